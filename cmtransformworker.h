@@ -3,7 +3,10 @@
 
 //////////////  Conversion Worker Thread - ///////////////
 // A subclass of the generic worker thread which has a
-// thread-specific TransformFactory, to dodge LCMS's thread safety issues.
+// thread-specific TransformFactory.  The factory itself isn't thread-safe,
+// but the transforms it hands out are shared with every other factory
+// through the ProfileManager's registry, so workers don't each build their
+// own copies.
 
 
 class CMTransformWorker : public Worker
@@ -689,7 +689,6 @@ void ExportTiff_Dialog(GtkWindow *parent,PhotoPrint_State &state)
 		
 						RangeParser rp(pagerange,state.layout->GetPages());
 						int p;
-						CMTransformFactory *factory=state.profilemanager.GetTransformFactory();
 						while((p=rp.Next()))
 						{
 							Debug[TRACE] << "Exporting page " << p << " of " <<  state.layout->GetPages() << endl;
@@ -701,7 +700,7 @@ void ExportTiff_Dialog(GtkWindow *parent,PhotoPrint_State &state)
 								ftmp=strdup(outputfilename);
 							Debug[TRACE] << ftmp << endl;
 
-							ImageSource *is=state.layout->GetImageSource(p-1,CM_COLOURDEVICE_EXPORT,factory,res,true);
+							ImageSource *is=state.layout->GetParallelImageSource(p-1,CM_COLOURDEVICE_EXPORT,res,true);
 							if(is)
 							{
 								ProgressBar p(_("Exporting..."),true,GTK_WIDGET(parent));
@@ -722,7 +721,6 @@ void ExportTiff_Dialog(GtkWindow *parent,PhotoPrint_State &state)
 							
 							free(ftmp);
 						}
-						delete factory;
 						g_free(outputfilename);
 						outputfilename=NULL;
 						done=true;
@@ -873,7 +871,6 @@ void ExportJPEG_Dialog(GtkWindow *parent,PhotoPrint_State &state)
 		
 						RangeParser rp(pagerange,state.layout->GetPages());
 						int p;
-						CMTransformFactory *factory=state.profilemanager.GetTransformFactory();
 						while((p=rp.Next()))
 						{
 							Debug[TRACE] << "Exporting page " << p << " of " <<  state.layout->GetPages() << endl;
@@ -885,7 +882,7 @@ void ExportJPEG_Dialog(GtkWindow *parent,PhotoPrint_State &state)
 								ftmp=strdup(outputfilename);
 							Debug[TRACE] << ftmp << endl;
 
-							ImageSource *is=state.layout->GetImageSource(p-1,CM_COLOURDEVICE_EXPORT,factory,res,true);
+							ImageSource *is=state.layout->GetParallelImageSource(p-1,CM_COLOURDEVICE_EXPORT,res,true);
 							if(is)
 							{
 								ProgressBar p(_("Exporting..."),true,GTK_WIDGET(parent));
@@ -906,7 +903,6 @@ void ExportJPEG_Dialog(GtkWindow *parent,PhotoPrint_State &state)
 							
 							free(ftmp);
 						}
-						delete factory;
 						done=true;
 					}
 					else
@@ -29,6 +29,8 @@
 #include "../support/debug.h"
 #include "../support/util.h"
 #include "../support/md5.h"
+#include "../support/consumer_async.h"
+#include "../support/thread.h"
 #include "../miscwidgets/generaldialogs.h"
 
 #include "gprinter.h"
@@ -41,6 +43,15 @@
 
 #define USE16BITPRINTING
 
+#ifdef USE8BITPRINTING
+typedef unsigned char GPrinter_Sample;
+#else
+typedef unsigned short GPrinter_Sample;
+#endif
+
+// Number of converted rows which may be prepared ahead of Gutenprint.
+#define GPRINTER_RINGROWS 64
+
 using namespace std;
 
 
@@ -307,7 +318,176 @@ string GPrinter::get_extendedopts()
 }
 
 
-void GPrinter::Print(ImageSource *src,int xpos,int ypos,Consumer *cons)
+
+// Pulls rows from the source and converts them to Gutenprint's format on a
+// thread of its own, so the ImageSource chain keeps working while Gutenprint
+// dithers and writes out earlier rows.  Gutenprint requests rows in order,
+// and a row stays available until a later one is requested.
+
+class GPrinter_RowRing : public ThreadFunction
+{
+	public:
+	GPrinter_RowRing(GPrinter &header,int rowbytes);
+	~GPrinter_RowRing();
+	bool GetRow(int row,unsigned char *data);
+	const char *GetError();
+	int Entry(Thread &t);
+	protected:
+	GPrinter &header;
+	int rowbytes;
+	unsigned char *buffer;
+	int produced;	// Number of rows converted so far.
+	int released;	// Rows before this one have been consumed.
+	bool cancelled;
+	const char *error;
+	ThreadCondition cond;
+	Thread thread;
+};
+
+
+GPrinter_RowRing::GPrinter_RowRing(GPrinter &header,int rowbytes)
+	: ThreadFunction(), header(header), rowbytes(rowbytes), buffer(NULL), produced(0), released(0),
+	cancelled(false), error(NULL), thread(this)
+{
+	buffer=(unsigned char *)malloc(rowbytes*GPRINTER_RINGROWS);
+	if(!buffer)
+		throw "GPrinter: Out of memory";
+	thread.Start();
+}
+
+
+GPrinter_RowRing::~GPrinter_RowRing()
+{
+	cond.ObtainMutex();
+	cancelled=true;
+	cond.Broadcast();
+	cond.ReleaseMutex();
+
+	// The thread must be finished before the buffer and source are released.
+	if(!thread.TestFinished())
+		thread.WaitFinished();
+	free(buffer);
+}
+
+
+int GPrinter_RowRing::Entry(Thread &t)
+{
+	for(int row=0;row<header.pixelheight;++row)
+	{
+		// Wait for Gutenprint to finish with the row previously held in this slot.
+		cond.ObtainMutex();
+		while(row>=released+GPRINTER_RINGROWS && !cancelled)
+			cond.WaitCondition();
+		bool stop=cancelled;
+		cond.ReleaseMutex();
+		if(stop)
+			return(0);
+
+		const char *err=NULL;
+		try
+		{
+			if(!header.ConvertRow(row,buffer+(row%GPRINTER_RINGROWS)*rowbytes))
+				err="Only RGB and CMYK images are currently supported!";
+		}
+		catch(const char *e)
+		{
+			err=e;
+		}
+		catch(...)
+		{
+			err="GPrinter: rendering failed";
+		}
+
+		cond.ObtainMutex();
+		if(err)
+			error=err;
+		else
+			produced=row+1;
+		cond.Broadcast();
+		cond.ReleaseMutex();
+
+		if(err)
+		{
+			Debug[ERROR] << "GPrinter - rendering failed: " << err << endl;
+			return(-1);
+		}
+	}
+	return(0);
+}
+
+
+bool GPrinter_RowRing::GetRow(int row,unsigned char *data)
+{
+	cond.ObtainMutex();
+	if(row<released && !error)
+		error="GPrinter: rows must be requested in order";
+	if(row>released)
+	{
+		released=row;
+		cond.Broadcast();
+	}
+	while(produced<=row && !error)
+		cond.WaitCondition();
+	bool ok=(error==NULL);
+	cond.ReleaseMutex();
+
+	// The slot can't be reused until a later row is requested.
+	if(ok)
+		memcpy(data,buffer+(row%GPRINTER_RINGROWS)*rowbytes,rowbytes);
+	return(ok);
+}
+
+
+const char *GPrinter_RowRing::GetError()
+{
+	cond.ObtainMutex();
+	const char *result=error;
+	cond.ReleaseMutex();
+	return(result);
+}
+
+
+// Passes the print data on to another Consumer, keeping a copy in a file for
+// GPrinter::Replay().  Failing to write the copy doesn't affect the print, but
+// clears the recorded flag so the copy won't be used.
+
+class GPrinter_Recorder : public Consumer
+{
+	public:
+	GPrinter_Recorder(Consumer *target,const char *filename,bool &recorded)
+		: Consumer(), target(target), file(NULL), recorded(recorded)
+	{
+		file=fopen(filename,"wb");
+		recorded=(file!=NULL);
+	}
+	virtual ~GPrinter_Recorder()
+	{
+		if(file && fclose(file)!=0)
+			recorded=false;
+		delete target;
+	}
+	virtual bool Write(const char *buffer,int length)
+	{
+		if(recorded && fwrite(buffer,1,length,file)!=size_t(length))
+		{
+			Debug[WARN] << "GPrinter: Unable to keep print data for replay" << endl;
+			recorded=false;
+		}
+		return(target->Write(buffer,length));
+	}
+	virtual void Cancel()
+	{
+		recorded=false;
+		target->Cancel();
+	}
+	protected:
+	Consumer *target;
+	FILE *file;
+	bool &recorded;
+};
+
+
+void GPrinter::Print(ImageSource *src,int xpos,int ypos,Consumer *cons,const char *replaykey)
 {
 	Debug[TRACE] << "*** GPrinter: Printing at position: " << xpos << ", " << ypos << endl;
 
@@ -366,8 +546,23 @@ void GPrinter::Print(ImageSource *src,int xpos,int ypos,Consumer *cons)
 
 	string extendedopts=get_extendedopts();
 
+	TempFile *replayfile=NULL;
+	bool recorded=false;
 	if(!(consumer=cons))
-		consumer=output.GetConsumer(extendedopts.c_str());
+	{
+		// The spooler is fed in large blocks from a thread of its own, so
+		// Gutenprint isn't held up whenever the spooler is busy.  Any copy for
+		// replay is written from the same thread.
+		if((consumer=output.GetConsumer(extendedopts.c_str())))
+		{
+			if(replaykey)
+			{
+				replayfile=replays.GetTempFile("PPRPL",replaykey);
+				consumer=new GPrinter_Recorder(consumer,replayfile->Filename(),recorded);
+			}
+			consumer=new Consumer_Async(consumer);
+		}
+	}
 
 	if(!consumer)
 		return;
@@ -387,14 +582,26 @@ void GPrinter::Print(ImageSource *src,int xpos,int ypos,Consumer *cons)
 	result&=stp_verify(tmpvars);
 	if(result)
 	{
+		// Rows are rendered ahead on another thread while Gutenprint works.
+		ring=new GPrinter_RowRing(*this,pixelwidth*source->samplesperpixel*sizeof(GPrinter_Sample));
 		result&=stp_print(tmpvars, &stpImage);
-		error=NULL;
+		error=ring->GetError();
+		delete ring;
+		ring=NULL;
 	}
 
 	stp_vars_destroy(tmpvars);
 
 	if(!cons)
+	{
+		if(!consumer->Flush())
+			writeerror=true;
 		delete consumer;
+	}
+
+	// An incomplete copy must never be replayed.
+	if(replayfile && (!result || writeerror || !recorded))
+		delete replayfile;
 	
 	if(result==0 && error)
 		throw error;
@@ -404,6 +611,77 @@ void GPrinter::Print(ImageSource *src,int xpos,int ypos,Consumer *cons)
 }
 
 
+// Copies the kept output to a new job in blocks, since it's already in the
+// printer's own format.
+
+#define GPRINTER_REPLAYBLOCK (256*1024)
+
+bool GPrinter::Replay(const char *replaykey)
+{
+	TempFile *replayfile=replays.FindTempFile(replaykey);
+	if(!replayfile)
+		return(false);
+
+	FILE *file=fopen(replayfile->Filename(),"rb");
+	if(!file)
+		return(false);
+
+	Debug[TRACE] << "*** GPrinter: Replaying page from " << replayfile->Filename() << endl;
+
+	fseek(file,0,SEEK_END);
+	long total=ftell(file);
+	fseek(file,0,SEEK_SET);
+
+	Consumer *cons=output.GetConsumer(get_extendedopts().c_str());
+	if(!cons)
+	{
+		fclose(file);
+		return(true);
+	}
+
+	char *buffer=(char *)malloc(GPRINTER_REPLAYBLOCK);
+	const char *error=NULL;
+	long done=0;
+	size_t length;
+	while((length=fread(buffer,1,GPRINTER_REPLAYBLOCK,file))>0)
+	{
+		if(progress && !(progress->DoProgress(done,total)))
+		{
+			cons->Cancel();
+			break;
+		}
+		if(!cons->Write(buffer,length))
+		{
+			error="Write error: check your print command";
+			break;
+		}
+		done+=length;
+	}
+	if(!error && ferror(file))
+	{
+		cons->Cancel();
+		error="Unable to read print data kept for replay";
+	}
+
+	free(buffer);
+	fclose(file);
+	delete cons;
+
+	if(error)
+		throw error;
+
+	return(true);
+}
+
+
+void GPrinter::ClearReplays()
+{
+	TempFile *t;
+	while((t=replays.FirstTempFile()))
+		delete t;
+}
+
+
 // Deal with borderless mode by adding the bleed area to the media size
 // and reducing the negative margins to zero.
 
@@ -564,7 +842,7 @@ void GPrinter::SetCustomHeight(int h)
 
 
 GPrinter::GPrinter(PrintOutput &output,ConfigFile *ini,const char *section)
-	: GPrinterSettings(output,ini,section), source(NULL), firstrow(0), firstpixel(0), progress(NULL)
+	: GPrinterSettings(output,ini,section), source(NULL), ring(NULL), firstrow(0), firstpixel(0), progress(NULL)
 {
 	stpImage.rep=this;
 	staticinitializer=&gpstaticinitializer;
@@ -609,16 +887,6 @@ stp_image_status_t GPrinter::GetRowStub(struct stp_image *image, unsigned char *
 stp_image_status_t GPrinter::GetRow(int row,unsigned char *data)
 {
 	stp_image_status_t result=STP_IMAGE_STATUS_OK;
-	ISDataType *src;
-#ifdef USE8BITPRINTING
-	unsigned char *dst=(unsigned char *)data;
-#else
-	unsigned short *dst=(unsigned short *)data;
-#endif
-	int i;
-
-	src=source->GetRow(row+firstrow);
-	src+=(source->samplesperpixel*firstpixel);
 
 	if(progress && !(row&31))
 	{
@@ -628,31 +896,72 @@ stp_image_status_t GPrinter::GetRow(int row,unsigned char *data)
 			consumer->Cancel();
 		}
 	}
-	
+
+	if(!ring->GetRow(row,data))
+		result=STP_IMAGE_STATUS_ABORT;
+
+	if(writeerror)
+		result=STP_IMAGE_STATUS_ABORT;
+
+	return result;
+}
+
+
+// Converts a row of the source to Gutenprint's format.  Called from the
+// ring's render thread.
+
+bool GPrinter::ConvertRow(int row,unsigned char *data)
+{
+	ISDataType *src;
+	GPrinter_Sample *dst=(GPrinter_Sample *)data;
+	int i,x,spp;
+
+	src=source->GetRow(row+firstrow);
+	src+=(source->samplesperpixel*firstpixel);
+
 	switch(source->type)
 	{
 		case IS_TYPE_RGB:
 		case IS_TYPE_CMYK:
 		case IS_TYPE_DEVICEN:
-			for(i=0;i<pixelwidth*source->samplesperpixel;++i)
+			// Blank areas of the page are reported as uniform runs, which need
+			// only have their first pixel converted.
+			spp=source->samplesperpixel;
+			x=0;
+			while(x<pixelwidth)
 			{
+				int run=source->GetUniformRun(row+firstrow,x+firstpixel);
+				int count=(run>0) ? 1 : (run<0 ? -run : pixelwidth-x);
+				if(run>(pixelwidth-x))
+					run=pixelwidth-x;
+				if(count>(pixelwidth-x))
+					count=pixelwidth-x;
+				for(i=0;i<count*spp;++i)
+				{
 #ifdef USE8BITPRINTING
-				ISDataType t=*src++;
-				*dst++=ISTOEIGHT(t);
+					ISDataType t=*src++;
+					*dst++=ISTOEIGHT(t);
 #else
-				*dst++=*src++;
+					*dst++=*src++;
 #endif
+				}
+				if(run>1)
+				{
+					for(i=0;i<(run-1)*spp;++i)
+					{
+						*dst=dst[-spp];
+						++dst;
+					}
+					src+=(run-1)*spp;
+					count=run;
+				}
+				x+=count;
 			}
 			break;
 		default:
-			result=STP_IMAGE_STATUS_ABORT;
-			break;
+			return(false);
 	}
-
-	if(writeerror)
-		result=STP_IMAGE_STATUS_ABORT;
-
-	return result;
+	return(true);
 }
 
 const char *GPrinter::Image_get_appname(struct stp_image *image)
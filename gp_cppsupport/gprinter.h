@@ -17,19 +17,27 @@
 #include "support/consumer.h"
 #include "printoutput.h"
 #include "support/progress.h"
+#include "support/tempfile.h"
 #include <gutenprint/gutenprint.h>
 
 #include "gprintersettings.h"
 
 
 class ImageSource; // Forward Declaration
+class GPrinter_RowRing;
 
 class GPrinter : public GPrinterSettings
 {
 	public:
 	GPrinter(PrintOutput &output,ConfigFile *inf,const char *section);
 	~GPrinter();
-	void Print(ImageSource *source,int xpos,int ypos,Consumer *consumer=NULL);
+	// If replaykey is given, a copy of the driver's output is kept so the page can be
+	// sent again with Replay().
+	void Print(ImageSource *source,int xpos,int ypos,Consumer *consumer=NULL,const char *replaykey=NULL);
+	// Sends the output kept by an earlier Print() to the printer again as a new page.
+	// Returns false if no output was kept under replaykey.
+	bool Replay(const char *replaykey);
+	void ClearReplays();
 	void Help();
 	void SetProgress(Progress *p);
 	void GetImageableArea();
@@ -39,6 +47,7 @@ class GPrinter : public GPrinterSettings
 	std::string GetResponseHash(Progress *p=NULL);
 	protected:
 	stp_image_status_t GetRow(int row,unsigned char *data);
+	bool ConvertRow(int row,unsigned char *data);
 
 	std::string get_extendedopts();
 	void get_dimensions();
@@ -47,6 +56,7 @@ class GPrinter : public GPrinterSettings
 
 	ImageSource *source;
 	Consumer *consumer;
+	GPrinter_RowRing *ring;	// Renders rows ahead of Gutenprint while printing.
 	
 	int xpos,ypos;
 
@@ -73,6 +83,8 @@ class GPrinter : public GPrinterSettings
 
 	Progress *progress;
 
+	TempFileTracker replays;	// Driver output kept for Replay().
+
 	/* Static members and stubs */
 	static stp_image_t stpImage;
 	static bool writeerror;
@@ -85,6 +97,7 @@ class GPrinter : public GPrinterSettings
 	static const char *Image_get_appname(struct stp_image *image);
 
 	void *staticinitializer;
+	friend class GPrinter_RowRing;
 };
 
 
@@ -1,11 +1,12 @@
 #include <iostream>
+#include <string.h>
 
 #include "lcmswrapper.h"
 #include "imagesource.h"
 
 using namespace std;
 
-ImageSource::ImageSource() : embeddedprofile(NULL), embprofowned(false), rowbuffer(NULL)
+ImageSource::ImageSource() : embeddedprofile(NULL), embprofowned(false), rowbuffer(NULL), stripbuffer(NULL), stripbuffersize(0)
 {
 	type=IS_TYPE_RGB;
 	samplesperpixel=3;
@@ -17,7 +18,7 @@ ImageSource::ImageSource() : embeddedprofile(NULL), embprofowned(false), rowbuff
 
 
 ImageSource::ImageSource(int width, int height, IS_TYPE type)
-	: width(width), height(height), type(type), embeddedprofile(NULL), embprofowned(false), rowbuffer(NULL)
+	: width(width), height(height), type(type), embeddedprofile(NULL), embprofowned(false), rowbuffer(NULL), stripbuffer(NULL), stripbuffersize(0)
 {
 	switch(type)
 	{
@@ -50,7 +51,7 @@ ImageSource::ImageSource(int width, int height, IS_TYPE type)
 }
 
 
-ImageSource::ImageSource(ImageSource *src) : embprofowned(false), rowbuffer(NULL)
+ImageSource::ImageSource(ImageSource *src) : embprofowned(false), rowbuffer(NULL), stripbuffer(NULL), stripbuffersize(0)
 {
 	width=src->width;
 	height=src->height;
@@ -68,6 +69,8 @@ ImageSource::~ImageSource()
 {
 	if(rowbuffer)
 		free(rowbuffer);
+	if(stripbuffer)
+		free(stripbuffer);
 	if(embeddedprofile && embprofowned)
 		delete embeddedprofile;
 }
@@ -80,6 +83,57 @@ void ImageSource::MakeRowBuffer()
 }
 
 
+// Ensures the strip buffer can hold the requested number of rows at the
+// current width.  (The width of some sources, such as Montage, can change
+// after construction, so this is checked on every call.)
+
+void ImageSource::MakeStripBuffer(int rows)
+{
+	int size=width*samplesperpixel*rows;
+	if(size>stripbuffersize)
+	{
+		if(stripbuffer)
+			free(stripbuffer);
+		stripbuffer=(ISDataType *)malloc(sizeof(ISDataType)*size);
+		stripbuffersize=size;
+	}
+}
+
+
+bool ImageSource::SetROI(int x,int y,int w,int h)
+{
+	return(false);
+}
+
+
+void ImageSource::SkipToRow(int row)
+{
+	if(randomaccess)
+		return;
+	for(int i=currentrow+1;i<row;++i)
+		GetRow(i);
+}
+
+
+int ImageSource::GetUniformRun(int row,int x)
+{
+	return(x-width);
+}
+
+
+ISDataType *ImageSource::GetRows(int row,int count)
+{
+	if(count==1)
+		return(GetRow(row));
+
+	MakeStripBuffer(count);
+	int samplesperrow=width*samplesperpixel;
+	for(int i=0;i<count;++i)
+		memcpy(stripbuffer+i*samplesperrow,GetRow(row+i),sizeof(ISDataType)*samplesperrow);
+	return(stripbuffer);
+}
+
+
 void ImageSource::SetResolution(double xr,double yr)
 {
 	xres=xr;
@@ -25,6 +25,32 @@ class ImageSource
 	ImageSource(ImageSource *src);
 	virtual ~ImageSource();
 	virtual ISDataType *GetRow(int row)=0;
+	// Returns count consecutive rows starting at row, packed contiguously
+	// (width*samplesperpixel samples per row).  The pointer is only valid
+	// until the next call to GetRow() or GetRows().  The default implementation
+	// assembles the strip from GetRow(); filters override it where they can
+	// process a block of rows more efficiently than one at a time.
+	virtual ISDataType *GetRows(int row,int count);
+	// Region of interest negotiation.  Asks the source to supply only the given
+	// window of its image, which then becomes the whole of its image, with width
+	// and height set accordingly.  Filters which can work out which part of their
+	// own source the window depends upon pass the request on upstream, so pixels
+	// which would be cropped away are never loaded or processed.
+	// Returns false if the source can't do this, in which case it's unchanged.
+	// Must be called before any rows are read.  (See also ISCropImage().)
+	virtual bool SetROI(int x,int y,int w,int h);
+	// Tells the source that no rows before the given row will be requested.
+	// Sequential loaders which can seek, or skip rows more cheaply than decoding
+	// them, override this; the default reads through the intervening rows
+	// unless the source supports random access.
+	virtual void SkipToRow(int row);
+	// Describes the runs of identical pixels in a row, so that per-pixel stages
+	// can process a blank area once and repeat the result.  Returns a positive
+	// count if that many pixels, starting at x, are known to be identical to
+	// pixel x, or else minus the number of pixels before the next such run.
+	// Only valid for rows returned by the most recent GetRow() or GetRows()
+	// call.  The default knows of no runs, and returns -(width-x).
+	virtual int GetUniformRun(int row,int x);
 	void MakeRowBuffer();
 	void SetResolution(double xr,double yr);
 	inline CMSProfile *GetEmbeddedProfile()	// Inlined to avoid link order problems
@@ -42,7 +68,13 @@ class ImageSource
 	bool embprofowned;
 	int currentrow;
 	ISDataType *rowbuffer;
+	void MakeStripBuffer(int rows);
+	ISDataType *stripbuffer;
+	int stripbuffersize;
 };
 
+// Default number of rows a consumer should request from GetRows().
+#define IS_STRIPROWS 16
+
 
 #endif
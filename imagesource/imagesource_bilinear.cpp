@@ -17,6 +17,7 @@
 #include <math.h>
 
 #include "imagesource_bilinear.h"
+#include "imagesource_crop.h"
 
 using namespace std;
 
@@ -69,16 +70,16 @@ ISDataType *ImageSource_HBilinear::GetRow(int row)
 
 	for(i=0;i<width;++i)
 	{
-		int x1=(i*source->width)/width;
+		int x1=((i+xorigin)*srcwidth)/fullwidth;
 		int x2=x1+1;
-		if(x2 >= source->width)
+		if(x2 >= srcwidth)
 			x2=x1;
-		float xfactor=(i*source->width);
-		xfactor/=width;
+		float xfactor=((i+xorigin)*srcwidth);
+		xfactor/=fullwidth;
 		xfactor-=x1;
 
-		x1*=samplesperpixel;
-		x2*=samplesperpixel;
+		x1=(x1-srcxorigin)*samplesperpixel;
+		x2=(x2-srcxorigin)*samplesperpixel;
 
 		for(int s=0;s<samplesperpixel;++s)
 		{
@@ -97,8 +98,28 @@ ISDataType *ImageSource_HBilinear::GetRow(int row)
 }
 
 
+// The window needs the source pixels from the left neighbour of its first
+// pixel to the right neighbour of its last.
+
+bool ImageSource_HBilinear::SetROI(int x,int y,int w,int h)
+{
+	x+=xorigin;
+	int first=(x*srcwidth)/fullwidth;
+	int last=((x+w-1)*srcwidth)/fullwidth+1;
+	if(last>=srcwidth)
+		last=srcwidth-1;
+	source=ISCropImage(source,first-srcxorigin,y,last-first+1,h);
+	xorigin=x;
+	srcxorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+	return(true);
+}
+
+
 ImageSource_HBilinear::ImageSource_HBilinear(struct ImageSource *source,int width)
-	: ImageSource(source), source(source)
+	: ImageSource(source), source(source), fullwidth(width), srcwidth(source->width), xorigin(0), srcxorigin(0)
 {
 	this->width=width;
 	xres=(source->xres*width); xres/=source->width;
@@ -127,9 +148,9 @@ ISDataType *ImageSource_VBilinear::GetRow(int row)
 	if(row==currentrow)
 		return(rowbuffer);
 
-	int srow1=(row*source->height)/height;
+	int srow1=((row+yorigin)*srcheight)/fullheight;
 	int srow2=srow1+1;
-	if(srow2>=source->height)
+	if(srow2>=srcheight)
 		srow2=srow1;
 
 	ISDataType *src1,*src2;
@@ -140,17 +161,17 @@ ISDataType *ImageSource_VBilinear::GetRow(int row)
 	}
 	else
 	{
-		src1=source->GetRow(srow1);
+		src1=source->GetRow(srow1-srcyorigin);
 		for(int i=0;i<source->width*source->samplesperpixel;++i)
 			lastrow[i]=src1[i];
 		cachedrow=srow1;
 		src1=lastrow;
 	}
 
-	src2=source->GetRow(srow2);
+	src2=source->GetRow(srow2-srcyorigin);
 
-	double yfactor=row*source->height;
-	yfactor/=height;
+	double yfactor=(row+yorigin)*srcheight;
+	yfactor/=fullheight;
 	yfactor-=srow1;
 
 	for(i=0;i<width*samplesperpixel;++i)
@@ -169,8 +190,27 @@ ISDataType *ImageSource_VBilinear::GetRow(int row)
 }
 
 
+bool ImageSource_VBilinear::SetROI(int x,int y,int w,int h)
+{
+	y+=yorigin;
+	int first=(y*srcheight)/fullheight;
+	int last=((y+h-1)*srcheight)/fullheight+1;
+	if(last>=srcheight)
+		last=srcheight-1;
+	source=ISCropImage(source,x,first-srcyorigin,w,last-first+1);
+	yorigin=y;
+	srcyorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+	cachedrow=-1;
+	return(true);
+}
+
+
 ImageSource_VBilinear::ImageSource_VBilinear(struct ImageSource *source,int height)
-	: ImageSource(source), source(source), lastrow(NULL), cachedrow(-1)
+	: ImageSource(source), source(source), lastrow(NULL), cachedrow(-1), fullheight(height), srcheight(source->height),
+	yorigin(0), srcyorigin(0)
 {
 	this->height=height;
 	yres=(source->yres*height); yres/=source->height;
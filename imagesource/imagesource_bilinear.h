@@ -37,8 +37,12 @@ class ImageSource_HBilinear : public ImageSource
 	ImageSource_HBilinear(ImageSource *source,int dstwidth);
 	~ImageSource_HBilinear();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	protected:
 	ImageSource *source;
+	// Full image sizes, and the origins of any region of interest.
+	int fullwidth,srcwidth;
+	int xorigin,srcxorigin;
 };
 
 
@@ -48,10 +52,13 @@ class ImageSource_VBilinear : public ImageSource
 	ImageSource_VBilinear(ImageSource *source,int dstheight);
 	~ImageSource_VBilinear();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	protected:
 	ImageSource *source;
 	ISDataType *lastrow;
 	int cachedrow;
+	int fullheight,srcheight;
+	int yorigin,srcyorigin;
 };
 
 #endif
@@ -17,13 +17,22 @@
 #include "../support/debug.h"
 
 #include "imagesource_cms.h"
+#include "imagesource_crop.h"
 
 using namespace std;
 
+// Samples are passed to the transform as they are, which relies on
+// ISDataType sharing LittleCMS' 16-bit range.
+#if IS_SAMPLEMAX!=65535
+#error "ImageSource_CMS requires IS_SAMPLEMAX to be 65535"
+#endif
+
 ImageSource_CMS::~ImageSource_CMS()
 {
-	free(tmp1);
-	free(tmp2);
+	if(tmp1)
+		free(tmp1);
+	if(tmp2)
+		free(tmp2);
 
 	if(source)
 		delete source;
@@ -33,41 +42,135 @@ ImageSource_CMS::~ImageSource_CMS()
 }
 
 
-ISDataType *ImageSource_CMS::GetRow(int row)
+// Each output pixel depends only on the corresponding source pixel, so the window is passed straight on.
+
+bool ImageSource_CMS::SetROI(int x,int y,int w,int h)
 {
-	ISDataType *src;
+	source=ISCropImage(source,x,y,w,h);
+	width=source->width;
+	height=source->height;
+	currentrow=-1;
+	return(true);
+}
+
 
+ISDataType *ImageSource_CMS::GetRow(int row)
+{
 	if(row==currentrow)
 		return(rowbuffer);
 
-	src=source->GetRow(row);
+	TransformRows(row,source->GetRow(row),rowbuffer,1);
+
+	currentrow=row;
+	return(rowbuffer);
+}
+
+
+// Transforms a whole strip with a single call to the CMS engine, which
+// amortises lcms' per-call overhead over several rows.
+
+ISDataType *ImageSource_CMS::GetRows(int row,int count)
+{
+	ISDataType *src=source->GetRows(row,count);
+	MakeStripBuffer(count);
+	TransformRows(row,src,stripbuffer,count);
+	return(stripbuffer);
+}
+
+
+// A colour transform is per-pixel, so the source's runs are unchanged.
+
+int ImageSource_CMS::GetUniformRun(int row,int x)
+{
+	return(source->GetUniformRun(row,x));
+}
+
+
+// Unless the source reports uniform runs, the whole strip is transformed in
+// one go.  Otherwise each uniform run, such as a page's blank margins, is
+// transformed just once and the result repeated along the run.
+
+void ImageSource_CMS::TransformRows(int row,ISDataType *src,ISDataType *dst,int rows)
+{
+	bool haveruns=false;
+	for(int r=0;r<rows && !haveruns;++r)
+		haveruns=(source->GetUniformRun(row+r,0)!=-width);
+
+	if(!haveruns)
+	{
+		TransformPixels(src,dst,width*rows);
+		return;
+	}
+
+	for(int r=0;r<rows;++r)
+	{
+		int x=0;
+		while(x<width)
+		{
+			ISDataType *s=src+(r*width+x)*source->samplesperpixel;
+			ISDataType *d=dst+(r*width+x)*samplesperpixel;
+			int run=source->GetUniformRun(row+r,x);
+			if(run>1)
+			{
+				TransformPixels(s,d,1);
+				for(int i=samplesperpixel;i<run*samplesperpixel;++i)
+					d[i]=d[i-samplesperpixel];
+			}
+			else
+			{
+				run=(run==0) ? width-x : (run<0 ? -run : run);
+				TransformPixels(s,d,run);
+			}
+			x+=run;
+		}
+	}
+}
+
+
+// ISDataType and LittleCMS' 16-bit samples share the same range, so when
+// neither image has an alpha channel the transform reads straight from the
+// source's buffer and writes straight into ours, with no intermediate copies.
+
+void ImageSource_CMS::TransformPixels(ISDataType *src,ISDataType *dst,int pixels)
+{
+	if(!HAS_ALPHA(source->type))
+	{
+		transform->Transform(src,dst,pixels);
+		return;
+	}
+
+	MakeTempBuffers(pixels);
 
 	// Copy just the colour data from src to tmp1, ignoring alpha
-	// (FIXME: separate code-path for the non-alpha case would be quicker)
-	for(int i=0;i<width;++i)
+	for(int i=0;i<pixels;++i)
 	{
 		for(int j=0;j<tmpsourcespp;++j)
-			tmp1[i*tmpsourcespp+j]=(65535*src[i*source->samplesperpixel+j])/IS_SAMPLEMAX;
+			tmp1[i*tmpsourcespp+j]=src[i*source->samplesperpixel+j];
 	}
 
-	transform->Transform(tmp1,tmp2,width);
+	transform->Transform(tmp1,tmp2,pixels);
 
-	// Copy just the colour data from tmp2 to rowbuffer, ignoring alpha.
-	for(int i=0;i<width;++i)
+	// Copy the colour data from tmp2 to dst, and the alpha channel unchanged from src.
+	for(int i=0;i<pixels;++i)
 	{
 		for(int j=0;j<tmpdestspp;++j)
-			rowbuffer[i*samplesperpixel+j]=(IS_SAMPLEMAX*tmp2[i*tmpdestspp+j])/65535;
+			dst[i*samplesperpixel+j]=tmp2[i*tmpdestspp+j];
+		dst[(i+1)*samplesperpixel-1]=src[(i+1)*source->samplesperpixel-1];
 	}
+}
 
-	// Copy alpha channel unchanged if present
-	if(HAS_ALPHA(source->type))
-	{
-		for(int i=0;i<width;++i)
-			rowbuffer[(i+1)*samplesperpixel-1]=src[(i+1)*source->samplesperpixel-1];
-	}
 
-	currentrow=row;
-	return(rowbuffer);
+void ImageSource_CMS::MakeTempBuffers(int pixels)
+{
+	if(pixels<=tmppixels)
+		return;
+	if(tmp1)
+		free(tmp1);
+	if(tmp2)
+		free(tmp2);
+	tmp1=(unsigned short *)malloc(sizeof(unsigned short)*pixels*tmpsourcespp);
+	tmp2=(unsigned short *)malloc(sizeof(unsigned short)*pixels*tmpdestspp);
+	tmppixels=pixels;
 }
 
 #if 0
@@ -146,8 +249,10 @@ void ImageSource_CMS::Init()
 		type=IS_TYPE(type | IS_TYPE_ALPHA);
 	}
 
-	tmp1=(unsigned short *)malloc(sizeof(unsigned short)*width*source->samplesperpixel);
-	tmp2=(unsigned short *)malloc(sizeof(unsigned short)*width*samplesperpixel);
+	// The temporary buffers are only needed for images with alpha,
+	// and are allocated on first use.
+	tmppixels=0;
+	tmp1=tmp2=NULL;
 
 //	Debug[TRACE] << "tmpsourcespp: " << tmpsourcespp << endl;
 //	Debug[TRACE] << "tmpdestspp: " << tmpdestspp << endl;
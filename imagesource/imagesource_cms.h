@@ -25,13 +25,20 @@ class ImageSource_CMS : public ImageSource
 	ImageSource_CMS(ImageSource *source,CMSTransform *transform);
 	virtual ~ImageSource_CMS();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
+	ISDataType *GetRows(int row,int count);
+	int GetUniformRun(int row,int x);
 	private:
 	void Init();
+	void MakeTempBuffers(int pixels);
+	void TransformRows(int row,ISDataType *src,ISDataType *dst,int rows);
+	void TransformPixels(ISDataType *src,ISDataType *dst,int pixels);
 	ImageSource *source;
 	CMSTransform *transform;
 	bool disposetransform;
 	int tmpsourcespp;
 	int tmpdestspp;
+	int tmppixels;
 	unsigned short *tmp1;
 	unsigned short *tmp2;
 };
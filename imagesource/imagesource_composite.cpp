@@ -0,0 +1,198 @@
+/*
+ * imagesource_composite.cpp - alpha compositing inner loops shared by
+ * ImageSource_Montage, ImageSource_Flatten and ImageSource_Mask.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#include "../support/cpufeatures.h"
+
+#include "imagesource_composite.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// The multiply-shift division below is exact only for this range.
+#if IS_SAMPLEMAX!=65535
+#error "imagesource_composite requires IS_SAMPLEMAX to be 65535"
+#endif
+
+
+// Divides x, which mustn't exceed IS_SAMPLEMAX squared, by IS_SAMPLEMAX,
+// rounding down.  Products of two samples can exceed the range of int, so
+// the arithmetic is unsigned throughout.
+static inline unsigned int DivSampleMax(unsigned int x)
+{
+	return((x+1+(x>>16))>>16);
+}
+
+
+static inline ISDataType Blend(unsigned int d,unsigned int s,unsigned int a)
+{
+	return(DivSampleMax(d*(IS_SAMPLEMAX-a)+s*a));
+}
+
+
+static void CompositeRow_Scalar(ISDataType *dst,const ISDataType *src,int spp,bool dstalpha,int pixels)
+{
+	int dstspp=dstalpha ? spp : spp-1;
+	for(int i=0;i<pixels;++i)
+	{
+		unsigned int a=src[spp-1];
+		for(int j=0;j<spp-1;++j)
+			dst[j]=Blend(dst[j],src[j],a);
+		if(dstalpha && dst[spp-1]<a)
+			dst[spp-1]=a;
+		src+=spp;
+		dst+=dstspp;
+	}
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// Blends one RGBA source pixel, held as four 32-bit lanes, into four
+// destination samples.  The alpha lane of the result is the greater alpha.
+__attribute__((target("sse4.1")))
+static inline __m128i BlendPixel_SSE41(__m128i d,__m128i s)
+{
+	__m128i a=_mm_shuffle_epi32(s,0xff);
+	__m128i ia=_mm_sub_epi32(_mm_set1_epi32(IS_SAMPLEMAX),a);
+	__m128i x=_mm_add_epi32(_mm_mullo_epi32(d,ia),_mm_mullo_epi32(s,a));
+	x=_mm_add_epi32(x,_mm_add_epi32(_mm_set1_epi32(1),_mm_srli_epi32(x,16)));
+	x=_mm_srli_epi32(x,16);
+	return(_mm_blend_epi16(x,_mm_max_epi32(d,a),0xc0));
+}
+
+
+// One pixel at a time.  Without a destination alpha channel, the fourth
+// destination sample belongs to the next pixel, so is written back unchanged;
+// reading it means the last pixel must be left to the scalar code.
+
+__attribute__((target("sse4.1")))
+static void CompositeRow_SSE41(ISDataType *dst,const ISDataType *src,int spp,bool dstalpha,int pixels)
+{
+	if(spp!=4)
+	{
+		CompositeRow_Scalar(dst,src,spp,dstalpha,pixels);
+		return;
+	}
+	int dstspp=dstalpha ? 4 : 3;
+	int i=0;
+	for(;i<pixels-1;++i)
+	{
+		__m128i s=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(src+i*4)));
+		__m128i d=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(dst+i*dstspp)));
+		__m128i r=BlendPixel_SSE41(d,s);
+		if(!dstalpha)
+			r=_mm_blend_epi16(r,d,0xc0);
+		_mm_storel_epi64((__m128i *)(dst+i*dstspp),_mm_packus_epi32(r,r));
+	}
+	CompositeRow_Scalar(dst+i*dstspp,src+i*4,spp,dstalpha,pixels-i);
+}
+
+
+// Two pixels at a time.  Without a destination alpha channel the pixels'
+// six destination samples are spread across the two lanes, and the two
+// samples following them are written back unchanged.
+
+__attribute__((target("avx2")))
+static void CompositeRow_AVX2(ISDataType *dst,const ISDataType *src,int spp,bool dstalpha,int pixels)
+{
+	if(spp!=4)
+	{
+		CompositeRow_Scalar(dst,src,spp,dstalpha,pixels);
+		return;
+	}
+	__m256i max=_mm256_set1_epi32(IS_SAMPLEMAX);
+	__m256i one=_mm256_set1_epi32(1);
+	__m256i spread=_mm256_setr_epi32(0,1,2,3,3,4,5,6);
+	__m256i gather=_mm256_setr_epi32(0,1,2,4,5,6,6,7);
+	int dstspp=dstalpha ? 4 : 3;
+	int i=0;
+	for(;i<pixels-2;i+=2)
+	{
+		__m256i s=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src+i*4)));
+		__m256i orig=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(dst+i*dstspp)));
+		__m256i d=dstalpha ? orig : _mm256_permutevar8x32_epi32(orig,spread);
+		__m256i a=_mm256_shuffle_epi32(s,0xff);
+		__m256i ia=_mm256_sub_epi32(max,a);
+		__m256i x=_mm256_add_epi32(_mm256_mullo_epi32(d,ia),_mm256_mullo_epi32(s,a));
+		x=_mm256_add_epi32(x,_mm256_add_epi32(one,_mm256_srli_epi32(x,16)));
+		x=_mm256_srli_epi32(x,16);
+		if(dstalpha)
+			x=_mm256_blend_epi32(x,_mm256_max_epi32(d,a),0x88);
+		else
+			x=_mm256_blend_epi32(_mm256_permutevar8x32_epi32(x,gather),orig,0xc0);
+		// packus works within 128-bit lanes, so the result must be reordered.
+		__m256i r=_mm256_permute4x64_epi64(_mm256_packus_epi32(x,x),0xd8);
+		_mm_storeu_si128((__m128i *)(dst+i*dstspp),_mm256_castsi256_si128(r));
+	}
+	CompositeRow_Scalar(dst+i*dstspp,src+i*4,spp,dstalpha,pixels-i);
+}
+
+#endif
+
+
+struct ISComposite_Kernels
+{
+	ISComposite_Kernels();
+	void (*CompositeRow)(ISDataType *dst,const ISDataType *src,int spp,bool dstalpha,int pixels);
+};
+
+
+ISComposite_Kernels::ISComposite_Kernels() : CompositeRow(CompositeRow_Scalar)
+{
+#ifdef HAVE_X86_SIMD
+	int features=GetCPUFeatures();
+	if(features&CPUFEATURE_SSE41)
+		CompositeRow=CompositeRow_SSE41;
+	if(features&CPUFEATURE_AVX2)
+		CompositeRow=CompositeRow_AVX2;
+#endif
+}
+
+
+static ISComposite_Kernels &GetKernels()
+{
+	static ISComposite_Kernels kernels;
+	return(kernels);
+}
+
+
+void ISCompositeRow(ISDataType *dst,const ISDataType *src,int spp,bool dstalpha,int pixels)
+{
+	GetKernels().CompositeRow(dst,src,spp,dstalpha,pixels);
+}
+
+
+void ISFlattenRow(ISDataType *dst,const ISDataType *src,int spp,ISDataType background,int pixels)
+{
+	for(int i=0;i<pixels*(spp-1);++i)
+		dst[i]=background;
+	GetKernels().CompositeRow(dst,src,spp,false,pixels);
+}
+
+
+void ISMaskRow(ISDataType *dst,const ISDataType *src,int spp,bool srcalpha,const ISDataType *mask,int maskspp,int pixels)
+{
+	int colours=srcalpha ? spp-1 : spp;
+	for(int i=0;i<pixels;++i)
+	{
+		for(int j=0;j<colours;++j)
+			dst[j]=src[j];
+		if(srcalpha)
+			dst[colours]=DivSampleMax((unsigned int)src[colours]*mask[0]);
+		else
+			dst[colours]=mask[0];
+		src+=spp;
+		dst+=colours+1;
+		mask+=maskspp;
+	}
+}
@@ -0,0 +1,36 @@
+/*
+ * imagesource_composite.h - alpha compositing inner loops shared by
+ * ImageSource_Montage, ImageSource_Flatten and ImageSource_Mask.
+ *
+ * Alpha is always the last sample of a pixel, and isn't premultiplied.
+ * Results are exactly (dst*(IS_SAMPLEMAX-alpha)+src*alpha)/IS_SAMPLEMAX,
+ * with the division done by multiply and shift.  RGBA pixels have SSE4.1
+ * and AVX2 versions, selected at runtime if the CPU supports them.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#ifndef IMAGESOURCE_COMPOSITE_H
+#define IMAGESOURCE_COMPOSITE_H
+
+#include "imagesource.h"
+
+// Composites pixels of src, which have spp samples including alpha, over dst.
+// If dstalpha is set, dst has an alpha channel too, which becomes the greater
+// of the two alpha values; otherwise dst has spp-1 samples per pixel.
+void ISCompositeRow(ISDataType *dst,const ISDataType *src,int spp,bool dstalpha,int pixels);
+
+// Composites pixels of src, which have spp samples including alpha, over a
+// solid background with every sample set to background, writing spp-1 samples
+// per pixel to dst.
+void ISFlattenRow(ISDataType *dst,const ISDataType *src,int spp,ISDataType background,int pixels);
+
+// Copies the colour samples of src to dst, which has an alpha channel, setting
+// the alpha to the first sample of each mask pixel, multiplied by src's own
+// alpha if srcalpha is set.  (Src has spp samples per pixel including any alpha.)
+void ISMaskRow(ISDataType *dst,const ISDataType *src,int spp,bool srcalpha,const ISDataType *mask,int maskspp,int pixels);
+
+#endif
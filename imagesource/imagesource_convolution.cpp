@@ -25,6 +25,8 @@ using namespace std;
 
 // The row cache is just a simplistic ring-buffer type cache which handles
 // the details of tracking several rows of "support" data.
+// Source rows are fetched a strip at a time, to amortise the cost of the
+// upstream filter chain over IS_STRIPROWS rows.
 
 class ISConvolution_RowCache
 {
@@ -38,6 +40,9 @@ class ISConvolution_RowCache
 	int cachewidth,cachehoffset;
 	int bufferrows;
 	int currentrow;
+	ISDataType *strip;
+	int stripfirstrow;
+	int striprows;
 };
 
 
@@ -49,7 +54,7 @@ ISConvolution_RowCache::~ISConvolution_RowCache()
 
 
 ISConvolution_RowCache::ISConvolution_RowCache(ImageSource_Convolution *source)
-	: source(source), currentrow(-1)
+	: source(source), currentrow(-1), strip(NULL), stripfirstrow(0), striprows(0)
 {
 	cachewidth=source->width+source->hextra*2;
 	cachehoffset=source->hextra;
@@ -69,7 +74,15 @@ inline float *ISConvolution_RowCache::GetRow(int row)
 	if(row>currentrow)
 	{
 		currentrow=row;
-		ISDataType *src=source->source->GetRow(row);
+		if(row>=stripfirstrow+striprows)
+		{
+			stripfirstrow=row;
+			striprows=source->source->height-row;
+			if(striprows>IS_STRIPROWS)
+				striprows=IS_STRIPROWS;
+			strip=source->source->GetRows(stripfirstrow,striprows);
+		}
+		ISDataType *src=strip+(row-stripfirstrow)*source->samplesperpixel*source->width;
 		for(int x=0;x<cachewidth;++x)
 		{
 			int sx=x-cachehoffset;
@@ -102,6 +115,25 @@ ISDataType *ImageSource_Convolution::GetRow(int row)
 	if(row==currentrow)
 		return(rowbuffer);
 
+	ConvolveRow(row,rowbuffer);
+
+	currentrow=row;
+
+	return(rowbuffer);
+}
+
+
+ISDataType *ImageSource_Convolution::GetRows(int row,int count)
+{
+	MakeStripBuffer(count);
+	for(int i=0;i<count;++i)
+		ConvolveRow(row+i,stripbuffer+i*width*samplesperpixel);
+	return(stripbuffer);
+}
+
+
+void ImageSource_Convolution::ConvolveRow(int row,ISDataType *dst)
+{
 	int kw=kernel->GetWidth();
 	int kh=kernel->GetHeight();
 
@@ -128,13 +160,9 @@ ISDataType *ImageSource_Convolution::GetRow(int row)
 			float a=t[s];
 			if(a<0.0) a=0.0;
 			if(a>IS_SAMPLEMAX) a=IS_SAMPLEMAX;
-			rowbuffer[x*samplesperpixel+s]=ISDataType(a);
+			dst[x*samplesperpixel+s]=ISDataType(a);
 		}
 	}
-
-	currentrow=row;
-
-	return(rowbuffer);
 }
 
 
@@ -21,7 +21,9 @@ class ImageSource_Convolution : public ImageSource
 	ImageSource_Convolution(ImageSource *source,ConvKernel *kernel);
 	~ImageSource_Convolution();
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
 	protected:
+	void ConvolveRow(int row,ISDataType *dst);
 	ImageSource *source;
 	ConvKernel *kernel;
 	int hextra,vextra;
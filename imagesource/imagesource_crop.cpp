@@ -30,14 +30,9 @@ ISDataType *ImageSource_Crop::GetRow(int row)
 {
 	int i;
 
-	// If random access is not supported, we must loop through the unwanted rows.
-	if(row==0 && source->randomaccess==false)
-	{
-		for(int i=0;i<yoffset;++i)
-		{
-			source->GetRow(i);
-		}
-	}
+	// If random access is not supported, the source must skip the unwanted rows.
+	if(currentrow<0 && source->randomaccess==false)
+		source->SkipToRow(yoffset);
 
 	if(row==currentrow)
 		return(rowbuffer);
@@ -81,6 +76,73 @@ ISDataType *ImageSource_Crop::GetRow(int row)
 }
 
 
+// Crops compose - and since the window is now known, we can try passing it upstream.
+
+void ImageSource_Crop::SkipToRow(int row)
+{
+	source->SkipToRow(row+yoffset);
+}
+
+
+// The source's runs, clipped to the window.
+
+int ImageSource_Crop::GetUniformRun(int row,int x)
+{
+	int run=source->GetUniformRun(row+yoffset,x+xoffset);
+	if(run>(width-x))
+		run=width-x;
+	if(run<(x-width))
+		run=x-width;
+	return(run);
+}
+
+
+bool ImageSource_Crop::SetROI(int x,int y,int w,int h)
+{
+	xoffset+=x;
+	yoffset+=y;
+	width=w;
+	height=h;
+	if(width>(source->width-xoffset))
+		width=source->width-xoffset;
+	if(height>(source->height-yoffset))
+		height=source->height-yoffset;
+	if(source->SetROI(xoffset,yoffset,width,height))
+		xoffset=yoffset=0;
+	currentrow=-1;
+	return(true);
+}
+
+
+ImageSource *ISCropImage(ImageSource *source,int xoffset,int yoffset,int cropwidth,int cropheight)
+{
+	if(xoffset<0)
+	{
+		cropwidth+=xoffset;
+		xoffset=0;
+	}
+	if(yoffset<0)
+	{
+		cropheight+=yoffset;
+		yoffset=0;
+	}
+	if(cropwidth>(source->width-xoffset))
+		cropwidth=source->width-xoffset;
+	if(cropheight>(source->height-yoffset))
+		cropheight=source->height-yoffset;
+	if(cropwidth<1 || cropheight<1)
+		throw "ISCropImage: crop window lies outside the image";
+
+	if(xoffset==0 && yoffset==0 && cropwidth==source->width && cropheight==source->height)
+		return(source);
+
+	if(source->SetROI(xoffset,yoffset,cropwidth,cropheight))
+		return(source);
+
+	return(new ImageSource_Crop(source,xoffset,yoffset,cropwidth,cropheight));
+}
+
+
 ImageSource_Crop::ImageSource_Crop(struct ImageSource *source,int xoffset,int yoffset,int cropwidth,int cropheight)
 	: ImageSource(source), source(source), xoffset(xoffset), yoffset(yoffset)
 {
@@ -21,9 +21,18 @@ class ImageSource_Crop : public ImageSource
 	ImageSource_Crop(ImageSource *source,int xoffset,int yoffset,int cropwidth,int cropheight);
 	~ImageSource_Crop();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
+	void SkipToRow(int row);
+	int GetUniformRun(int row,int x);
 	private:
 	ImageSource *source;
 	int xoffset,yoffset;
 };
 
+
+// Crops an image, passing the crop upstream through the filter chain where
+// possible (see ImageSource::SetROI()), and falling back to an ImageSource_Crop
+// where not.  The window is clipped to the image's bounds.
+ImageSource *ISCropImage(ImageSource *source,int xoffset,int yoffset,int cropwidth,int cropheight);
+
 #endif
@@ -8,6 +8,7 @@
 
 #include "../support/debug.h"
 
+#include "imagesource_crop.h"
 #include "imagesource_downsample.h"
 
 using namespace std;
@@ -42,6 +43,41 @@ ImageSource_Downsample::ImageSource_Downsample(struct ImageSource *source,int wi
 }
 
 
+// Both filters step through the source with the same Bresenham-esque accumulator.
+// To start part way through, for a region of interest, we run the accumulator
+// through the preceding output pixels without touching any data.  This gives the
+// next source position, the accumulator's value, and the source position and
+// proportion which carry over into the next output pixel.  The furthest source
+// position touched is also tracked, so the source can be cropped to match.
+
+static void DownsampleStep(int srcsize,int dstsize,int steps,int &src,int &a,int &carrypos,double &carry,int &furthest)
+{
+	for(int i=0;i<steps;++i)
+	{
+		a+=dstsize;
+		while(a<srcsize)
+		{
+			if(src>=srcsize)
+				src=srcsize-1;
+			if(src>furthest)
+				furthest=src;
+			++src;
+			a+=dstsize;
+		}
+		double p=srcsize-(a-dstsize);
+		p/=dstsize;
+		a-=srcsize;
+		if(src>=srcsize)
+			src=srcsize-1;
+		if(src>furthest)
+			furthest=src;
+		carrypos=src;
+		carry=1.0-p;
+		++src;
+	}
+}
+
+
 // Horizontal downsampling
 
 
@@ -58,6 +94,8 @@ ISDataType *ImageSource_HDownsample::GetRow(int row)
 		return(rowbuffer);
 	currentrow=row;
 
+	ISDataType *srcdata=source->GetRow(row);
+
 	// We accumulate pixel values from a potentially
 	// large number of pixels and process all the samples
 	// in a pixel at one time.
@@ -65,61 +103,67 @@ ISDataType *ImageSource_HDownsample::GetRow(int row)
 	for(int i=0;i<samplesperpixel;++i)
 		tmp[i]=0;
 
-	ISDataType *srcdata=source->GetRow(row);
+	// If we're starting part way through the image, part of the
+	// previous source pixel counts towards the first output pixel.
+	if(carrypos>=0)
+	{
+		for(int i=0;i<samplesperpixel;++i)
+			tmp[i]=carry*srcdata[samplesperpixel*(carrypos-srcxorigin)+i];
+	}
 
 	// We use a Bresenham-esque method of calculating the
 	// pixel boundaries for scaling - add the smaller value
 	// to an accumulator until it exceeds the larger value,
 	// then subtract the larger value, leaving the remainder
 	// in place for the next round.
-	int a=0;
-	int src=0;
+	int a=starta;
+	int src=startsrc;
 	int dst=0;
 	while(dst<width)
 	{
 		// Add the smaller value (destination width)
-		a+=width;
+		a+=fullwidth;
 
 		// As long as the counter is less than the larger value
 		// (source width), we take full pixels.
-		while(a<source->width)
+		while(a<srcwidth)
 		{
-			if(src>=source->width)
-				src=source->width-1;
+			if(src>=srcwidth)
+				src=srcwidth-1;
 			for(int i=0;i<samplesperpixel;++i)
-				tmp[i]+=srcdata[samplesperpixel*src+i];
+				tmp[i]+=srcdata[samplesperpixel*(src-srcxorigin)+i];
 			++src;
-			a+=width;
+			a+=fullwidth;
 		}
 
-		double p=source->width-(a-width);
-		p/=width;
+		double p=srcwidth-(a-fullwidth);
+		p/=fullwidth;
 		// p now contains the proportion of the next pixel
 		// to be counted towards the output pixel.
 
-		a-=source->width;
+		a-=srcwidth;
 		// And a now contains the remainder,
 		// ready for the next round.
 
 		// So we add p * the new source pixel
 		// to the current output pixel...
-		if(src>=source->width)
-			src=source->width-1;
+		if(src>=srcwidth)
+			src=srcwidth-1;
 		for(int i=0;i<samplesperpixel;++i)
-			tmp[i]+=p*srcdata[samplesperpixel*src+i];
+			tmp[i]+=p*srcdata[samplesperpixel*(src-srcxorigin)+i];
 
 		// Store it...
 		for(int i=0;i<samplesperpixel;++i)
 		{
 			rowbuffer[samplesperpixel*dst+i] =
-				0.5+(tmp[i]*width)/source->width;
+				0.5+(tmp[i]*fullwidth)/srcwidth;
 		}
 		++dst;
 
 		// And start off the next output pixel with
 		// (1-p) * the source pixel.
 		for(int i=0;i<samplesperpixel;++i)
-			tmp[i]=(1.0-p)*srcdata[samplesperpixel*src+i];
+			tmp[i]=(1.0-p)*srcdata[samplesperpixel*(src-srcxorigin)+i];
 		++src;
 	}
 
@@ -127,8 +171,36 @@ ISDataType *ImageSource_HDownsample::GetRow(int row)
 }
 
 
+bool ImageSource_HDownsample::SetROI(int x,int y,int w,int h)
+{
+	// Find the state at the start of the window (relative to any window already set)...
+	int src=startsrc;
+	int a=starta;
+	int furthest=-1;
+	DownsampleStep(srcwidth,fullwidth,x,src,a,carrypos,carry,furthest);
+	int first=src;
+	if(carrypos>=0 && carrypos<first)
+		first=carrypos;
+
+	// ...and the furthest source pixel the window touches.
+	int s=src,t=a,cp=carrypos;
+	double c=carry;
+	DownsampleStep(srcwidth,fullwidth,w,s,t,cp,c,furthest);
+
+	source=ISCropImage(source,first-srcxorigin,y,furthest-first+1,h);
+	srcxorigin=first;
+	startsrc=src;
+	starta=a;
+	width=w;
+	height=h;
+	currentrow=-1;
+	return(true);
+}
+
+
 ImageSource_HDownsample::ImageSource_HDownsample(struct ImageSource *source,int width)
-	: ImageSource(source), source(source)
+	: ImageSource(source), source(source), fullwidth(width), srcwidth(source->width), srcxorigin(0),
+	startsrc(0), starta(0), carrypos(-1), carry(0.0)
 {
 	Debug[COMMENT] << "Using hdownsample filter" << endl;
 	this->width=width;
@@ -159,37 +231,47 @@ ISDataType *ImageSource_VDownsample::GetRow(int row)
 
 	ISDataType *srcdata;
 
+	// If we're starting part way through the image, part of the
+	// previous source row counts towards the first output row.
+	if(carryrow>=0)
+	{
+		srcdata=source->GetRow(carryrow-srcyorigin);
+		for(int i=0;i<width*samplesperpixel;++i)
+			tmp[i]=carry*srcdata[i];
+		carryrow=-1;
+	}
+
 	// Add the smaller value (destination width)
-	acc+=height;
+	acc+=fullheight;
 
 	// As long as the counter is less than the larger value, we take full pixels.
-	while(acc<source->height)
+	while(acc<srcheight)
 	{
-		if(srcrow>=source->height)
-			srcrow=source->height-1;
-		srcdata=source->GetRow(srcrow++);
+		if(srcrow>=srcheight)
+			srcrow=srcheight-1;
+		srcdata=source->GetRow((srcrow++)-srcyorigin);
 		for(int i=0;i<width*samplesperpixel;++i)
 			tmp[i]+=srcdata[i];
-		acc+=height;
+		acc+=fullheight;
 	}
 
-	double p=source->height-(acc-height);
-	p/=height;
+	double p=srcheight-(acc-fullheight);
+	p/=fullheight;
 	// p now contains the proportion of the next row to be counted towards the output row.
 
-	acc-=source->height;
+	acc-=srcheight;
 	// And acc now contains the remainder, ready for the next round.
 
 	// So we add p * the new source pixel to the current output pixel...
-	if(srcrow>=source->height)
-		srcrow=source->height-1;
-	srcdata=source->GetRow(srcrow);
+	if(srcrow>=srcheight)
+		srcrow=srcheight-1;
+	srcdata=source->GetRow(srcrow-srcyorigin);
 	for(int i=0;i<width*samplesperpixel;++i)
 		tmp[i]+=p*srcdata[i];
 
 	// Store it...
 	for(int i=0;i<width*samplesperpixel;++i)
-		rowbuffer[i]=0.5+(tmp[i]*height)/source->height;
+		rowbuffer[i]=0.5+(tmp[i]*fullheight)/srcheight;
 
 	// And start off the next output pixel with (1-p) * the source pixel.
 	for(int i=0;i<width*samplesperpixel;++i)
@@ -200,8 +282,31 @@ ISDataType *ImageSource_VDownsample::GetRow(int row)
 }
 
 
+bool ImageSource_VDownsample::SetROI(int x,int y,int w,int h)
+{
+	int furthest=-1;
+	DownsampleStep(srcheight,fullheight,y,srcrow,acc,carryrow,carry,furthest);
+	int first=srcrow;
+	if(carryrow>=0 && carryrow<first)
+		first=carryrow;
+
+	int s=srcrow,t=acc,cr=carryrow;
+	double c=carry;
+	DownsampleStep(srcheight,fullheight,h,s,t,cr,c,furthest);
+
+	source=ISCropImage(source,x,first-srcyorigin,w,furthest-first+1);
+	yorigin+=y;
+	srcyorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+	return(true);
+}
+
+
 ImageSource_VDownsample::ImageSource_VDownsample(struct ImageSource *source,int height)
-	: ImageSource(source), source(source), tmp(NULL), srcrow(0), acc(0)
+	: ImageSource(source), source(source), tmp(NULL), srcrow(0), acc(0), fullheight(height), srcheight(source->height),
+	yorigin(0), srcyorigin(0), carryrow(-1), carry(0.0)
 {
 	Debug[COMMENT] << "Using vdownsample filter" << endl;
 	this->height=height;
@@ -20,8 +20,15 @@ class ImageSource_HDownsample : public ImageSource
 	ImageSource_HDownsample(ImageSource *source,int dstwidth);
 	~ImageSource_HDownsample();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	private:
 	ImageSource *source;
+	int fullwidth,srcwidth;
+	int srcxorigin;
+	// The filter's state at the first pixel of the region of interest.
+	int startsrc,starta;
+	int carrypos;
+	double carry;
 };
 
 
@@ -31,11 +38,16 @@ class ImageSource_VDownsample : public ImageSource
 	ImageSource_VDownsample(ImageSource *source,int dstheight);
 	~ImageSource_VDownsample();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	private:
 	ImageSource *source;
 	double *tmp;
 	int srcrow;
 	int acc;
+	int fullheight,srcheight;
+	int yorigin,srcyorigin;
+	int carryrow;	// Part of this row must be added to the first row of a region of interest.
+	double carry;
 };
 
 #endif
@@ -16,6 +16,8 @@
 #include <math.h>
 
 #include "imagesource_flatten.h"
+#include "imagesource_composite.h"
+#include "imagesource_crop.h"
 
 using namespace std;
 
@@ -26,10 +28,28 @@ ImageSource_Flatten::~ImageSource_Flatten()
 }
 
 
-ISDataType *ImageSource_Flatten::GetRow(int row)
+// Flattening is a per-pixel operation - just crop the source to the window.
+
+bool ImageSource_Flatten::SetROI(int x,int y,int w,int h)
+{
+	source=ISCropImage(source,x,y,w,h);
+	width=source->width;
+	height=source->height;
+	currentrow=-1;
+	return(true);
+}
+
+
+// Flattening is per-pixel, so the source's runs are unchanged.
+
+int ImageSource_Flatten::GetUniformRun(int row,int x)
 {
-	int i;
+	return(source->GetUniformRun(row,x));
+}
 
+
+ISDataType *ImageSource_Flatten::GetRow(int row)
+{
 	if(row==currentrow)
 		return(rowbuffer);
 
@@ -38,38 +58,24 @@ ISDataType *ImageSource_Flatten::GetRow(int row)
 	if(!HAS_ALPHA(source->type))
 		return(srcdata);
 
-	switch(samplesperpixel)
+	// Each uniform run need only be flattened once.
+	int x=0;
+	while(x<width)
 	{
-		case 1:
-			for(i=0;i<width;++i)
-			{
-				int a=srcdata[i*2+1];
-				rowbuffer[i]=(a*srcdata[i*2]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-			}
-			break;
-		case 3:
-			for(i=0;i<width;++i)
-			{
-				int a=srcdata[i*4+3];
-				rowbuffer[i*3]=(a*srcdata[i*4]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-				rowbuffer[i*3+1]=(a*srcdata[i*4+1]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-				rowbuffer[i*3+2]=(a*srcdata[i*4+2]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-			}
-			break;
-		case 4:
-			for(i=0;i<width;++i)
-			{
-				int a=srcdata[i*5+4];
-//				rowbuffer[i*4]=(a*srcdata[i*5]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-//				rowbuffer[i*4+1]=(a*srcdata[i*5+1]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-//				rowbuffer[i*4+2]=(a*srcdata[i*5+2]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-//				rowbuffer[i*4+3]=(a*srcdata[i*5+3]+IS_SAMPLEMAX*(IS_SAMPLEMAX-a))/IS_SAMPLEMAX;
-				rowbuffer[i*4]=(a*srcdata[i*5])/IS_SAMPLEMAX;
-				rowbuffer[i*4+1]=(a*srcdata[i*5+1])/IS_SAMPLEMAX;
-				rowbuffer[i*4+2]=(a*srcdata[i*5+2])/IS_SAMPLEMAX;
-				rowbuffer[i*4+3]=(a*srcdata[i*5+3])/IS_SAMPLEMAX;
-			}
-			break;
+		int run=source->GetUniformRun(row,x);
+		if(run>1)
+		{
+			FlattenPixels(srcdata,x,x+1);
+			ISDataType *dst=rowbuffer+x*samplesperpixel;
+			for(int i=samplesperpixel;i<run*samplesperpixel;++i)
+				dst[i]=dst[i-samplesperpixel];
+		}
+		else
+		{
+			run=(run==0) ? width-x : (run<0 ? -run : run);
+			FlattenPixels(srcdata,x,x+run);
+		}
+		x+=run;
 	}
 
 	currentrow=row;
@@ -78,6 +84,15 @@ ISDataType *ImageSource_Flatten::GetRow(int row)
 }
 
 
+// Greyscale and RGB images are flattened onto white, others onto zero ink.
+
+void ImageSource_Flatten::FlattenPixels(ISDataType *srcdata,int first,int last)
+{
+	ISDataType background=(type==IS_TYPE_GREY || type==IS_TYPE_RGB) ? IS_SAMPLEMAX : 0;
+	ISFlattenRow(rowbuffer+first*samplesperpixel,srcdata+first*source->samplesperpixel,source->samplesperpixel,background,last-first);
+}
+
+
 ImageSource_Flatten::ImageSource_Flatten(struct ImageSource *source)
 	: ImageSource(source), source(source)
 {
@@ -21,7 +21,10 @@ class ImageSource_Flatten : public ImageSource
 	ImageSource_Flatten(ImageSource *source);
 	~ImageSource_Flatten();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
+	int GetUniformRun(int row,int x);
 	private:
+	void FlattenPixels(ISDataType *srcdata,int first,int last);
 	ImageSource *source;
 };
 
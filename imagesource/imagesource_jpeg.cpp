@@ -14,6 +14,11 @@
 
 #include <stdio.h>
 #include <string.h>
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 extern "C"
 {
 #ifdef WIN32
@@ -57,28 +62,28 @@ static void isjpeg_error_exit (j_common_ptr cinfo)
 }
 
 
-ImageSource_JPEG::ImageSource_JPEG(const char *filename)
-	: ImageSource(), cinfo(NULL), tmprow(NULL), err(NULL), iccprofbuffer(NULL), started(false)
+ImageSource_JPEG::ImageSource_JPEG(const char *filename,int minwidth,int minheight)
+	: ImageSource(), cinfo(NULL), tmprow(NULL), err(NULL), iccprofbuffer(NULL), started(false), skipped(false)
 {
 	err=new ImageSource_JPEG_ErrManager;
 	if ((err->File = fopen(filename,"rb")) == NULL)
     	throw "Unable to open file";
 	err->FileOwned=true;
-	Init();
+	Init(minwidth,minheight);
 }
 
 
-ImageSource_JPEG::ImageSource_JPEG(FILE *file)
-	: ImageSource(), cinfo(NULL), tmprow(NULL), err(NULL), iccprofbuffer(NULL), started(false)
+ImageSource_JPEG::ImageSource_JPEG(FILE *file,int minwidth,int minheight)
+	: ImageSource(), cinfo(NULL), tmprow(NULL), err(NULL), iccprofbuffer(NULL), started(false), skipped(false)
 {
 	err=new ImageSource_JPEG_ErrManager;
 	err->File = file;
 	err->FileOwned=false;
-	Init();
+	Init(minwidth,minheight);
 }
 
 
-void ImageSource_JPEG::Init()
+void ImageSource_JPEG::Init(int minwidth,int minheight)
 {
 	cinfo=new jpeg_decompress_struct;
 
@@ -96,8 +101,26 @@ void ImageSource_JPEG::Init()
 
 	jpeg_read_header(cinfo,TRUE);
 
-	width=cinfo->image_width;
-	height=cinfo->image_height;
+	// Let the IDCT do as much of any reduction as possible - decoding at
+	// 1/8 scale is considerably faster than decoding the full image and
+	// scaling it down afterwards.
+	if(minwidth>0 && minheight>0)
+	{
+		int denom=8;
+		while(denom>1 && ((int(cinfo->image_width)+denom-1)/denom<minwidth
+				|| (int(cinfo->image_height)+denom-1)/denom<minheight))
+			denom/=2;
+		cinfo->scale_num=1;
+		cinfo->scale_denom=denom;
+	}
+	jpeg_calc_output_dimensions(cinfo);
+
+	width=cinfo->output_width;
+	height=cinfo->output_height;
+
+	if(width!=int(cinfo->image_width))
+		Debug[TRACE] << "JPEG Loader: decoding " << cinfo->image_width << " x " << cinfo->image_height
+			<< " image at " << width << " x " << height << endl;
 
 	Debug[TRACE] << "JPEG Loader: Have " << cinfo->num_components << " components" << endl;
 
@@ -138,6 +161,8 @@ void ImageSource_JPEG::Init()
 			xres=yres=72;
 			break;
 	}
+	xres=(xres*width)/cinfo->image_width;
+	yres=(yres*height)/cinfo->image_height;
 	
 	JOCTET *iccprofile;
 	unsigned int profilelen;
@@ -174,11 +199,15 @@ ISDataType *ImageSource_JPEG::GetRow(int row)
 		throw "Random access not supported for JPEG files";
 	}
 	
+	if(row>currentrow+1)
+		SkipToRow(row);
+
 	rowptr[0]=(JSAMPROW)tmprow;
 	for(;currentrow<row;++currentrow)
 	{
 		jpeg_read_scanlines(cinfo, rowptr, 1);
 	}
+	skipped=false;
 	
 	switch(samplesperpixel)
 	{
@@ -213,11 +242,47 @@ ISDataType *ImageSource_JPEG::GetRow(int row)
 }
 
 
-ImageSource_JPEG::~ImageSource_JPEG()
+// Rows up to (but not including) the requested row are discarded.  With a
+// libjpeg that can skip scanlines, entropy decoding is all that's needed for
+// most of them; otherwise they're at least spared the conversion to ISDataType.
+
+void ImageSource_JPEG::SkipToRow(int row)
 {
-	while(currentrow<(height-1))
-		GetRow(currentrow+1);
+	if(!started)
+	{
+		jpeg_start_decompress(cinfo);
+		started=true;
+	}
+
+	int skip=(row-1)-currentrow;
+	if(skip<=0)
+		return;
+
+#ifdef HAVE_JPEG_SKIP_SCANLINES
+	// When decoding with DCT scaling, libjpeg-turbo's skipping can disturb the
+	// upsampling context of the rows which follow a short skip, or a second skip
+	// without a read in between - so these are read instead.  (Short skips save
+	// little anyway.)
+#if JPEG_LIB_VERSION >= 70
+	int imcurows=cinfo->max_v_samp_factor*cinfo->min_DCT_v_scaled_size;
+#else
+	int imcurows=cinfo->max_v_samp_factor*cinfo->min_DCT_scaled_size;
+#endif
+	if(skip>2*imcurows && !skipped)
+	{
+		currentrow+=jpeg_skip_scanlines(cinfo,skip);
+		skipped=true;
+		return;
+	}
+#endif
+	JSAMPROW rowptr[1]={(JSAMPROW)tmprow};
+	for(;skip>0;--skip,++currentrow)
+		jpeg_read_scanlines(cinfo,rowptr,1);
+}
 
+
+ImageSource_JPEG::~ImageSource_JPEG()
+{
 	if(iccprofbuffer)
 		free(iccprofbuffer);
 
@@ -226,7 +291,11 @@ ImageSource_JPEG::~ImageSource_JPEG()
 
 	if(cinfo)
 	{
-		jpeg_finish_decompress(cinfo);
+		// There's no need to decode rows which were never requested.
+		if(started && currentrow>=(height-1))
+			jpeg_finish_decompress(cinfo);
+		else
+			jpeg_abort_decompress(cinfo);
 		jpeg_destroy_decompress(cinfo);
 		delete cinfo;
 	}
@@ -1,7 +1,12 @@
 /*
  * imagesource_jpeg.h
  * 24-bit RGB and 8-bit Greyscale JPEG scanline-based Loader
- * Doesn't support Random Access
+ * Doesn't support Random Access, but skipped rows aren't fully decoded
+ * where libjpeg provides jpeg_skip_scanlines().
+ *
+ * If a minimum size is given, the image is decoded at 1/2, 1/4 or 1/8
+ * scale, whichever is smallest while still being at least that size.
+ * The resolution is adjusted to match, so the physical size is unchanged.
  *
  * Copyright (c) 2004 by Alastair M. Robinson
  * Distributed under the terms of the GNU General Public License -
@@ -18,18 +23,20 @@
 class ImageSource_JPEG : public ImageSource
 {
 	public:
-	ImageSource_JPEG(const char *filename);
-	ImageSource_JPEG(FILE *file);	// Use this variant if you want to provide an open file handle
+	ImageSource_JPEG(const char *filename,int minwidth=0,int minheight=0);
+	ImageSource_JPEG(FILE *file,int minwidth=0,int minheight=0);	// Use this variant if you want to provide an open file handle
 	~ImageSource_JPEG();
 	ISDataType *GetRow(int row);
+	void SkipToRow(int row);
 	private:
-	void Init();
+	void Init(int minwidth,int minheight);
 	FILE *file;
 	struct jpeg_decompress_struct *cinfo;
 	unsigned char *tmprow;
 	struct ImageSource_JPEG_ErrManager *err;
 	char *iccprofbuffer;
 	bool started;
+	bool skipped;	// Set if rows have been skipped since the last row was read.
 };
 
 #endif
@@ -17,8 +17,16 @@
 #include <string.h>
 #include <math.h>
 
+#include "../support/cpufeatures.h"
+#include "../support/ptmutex.h"
+
+#include "imagesource_crop.h"
 #include "imagesource_lanczossinc.h"
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 
@@ -38,6 +46,21 @@ ISDataType *ImageSource_LanczosSinc::GetRow(int row)
 }
 
 
+ISDataType *ImageSource_LanczosSinc::GetRows(int row,int count)
+{
+	return(source->GetRows(row,count));
+}
+
+
+bool ImageSource_LanczosSinc::SetROI(int x,int y,int w,int h)
+{
+	source=ISCropImage(source,x,y,w,h);
+	width=w;
+	height=h;
+	return(true);
+}
+
+
 ImageSource_LanczosSinc::ImageSource_LanczosSinc(struct ImageSource *source,int width,int height,int window)
 	: ImageSource(source), source(source)
 {
@@ -67,24 +90,507 @@ static double sinc(double x)
 }
 
 
+// Lanczos coefficients depend only upon the source and destination sizes and
+// the window size, so tables are shared between all instances (and threads)
+// which scale by the same ratio, and a few unused tables are kept around so
+// subsequent slots and pages of a layout can reuse them.
+// Output positions which fall at the same fractional source position share a
+// set of coefficients - there are only dstsize/gcd(srcsize,dstsize) of these
+// "phases".
+// Once built, a table is never modified, so can be read without locking.
+
+#define ISLANCZOSSINC_MAXUNUSEDTABLES 16
+
+class ISLanczosSinc_Table
+{
+	public:
+	static ISLanczosSinc_Table *Get(int srcsize,int dstsize,int windowsize);
+	void Release();
+	inline const float *GetCoeff(int pos) const
+	{
+		return(coeff+phase[pos]*support);
+	}
+	int srcsize,dstsize,windowsize;
+	int support;
+	int phases;
+	float *coeff;	// support coefficients for each phase
+	int *phase;		// The phase of each output position
+	int *index;		// The edge-clamped source position of each tap
+	int safesize;	// The first output position whose window reaches the last source position
+	protected:
+	ISLanczosSinc_Table(int srcsize,int dstsize,int windowsize);
+	~ISLanczosSinc_Table();
+	void Link();
+	void Unlink();
+	int refcount;
+	ISLanczosSinc_Table *next,*prev;
+	static ISLanczosSinc_Table *first;
+	static int unused;
+	static PTMutex mutex;
+};
+
+
+ISLanczosSinc_Table *ISLanczosSinc_Table::first=NULL;
+int ISLanczosSinc_Table::unused=0;
+PTMutex ISLanczosSinc_Table::mutex;
+
+
+static int gcd(int a,int b)
+{
+	while(b)
+	{
+		int t=a%b;
+		a=b;
+		b=t;
+	}
+	return(a);
+}
+
+
+ISLanczosSinc_Table::ISLanczosSinc_Table(int srcsize,int dstsize,int windowsize)
+	: srcsize(srcsize), dstsize(dstsize), windowsize(windowsize), coeff(NULL), phase(NULL), index(NULL),
+	refcount(1), next(NULL), prev(NULL)
+{
+	support=windowsize*2+1;
+	int g=gcd(srcsize,dstsize);
+	phases=dstsize/g;
+
+	coeff=(float *)malloc(sizeof(float)*phases*support);
+	for(int k=0;k<phases;++k)
+	{
+		double f=k*g; f/=dstsize;
+		for(int i=0; i<support; ++i)
+		{
+			int p=i-windowsize;
+			double v=f-p;
+			coeff[support*k+i]=sinc(v)*sinc(v/windowsize);
+		}
+	}
+
+	phase=(int *)malloc(sizeof(int)*dstsize);
+	index=(int *)malloc(sizeof(int)*dstsize*support);
+	safesize=dstsize;
+	for(int x=0;x<dstsize;++x)
+	{
+		phase[x]=((x*srcsize)%dstsize)/g;
+		int sx=(x*srcsize)/dstsize;
+		for(int i=0; i<support; ++i)
+		{
+			int lsx=sx+i-windowsize;
+			if(lsx<0) lsx=0;
+			if(lsx>=srcsize-1)
+			{
+				lsx=srcsize-1;
+				if(safesize>x)
+					safesize=x;
+			}
+			index[support*x+i]=lsx;
+		}
+	}
+}
+
+
+ISLanczosSinc_Table::~ISLanczosSinc_Table()
+{
+	free(coeff);
+	free(phase);
+	free(index);
+}
+
+
+// Adds the table to the head of the list - must be called with the mutex held.
+void ISLanczosSinc_Table::Link()
+{
+	prev=NULL;
+	if((next=first))
+		next->prev=this;
+	first=this;
+}
+
+
+// Removes the table from the list - must be called with the mutex held.
+void ISLanczosSinc_Table::Unlink()
+{
+	if(prev)
+		prev->next=next;
+	else
+		first=next;
+	if(next)
+		next->prev=prev;
+	next=prev=NULL;
+}
+
+
+ISLanczosSinc_Table *ISLanczosSinc_Table::Get(int srcsize,int dstsize,int windowsize)
+{
+	mutex.ObtainMutex();
+	ISLanczosSinc_Table *t=first;
+	while(t)
+	{
+		if(t->srcsize==srcsize && t->dstsize==dstsize && t->windowsize==windowsize)
+			break;
+		t=t->next;
+	}
+	if(t)
+	{
+		// Move to the head of the list, so the least recently used tables are discarded first.
+		t->Unlink();
+		if(t->refcount==0)
+			--unused;
+		++t->refcount;
+	}
+	else
+		t=new ISLanczosSinc_Table(srcsize,dstsize,windowsize);
+	t->Link();
+	mutex.ReleaseMutex();
+	return(t);
+}
+
+
+void ISLanczosSinc_Table::Release()
+{
+	mutex.ObtainMutex();
+	if(--refcount==0)
+	{
+		++unused;
+		if(unused>ISLANCZOSSINC_MAXUNUSEDTABLES)
+		{
+			// Discard the least recently used table which is no longer in use.
+			ISLanczosSinc_Table *t=first;
+			ISLanczosSinc_Table *victim=NULL;
+			while(t)
+			{
+				if(t->refcount==0)
+					victim=t;
+				t=t->next;
+			}
+			victim->Unlink();
+			delete victim;
+			--unused;
+		}
+	}
+	mutex.ReleaseMutex();
+}
+
+
+
+// Inner loops.  Each has a scalar version, plus SSE4.1 and AVX2 versions
+// which are selected at runtime if the CPU supports them.  Intermediate data
+// is single-precision float, which is ample for 16-bit samples.
+
+// Expands a row of samples to float
+static void ExpandRow_Scalar(float *dst,const ISDataType *src,int count)
+{
+	for(int i=0;i<count;++i)
+		dst[i]=src[i];
+}
+
+
+// Adds f times src to dst
+static void AccumulateRow_Scalar(float *dst,const float *src,float f,int count)
+{
+	for(int i=0;i<count;++i)
+		dst[i]+=f*src[i];
+}
+
+
+// Clamps a float row to the valid sample range, truncating to integer
+static void ClampRow_Scalar(ISDataType *dst,const float *src,int count)
+{
+	for(int i=0;i<count;++i)
+	{
+		float s=src[i];
+		if(s<0.0) s=0.0;
+		if(s>IS_SAMPLEMAX) s=IS_SAMPLEMAX;
+		dst[i]=int(s);
+	}
+}
+
+
+// Horizontal scaling of a single output pixel, using a precomputed table
+// of (already clamped) source sample offsets.  The row passed in may be a
+// cropped part of the full source row, starting at pixel srcoffset.
+static inline void HScalePixel_Scalar(ISDataType *dst,const ISDataType *src,const ISLanczosSinc_Table *table,int x,int spp,int srcoffset)
+{
+	int support=table->support;
+	const int *index=table->index+x*support;
+	const float *coeff=table->GetCoeff(x);
+	for(int s=0;s<spp;++s)
+	{
+		float a=0.0;
+		for(int p=0;p<support;++p)
+			a+=src[(index[p]-srcoffset)*spp+s]*coeff[p];
+		if(a<0.0) a=0.0;
+		if(a>IS_SAMPLEMAX) a=IS_SAMPLEMAX;
+		dst[s]=int(a);
+	}
+}
+
+
+// Scales count output pixels, starting at output position first.
+static void HScaleRow_Scalar(ISDataType *dst,const ISDataType *src,const ISLanczosSinc_Table *table,int spp,int first,int count,int srcoffset)
+{
+	for(int x=0;x<count;++x)
+		HScalePixel_Scalar(dst+x*spp,src,table,first+x,spp,srcoffset);
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+__attribute__((target("sse4.1")))
+static void ExpandRow_SSE41(float *dst,const ISDataType *src,int count)
+{
+	int i=0;
+	for(;i<=count-4;i+=4)
+	{
+		__m128i v=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(src+i)));
+		_mm_storeu_ps(dst+i,_mm_cvtepi32_ps(v));
+	}
+	for(;i<count;++i)
+		dst[i]=src[i];
+}
+
+
+__attribute__((target("sse4.1")))
+static void AccumulateRow_SSE41(float *dst,const float *src,float f,int count)
+{
+	__m128 vf=_mm_set1_ps(f);
+	int i=0;
+	for(;i<=count-4;i+=4)
+	{
+		__m128 d=_mm_loadu_ps(dst+i);
+		d=_mm_add_ps(d,_mm_mul_ps(vf,_mm_loadu_ps(src+i)));
+		_mm_storeu_ps(dst+i,d);
+	}
+	for(;i<count;++i)
+		dst[i]+=f*src[i];
+}
+
+
+__attribute__((target("sse4.1")))
+static void ClampRow_SSE41(ISDataType *dst,const float *src,int count)
+{
+	__m128 lo=_mm_setzero_ps();
+	__m128 hi=_mm_set1_ps(IS_SAMPLEMAX);
+	int i=0;
+	for(;i<=count-8;i+=8)
+	{
+		__m128i a=_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src+i),lo),hi));
+		__m128i b=_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src+i+4),lo),hi));
+		_mm_storeu_si128((__m128i *)(dst+i),_mm_packus_epi32(a,b));
+	}
+	ClampRow_Scalar(dst+i,src+i,count-i);
+}
+
+
+// Computes four samples of one output pixel at once.  Reading four samples
+// per tap means RGB pixels read one sample beyond the pixel, so pixels whose
+// window touches the last source pixel (those from safewidth onwards) are
+// handled by the scalar code.  Likewise the fourth sample written for an RGB
+// pixel is overwritten by the next pixel - the last pixel of a row is always
+// done by the scalar code so this can't overrun a region of interest.
+// (A cropped source row always extends one pixel beyond the window's last tap
+// unless that tap is the last source pixel.)
+
+__attribute__((target("sse4.1")))
+static void HScaleRow_SSE41(ISDataType *dst,const ISDataType *src,const ISLanczosSinc_Table *table,int spp,int first,int count,int srcoffset)
+{
+	if(spp!=3 && spp!=4)
+	{
+		HScaleRow_Scalar(dst,src,table,spp,first,count,srcoffset);
+		return;
+	}
+	int end=first+count;
+	int safewidth=(spp==4) ? end : table->safesize;
+	if(spp==3 && safewidth>end-1)
+		safewidth=end-1;
+	int support=table->support;
+
+	__m128 lo=_mm_setzero_ps();
+	__m128 hi=_mm_set1_ps(IS_SAMPLEMAX);
+	int x=first;
+	for(;x<safewidth;++x)
+	{
+		const int *idx=table->index+x*support;
+		const float *c=table->GetCoeff(x);
+		__m128 a=_mm_setzero_ps();
+		for(int p=0;p<support;++p)
+		{
+			__m128i v=_mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)(src+(idx[p]-srcoffset)*spp)));
+			a=_mm_add_ps(a,_mm_mul_ps(_mm_cvtepi32_ps(v),_mm_set1_ps(c[p])));
+		}
+		__m128i r=_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(a,lo),hi));
+		_mm_storel_epi64((__m128i *)(dst+(x-first)*spp),_mm_packus_epi32(r,r));
+	}
+	for(;x<end;++x)
+		HScalePixel_Scalar(dst+(x-first)*spp,src,table,x,spp,srcoffset);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void ExpandRow_AVX2(float *dst,const ISDataType *src,int count)
+{
+	int i=0;
+	for(;i<=count-8;i+=8)
+	{
+		__m256i v=_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src+i)));
+		_mm256_storeu_ps(dst+i,_mm256_cvtepi32_ps(v));
+	}
+	for(;i<count;++i)
+		dst[i]=src[i];
+}
+
+
+__attribute__((target("avx2,fma")))
+static void AccumulateRow_AVX2(float *dst,const float *src,float f,int count)
+{
+	__m256 vf=_mm256_set1_ps(f);
+	int i=0;
+	for(;i<=count-8;i+=8)
+		_mm256_storeu_ps(dst+i,_mm256_fmadd_ps(vf,_mm256_loadu_ps(src+i),_mm256_loadu_ps(dst+i)));
+	// The tail is fused too, so a sample's result doesn't depend upon its position
+	// within the row - a cropped row must match the same part of the full row.
+	for(;i<count;++i)
+		dst[i]=fmaf(f,src[i],dst[i]);
+}
+
+
+__attribute__((target("avx2,fma")))
+static void ClampRow_AVX2(ISDataType *dst,const float *src,int count)
+{
+	__m256 lo=_mm256_setzero_ps();
+	__m256 hi=_mm256_set1_ps(IS_SAMPLEMAX);
+	int i=0;
+	for(;i<=count-16;i+=16)
+	{
+		__m256i a=_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src+i),lo),hi));
+		__m256i b=_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src+i+8),lo),hi));
+		// packus works within 128-bit lanes, so the result must be reordered.
+		__m256i r=_mm256_permute4x64_epi64(_mm256_packus_epi32(a,b),0xd8);
+		_mm256_storeu_si256((__m256i *)(dst+i),r);
+	}
+	ClampRow_Scalar(dst+i,src+i,count-i);
+}
+
+
+// As HScaleRow_SSE41(), but computes two output pixels at once, one in each
+// 128-bit lane.  The taps are multiplied and added separately rather than fused -
+// this is built without FMA so the compiler can't fuse them either - so each
+// pixel's result is the same whichever version computes it, and a cropped row
+// still matches the same part of the full row.
+
+__attribute__((target("avx2")))
+static void HScaleRow_AVX2(ISDataType *dst,const ISDataType *src,const ISLanczosSinc_Table *table,int spp,int first,int count,int srcoffset)
+{
+	if(spp!=3 && spp!=4)
+	{
+		HScaleRow_Scalar(dst,src,table,spp,first,count,srcoffset);
+		return;
+	}
+	int end=first+count;
+	int safewidth=(spp==4) ? end : table->safesize;
+	if(spp==3 && safewidth>end-1)
+		safewidth=end-1;
+	int support=table->support;
+
+	__m256 lo=_mm256_setzero_ps();
+	__m256 hi=_mm256_set1_ps(IS_SAMPLEMAX);
+	int x=first;
+	for(;x<safewidth-1;x+=2)
+	{
+		const int *idx0=table->index+x*support;
+		const int *idx1=idx0+support;
+		const float *c0=table->GetCoeff(x);
+		const float *c1=table->GetCoeff(x+1);
+		__m256 a=_mm256_setzero_ps();
+		for(int p=0;p<support;++p)
+		{
+			__m128i v0=_mm_loadl_epi64((const __m128i *)(src+(idx0[p]-srcoffset)*spp));
+			__m128i v1=_mm_loadl_epi64((const __m128i *)(src+(idx1[p]-srcoffset)*spp));
+			__m256 v=_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_unpacklo_epi64(v0,v1)));
+			__m256 c=_mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(c0[p])),_mm_set1_ps(c1[p]),1);
+			a=_mm256_add_ps(a,_mm256_mul_ps(v,c));
+		}
+		__m256i r=_mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(a,lo),hi));
+		__m128i packed=_mm_packus_epi32(_mm256_castsi256_si128(r),_mm256_extracti128_si256(r,1));
+		// The first pixel's stray fourth sample, if RGB, is overwritten by the second.
+		_mm_storel_epi64((__m128i *)(dst+(x-first)*spp),packed);
+		_mm_storel_epi64((__m128i *)(dst+(x+1-first)*spp),_mm_unpackhi_epi64(packed,packed));
+	}
+	// Any odd pixel, and those the vector code can't handle, are left to the SSE4.1 version.
+	if(x<end)
+		HScaleRow_SSE41(dst+(x-first)*spp,src,table,spp,x,end-x,srcoffset);
+}
+
+#endif
+
+
+struct ISLanczosSinc_Kernels
+{
+	ISLanczosSinc_Kernels();
+	void (*ExpandRow)(float *dst,const ISDataType *src,int count);
+	void (*AccumulateRow)(float *dst,const float *src,float f,int count);
+	void (*ClampRow)(ISDataType *dst,const float *src,int count);
+	void (*HScaleRow)(ISDataType *dst,const ISDataType *src,const ISLanczosSinc_Table *table,int spp,int first,int count,int srcoffset);
+};
+
+
+ISLanczosSinc_Kernels::ISLanczosSinc_Kernels()
+	: ExpandRow(ExpandRow_Scalar), AccumulateRow(AccumulateRow_Scalar),
+	ClampRow(ClampRow_Scalar), HScaleRow(HScaleRow_Scalar)
+{
+#ifdef HAVE_X86_SIMD
+	int features=GetCPUFeatures();
+	if(features&CPUFEATURE_SSE41)
+	{
+		ExpandRow=ExpandRow_SSE41;
+		AccumulateRow=AccumulateRow_SSE41;
+		ClampRow=ClampRow_SSE41;
+		HScaleRow=HScaleRow_SSE41;
+	}
+	if(features&CPUFEATURE_AVX2)
+	{
+		ExpandRow=ExpandRow_AVX2;
+		AccumulateRow=AccumulateRow_AVX2;
+		ClampRow=ClampRow_AVX2;
+		HScaleRow=HScaleRow_AVX2;
+	}
+#endif
+}
+
+
+static ISLanczosSinc_Kernels &GetKernels()
+{
+	static ISLanczosSinc_Kernels kernels;
+	return(kernels);
+}
+
+
+
 // The row cache is just a simplistic ring-buffer type cache which handles
 // the details of tracking several rows of "support" data.
 // The temporary data does have to be float - or at least wider than ISDataType
-// and must be clamped since the ringing artifiacts inherent in Lanczos Sinc
+// - and must be clamped since the ringing artifiacts inherent in Lanczos Sinc
 // can push values out of range.
+// Source rows are fetched a strip at a time, to amortise the cost of the
+// upstream filter chain over IS_STRIPROWS rows.
 
 class ISLanczosSinc_RowCache
 {
 	public:
 	ISLanczosSinc_RowCache(ImageSource_VLanczosSinc *source);
 	~ISLanczosSinc_RowCache();
-	double *GetRow(int row);
-	double *GetCacheRow(int row);
+	float *GetRow(int row);
+	float *GetCacheRow(int row);
 	private:
 	ImageSource_VLanczosSinc *source;
-	double *cache;
-	double *rowbuffer;
+	ISLanczosSinc_Kernels &kernels;
+	float *cache;
+	float *rowbuffer;
 	int currentrow;
+	ISDataType *strip;
+	int stripfirstrow;
+	int striprows;
 };
 
 
@@ -98,50 +604,56 @@ ISLanczosSinc_RowCache::~ISLanczosSinc_RowCache()
 
 
 ISLanczosSinc_RowCache::ISLanczosSinc_RowCache(ImageSource_VLanczosSinc *source)
-	: source(source), cache(NULL), rowbuffer(NULL), currentrow(-1)
+	: source(source), kernels(GetKernels()), cache(NULL), rowbuffer(NULL), currentrow(-1), strip(NULL), stripfirstrow(0), striprows(0)
 {
-	cache=(double *)malloc(sizeof(double)*source->samplesperpixel*source->width*source->support);
-	rowbuffer=(double *)malloc(sizeof(double)*source->samplesperpixel*source->width);
+	cache=(float *)malloc(sizeof(float)*source->samplesperpixel*source->width*source->support);
+	rowbuffer=(float *)malloc(sizeof(float)*source->samplesperpixel*source->width);
 }
 
 
-double *ISLanczosSinc_RowCache::GetRow(int row)
+float *ISLanczosSinc_RowCache::GetRow(int row)
 {
-	for(int i=0;i<source->width*source->samplesperpixel;++i)
+	int samplesperrow=source->width*source->samplesperpixel;
+	for(int i=0;i<samplesperrow;++i)
 		rowbuffer[i]=0.0;
 
+	// Rows are tracked in the coordinates of the full images, so the table
+	// applies unchanged to a region of interest.
+	row+=source->yorigin;
+	int sr=(row*source->table->srcsize)/source->table->dstsize;
+	const float *coeff=source->table->GetCoeff(row);
 	for(int i=0;i<source->support;++i)
 	{
 		int p=i-source->windowsize;
-		int sr=(row*source->source->height)/source->height;
-		double *src=GetCacheRow(sr+p);
-		double f=source->coeff[row*source->support+i];
-		for(int x=0;x<source->width*source->samplesperpixel;++x)
-		{
-			rowbuffer[x]+=f*src[x];
-		}
+		float *src=GetCacheRow(sr+p);
+		kernels.AccumulateRow(rowbuffer,src,coeff[i],samplesperrow);
 	}
 	return(rowbuffer);
 }
 
 
-double *ISLanczosSinc_RowCache::GetCacheRow(int row)
+float *ISLanczosSinc_RowCache::GetCacheRow(int row)
 {
 	if(row<0)
 		row=0;
-	if(row>=source->source->height)
-		row=source->source->height-1;
+	if(row>=source->table->srcsize)
+		row=source->table->srcsize-1;
 	int crow=row%source->support;
 	{
-		double *rowptr=cache+crow*source->samplesperpixel*source->width;
+		float *rowptr=cache+crow*source->samplesperpixel*source->width;
 		if(row>currentrow)
 		{
 			currentrow=row;
-			ISDataType *src=source->source->GetRow(row);
-			for(int i=0;i<source->width*source->samplesperpixel;++i)
+			if(row>=stripfirstrow+striprows)
 			{
-				rowptr[i]=src[i];
+				stripfirstrow=row;
+				striprows=source->srcyorigin+source->source->height-row;
+				if(striprows>IS_STRIPROWS)
+					striprows=IS_STRIPROWS;
+				strip=source->source->GetRows(stripfirstrow-source->srcyorigin,striprows);
 			}
+			ISDataType *src=strip+(row-stripfirstrow)*source->samplesperpixel*source->width;
+			kernels.ExpandRow(rowptr,src,source->width*source->samplesperpixel);
 		}
 		return(rowptr);		
 	}
@@ -157,27 +669,17 @@ ImageSource_VLanczosSinc::~ImageSource_VLanczosSinc()
 		delete cache;
 	if(source)
 		delete source;
-	if(coeff)
-		free(coeff);
+	if(table)
+		table->Release();
 }
 
 
 ISDataType *ImageSource_VLanczosSinc::GetRow(int row)
 {
-	int i;
-
 	if(row==currentrow)
 		return(rowbuffer);
 
-	double *srcdata=cache->GetRow(row);
-
-	for(i=0;i<width*samplesperpixel;++i)
-	{
-		double s=srcdata[i];
-		if(s<0.0) s=0.0;
-		if(s>IS_SAMPLEMAX) s=IS_SAMPLEMAX;
-		rowbuffer[i]=int(s);
-	}
+	ScaleRow(row,rowbuffer);
 
 	currentrow=row;
 
@@ -185,35 +687,53 @@ ISDataType *ImageSource_VLanczosSinc::GetRow(int row)
 }
 
 
-// Since Lanczos Sinc is a relatively expensive algorithm to compute in realtime
-// and the row / column coefficients are constant we precompute them here.
+ISDataType *ImageSource_VLanczosSinc::GetRows(int row,int count)
+{
+	MakeStripBuffer(count);
+	for(int i=0;i<count;++i)
+		ScaleRow(row+i,stripbuffer+i*width*samplesperpixel);
+	return(stripbuffer);
+}
+
 
-void ImageSource_VLanczosSinc::PreCalc()
+void ImageSource_VLanczosSinc::ScaleRow(int row,ISDataType *dst)
 {
-	for(int y=0;y<height;++y)
-	{
-		double c=y*source->height; c/=height;
-		int ci=int(c);
-		double f=c-ci;
-		for(int i=0; i<support; ++i)
-		{
-			int p=i-windowsize;
-			double v=f-p;
-			coeff[support*y+i]=sinc(v)*sinc(v/windowsize);
-		}
-	}
+	GetKernels().ClampRow(dst,cache->GetRow(row),width*samplesperpixel);
+}
+
+
+bool ImageSource_VLanczosSinc::SetROI(int x,int y,int w,int h)
+{
+	y+=yorigin;
+	int first=((y*table->srcsize)/table->dstsize)-windowsize;
+	int last=(((y+h-1)*table->srcsize)/table->dstsize)+windowsize;
+	if(first<0)
+		first=0;
+	if(last>=table->srcsize)
+		last=table->srcsize-1;
+
+	source=ISCropImage(source,x,first-srcyorigin,w,last-first+1);
+	yorigin=y;
+	srcyorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+
+	// The cache's rows are sized to the output width, so must be rebuilt.
+	delete cache;
+	cache=new ISLanczosSinc_RowCache(this);
+	return(true);
 }
 
 
 ImageSource_VLanczosSinc::ImageSource_VLanczosSinc(struct ImageSource *source,int height,int windowsize)
-	: ImageSource(source), source(source), windowsize(windowsize)
+	: ImageSource(source), source(source), windowsize(windowsize), yorigin(0), srcyorigin(0)
 {
 	this->height=height;
 	yres=(source->yres*height); yres/=source->height;
 
 	support=windowsize*2+1;
-	coeff=(double *)malloc(sizeof(double)*height*support);
-	PreCalc();
+	table=ISLanczosSinc_Table::Get(source->height,height,windowsize);
 	cache=new ISLanczosSinc_RowCache(this);
 	MakeRowBuffer();
 	randomaccess=false;
@@ -228,26 +748,7 @@ ISDataType *ImageSource_HLanczosSinc::GetRow(int row)
 	if(row==currentrow)
 		return(rowbuffer);
 
-	ISDataType *src=source->GetRow(row);
-	for(int x=0;x<width;++x)
-	{
-		int sx=(x*source->width)/width;
-		for(int s=0;s<samplesperpixel;++s)
-		{
-			double a=0.0;
-			for(int p=0;p<support;++p)
-			{
-				int lsx=sx+p-windowsize;
-				if(lsx<0) lsx=0;
-				if(lsx>=source->width) lsx=source->width-1;
-
-				a+=src[lsx*samplesperpixel+s]*coeff[x*support+p];
-			}
-			if(a<0.0) a=0.0;
-			if(a>IS_SAMPLEMAX) a=IS_SAMPLEMAX;
-			rowbuffer[x*samplesperpixel+s]=a;
-		}
-	}
+	ScaleRow(source->GetRow(row),rowbuffer);
 
 	currentrow=row;
 
@@ -255,35 +756,52 @@ ISDataType *ImageSource_HLanczosSinc::GetRow(int row)
 }
 
 
-// Since Lanczos Sinc is a relatively expensive algorithm to compute in realtime
-// and the row / column coefficients are constant we precompute them here.
-
-void ImageSource_HLanczosSinc::PreCalc()
+ISDataType *ImageSource_HLanczosSinc::GetRows(int row,int count)
 {
-	for(int x=0;x<width;++x)
+	ISDataType *src=source->GetRows(row,count);
+	MakeStripBuffer(count);
+	for(int i=0;i<count;++i)
 	{
-		double c=x*source->width; c/=width;
-		int ci=int(c);
-		double f=c-ci;
-		for(int i=0; i<support; ++i)
-		{
-			int p=i-windowsize;
-			double v=f-p;
-			coeff[support*x+i]=sinc(v)*sinc(v/windowsize);
-		}
+		ScaleRow(src+i*source->width*samplesperpixel,
+			stripbuffer+i*width*samplesperpixel);
 	}
+	return(stripbuffer);
+}
+
+
+void ImageSource_HLanczosSinc::ScaleRow(ISDataType *src,ISDataType *dst)
+{
+	GetKernels().HScaleRow(dst,src,table,samplesperpixel,xorigin,width,srcxorigin);
+}
+
+
+bool ImageSource_HLanczosSinc::SetROI(int x,int y,int w,int h)
+{
+	x+=xorigin;
+	int first=table->index[x*support];
+	int last=table->index[(x+w-1)*support+support-1];
+	// The SSE code reads a sample beyond an RGB pixel, so keep one more pixel if there is one.
+	if(last<table->srcsize-1)
+		++last;
+
+	source=ISCropImage(source,first-srcxorigin,y,last-first+1,h);
+	xorigin=x;
+	srcxorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+	return(true);
 }
 
 
 ImageSource_HLanczosSinc::ImageSource_HLanczosSinc(struct ImageSource *source,int width,int windowsize)
-	: ImageSource(source), source(source), windowsize(windowsize)
+	: ImageSource(source), source(source), windowsize(windowsize), xorigin(0), srcxorigin(0)
 {
 	this->width=width;
 	xres=(source->xres*width); xres/=source->width;
 
 	support=windowsize*2+1;
-	coeff=(double *)malloc(sizeof(double)*width*support);
-	PreCalc();
+	table=ISLanczosSinc_Table::Get(source->width,width,windowsize);
 	MakeRowBuffer();
 }
 
@@ -292,8 +810,8 @@ ImageSource_HLanczosSinc::~ImageSource_HLanczosSinc()
 {
 	if(source)
 		delete source;
-	if(coeff)
-		free(coeff);
+	if(table)
+		table->Release();
 }
 
 
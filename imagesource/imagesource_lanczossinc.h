@@ -18,6 +18,7 @@
 #include "imagesource.h"
 
 class ISLanczosSinc_RowCache;
+class ISLanczosSinc_Table;
 
 
 class ImageSource_LanczosSinc : public ImageSource
@@ -26,6 +27,8 @@ class ImageSource_LanczosSinc : public ImageSource
 	ImageSource_LanczosSinc(ImageSource *source,int width,int height,int windowsize=6);
 	~ImageSource_LanczosSinc();
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	bool SetROI(int x,int y,int w,int h);
 	protected:
 	ImageSource *source;
 };
@@ -37,13 +40,16 @@ class ImageSource_VLanczosSinc : public ImageSource
 	ImageSource_VLanczosSinc(ImageSource *source,int height,int windowsize=6);
 	~ImageSource_VLanczosSinc();
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	bool SetROI(int x,int y,int w,int h);
 	protected:
-	void PreCalc();
+	void ScaleRow(int row,ISDataType *dst);
 	int support;
 	ImageSource *source;
 	int windowsize;
-	double *coeff;
+	ISLanczosSinc_Table *table;
 	ISLanczosSinc_RowCache *cache;
+	int yorigin,srcyorigin;	// Position of the region of interest and the cropped source within the full images
 	friend class ISLanczosSinc_RowCache;
 };
 
@@ -54,12 +60,15 @@ class ImageSource_HLanczosSinc : public ImageSource
 	ImageSource_HLanczosSinc(ImageSource *source,int width,int windowsize=6);
 	~ImageSource_HLanczosSinc();
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	bool SetROI(int x,int y,int w,int h);
 	protected:
-	void PreCalc();
+	void ScaleRow(ISDataType *src,ISDataType *dst);
 	int support;
 	ImageSource *source;
 	int windowsize;
-	double *coeff;
+	ISLanczosSinc_Table *table;
+	int xorigin,srcxorigin;	// Position of the region of interest and the cropped source within the full images
 };
 
 #endif
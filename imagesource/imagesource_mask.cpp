@@ -16,6 +16,8 @@
 #include <math.h>
 
 #include "imagesource_mask.h"
+#include "imagesource_composite.h"
+#include "imagesource_crop.h"
 
 using namespace std;
 
@@ -29,6 +31,19 @@ ImageSource_Mask::~ImageSource_Mask()
 }
 
 
+// The mask is aligned pixel-for-pixel with the image, so is cropped to the same window.
+
+bool ImageSource_Mask::SetROI(int x,int y,int w,int h)
+{
+	source=ISCropImage(source,x,y,w,h);
+	mask=ISCropImage(mask,x,y,w,h);
+	width=source->width;
+	height=source->height;
+	currentrow=-1;
+	return(true);
+}
+
+
 ISDataType *ImageSource_Mask::GetRow(int row)
 {
 	if(row==currentrow)
@@ -37,25 +52,7 @@ ISDataType *ImageSource_Mask::GetRow(int row)
 	ISDataType *srcdata=source->GetRow(row);
 	ISDataType *maskdata=mask->GetRow(row);
 
-	if(source->type&IS_TYPE_ALPHA)
-	{
-		for(int x=0;x<width;++x)
-		{
-			for(int s=0;s<source->samplesperpixel-1;++s)
-				rowbuffer[x*samplesperpixel+s]=srcdata[x*source->samplesperpixel+s];
-			rowbuffer[(x+1)*samplesperpixel-1]=
-				(srcdata[(x+1)*source->samplesperpixel-1]*maskdata[x*mask->samplesperpixel])/IS_SAMPLEMAX;
-		}
-	}
-	else
-	{
-		for(int x=0;x<width;++x)
-		{
-			for(int s=0;s<source->samplesperpixel;++s)
-				rowbuffer[x*samplesperpixel+s]=srcdata[x*source->samplesperpixel+s];
-			rowbuffer[(x+1)*samplesperpixel-1]=maskdata[x*mask->samplesperpixel];
-		}
-	}
+	ISMaskRow(rowbuffer,srcdata,source->samplesperpixel,HAS_ALPHA(source->type),maskdata,mask->samplesperpixel,width);
 
 	currentrow=row;
 
@@ -21,6 +21,7 @@ class ImageSource_Mask : public ImageSource
 	ImageSource_Mask(ImageSource *source,ImageSource *mask);
 	~ImageSource_Mask();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	private:
 	ImageSource *source;
 	ImageSource *mask;
@@ -0,0 +1,670 @@
+/*
+ * imagesource_mmap.cpp - ImageSource loader for uncompressed TIFF, BMP
+ * and PNM files, reading image data straight from a memory mapping.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <tiffio.h>
+
+#include "../support/debug.h"
+
+#include "imagesource_mmap.h"
+#include "../profilemanager/lcmswrapper.h"
+
+using namespace std;
+
+// Direct access hands out the file's own samples as ISDataType.
+#if IS_SAMPLEMAX!=65535
+#error ImageSource_MMap assumes 16-bit samples
+#endif
+
+
+static bool HostIsLittleEndian()
+{
+	unsigned short t=1;
+	return(*(unsigned char *)&t==1);
+}
+
+
+static unsigned long GetLE(const unsigned char *c,int l)
+{
+	unsigned long v=0;
+	for(int i=l-1;i>=0;--i)
+	{
+		v<<=8; v|=c[i];
+	}
+	return(v);
+}
+
+
+ImageSource_MMap::ImageSource_MMap(const char *filename)
+	: ImageSource(), fd(-1), map(NULL), mapsize(0), stripoffsets(NULL), stripcount(1), rowsperstrip(0),
+	bytesperrow(0), bytespersample(1), bottomup(false), swapbytes(false), invert(false), bgr(false),
+	direct(false), maxval(255), fullheight(0), roiy(0), roioffset(0), currentptr(NULL), lastrow(-1), windowrows(1), advisedwindow(-1), sequential(true)
+{
+	try
+	{
+		MapFile(filename);
+
+		if(mapsize>=4 && ((map[0]=='I' && map[1]=='I' && map[2]==42 && map[3]==0)
+			|| (map[0]=='M' && map[1]=='M' && map[2]==0 && map[3]==42)))
+			ParseTIFF(filename);
+		else if(mapsize>=2 && map[0]=='B' && map[1]=='M')
+			ParseBMP();
+		else if(mapsize>=2 && map[0]=='P' && (map[1]=='5' || map[1]=='6'))
+			ParsePNM();
+		else
+			throw "ImageSource_MMap: not an uncompressed TIFF, BMP or PNM file";
+
+		CheckLayout();
+	}
+	catch(...)
+	{
+		Unmap();
+		throw;
+	}
+
+	MakeRowBuffer();
+	randomaccess=true;
+	fullheight=height;
+
+	windowrows=IS_MMAP_READAHEAD/bytesperrow;
+	if(windowrows<1)
+		windowrows=1;
+
+#ifndef WIN32
+	// Most consumers read from top to bottom, so unless the rows are stored
+	// upside down, start with aggressive readahead - Advise() backs this off
+	// if the access pattern turns out to be random.
+	if((sequential=!bottomup))
+		madvise(map,mapsize,MADV_SEQUENTIAL);
+#endif
+
+	Debug[TRACE] << "ImageSource_MMap: mapped " << width << " x " << height << ", " << samplesperpixel
+		<< " samples per pixel, " << bytespersample*8 << " bits per sample" << (direct ? " (direct)" : "") << endl;
+}
+
+
+ImageSource_MMap::~ImageSource_MMap()
+{
+	Unmap();
+}
+
+
+void ImageSource_MMap::MapFile(const char *filename)
+{
+#ifdef WIN32
+	throw "ImageSource_MMap: memory-mapped files aren't supported on this platform";
+#else
+	if((fd=open(filename,O_RDONLY))<0)
+		throw "Can't open file";
+
+	struct stat st;
+	if(fstat(fd,&st)!=0 || st.st_size==0)
+		throw "ImageSource_MMap: can't determine file size";
+	mapsize=st.st_size;
+
+	// The mapping is private and writable so that a downstream filter which
+	// scribbles on a row it's been given only touches its own copy-on-write
+	// page, never the file.
+	void *p=mmap(NULL,mapsize,PROT_READ|PROT_WRITE,MAP_PRIVATE,fd,0);
+	if(p==MAP_FAILED)
+		throw "ImageSource_MMap: can't map file";
+	map=(unsigned char *)p;
+#endif
+}
+
+
+void ImageSource_MMap::Unmap()
+{
+#ifndef WIN32
+	if(map)
+		munmap(map,mapsize);
+	map=NULL;
+	if(fd>=0)
+		close(fd);
+	fd=-1;
+#endif
+	if(stripoffsets)
+		free(stripoffsets);
+	stripoffsets=NULL;
+}
+
+
+// Only the layouts ImageSource_TIFF would read without decompression are
+// accepted: 8 or 16-bit unsigned samples, stored contiguously in strips.
+
+void ImageSource_MMap::ParseTIFF(const char *filename)
+{
+	TIFF *file;
+	if(!(file=TIFFOpen(filename,"r")))
+		throw "Can't open file...";
+
+	try
+	{
+		uint16 photometric=0,spp=0,bps=0;
+		uint16 compression=COMPRESSION_NONE,planar=PLANARCONFIG_CONTIG,sampleformat=SAMPLEFORMAT_UINT;
+		uint32 w=0,h=0,sl=0;
+
+		TIFFGetField(file, TIFFTAG_PHOTOMETRIC, &photometric);
+		TIFFGetField(file, TIFFTAG_SAMPLESPERPIXEL, &spp);
+		TIFFGetField(file, TIFFTAG_BITSPERSAMPLE, &bps);
+		TIFFGetField(file, TIFFTAG_IMAGEWIDTH, &w);
+		TIFFGetField(file, TIFFTAG_IMAGELENGTH, &h);
+		TIFFGetField(file, TIFFTAG_ROWSPERSTRIP, &sl);
+		TIFFGetField(file, TIFFTAG_COMPRESSION, &compression);
+		TIFFGetField(file, TIFFTAG_PLANARCONFIG, &planar);
+		TIFFGetField(file, TIFFTAG_SAMPLEFORMAT, &sampleformat);
+
+		if(compression!=COMPRESSION_NONE || planar!=PLANARCONFIG_CONTIG || sampleformat!=SAMPLEFORMAT_UINT)
+			throw "ImageSource_MMap: TIFF data isn't uncompressed and contiguous";
+		if(TIFFIsTiled(file))
+			throw "ImageSource_MMap: tiled TIFFs aren't supported";
+		if(bps!=8 && bps!=16)
+			throw "ImageSource_MMap: TIFF must have 8 or 16 bits per sample";
+
+		if(sl==0 || sl>h) sl=h;
+
+		switch(photometric)
+		{
+			case PHOTOMETRIC_MINISBLACK:
+			case PHOTOMETRIC_MINISWHITE:
+				switch(spp)
+				{
+					case 1:
+						type=IS_TYPE_GREY;
+						break;
+					case 2:
+						type=IS_TYPE_GREYA;
+						break;
+					default:
+						throw "ImageSource_MMap: unsupported greyscale TIFF";
+				}
+				// As with ImageSource_TIFF, greyscale data is stored as density.
+				invert=(photometric==PHOTOMETRIC_MINISBLACK);
+				break;
+			case PHOTOMETRIC_RGB:
+				switch(spp)
+				{
+					case 3:
+						type=IS_TYPE_RGB;
+						break;
+					case 4:
+						type=IS_TYPE_RGBA;
+						break;
+					default:
+						throw "ISTIFF Panic: RGB images must have 3 or 4 samples per pixel!";
+				}
+				break;
+			case PHOTOMETRIC_SEPARATED:
+				switch(spp)
+				{
+					case 4:
+						type=IS_TYPE_CMYK;
+						break;
+					case 5:
+						type=IS_TYPE_CMYKA;
+						break;
+					default:
+						type=IS_TYPE_DEVICEN;
+						break;
+				}
+				break;
+			default:
+				throw "ImageSource_MMap: unsupported TIFF photometric interpretation";
+		}
+
+		width=w;
+		height=h;
+		samplesperpixel=spp;
+		bytespersample=bps/8;
+		maxval=(1<<bps)-1;
+		bytesperrow=long(width)*samplesperpixel*bytespersample;
+		rowsperstrip=sl;
+		swapbytes=(bps==16 && TIFFIsByteSwapped(file));
+
+		toff_t *offsets=NULL;
+		stripcount=TIFFNumberOfStrips(file);
+		if(stripcount<1 || !TIFFGetField(file, TIFFTAG_STRIPOFFSETS, &offsets) || !offsets)
+			throw "ImageSource_MMap: TIFF has no strip offsets";
+		stripoffsets=(size_t *)malloc(sizeof(size_t)*stripcount);
+		for(int i=0;i<stripcount;++i)
+			stripoffsets[i]=offsets[i];
+
+		float xr=72.0,yr=72.0;
+		uint16 resunit=RESUNIT_INCH;
+		TIFFGetField(file, TIFFTAG_RESOLUTIONUNIT, &resunit);
+		TIFFGetField(file, TIFFTAG_XRESOLUTION, &xr);
+		TIFFGetField(file, TIFFTAG_YRESOLUTION, &yr);
+		if(resunit==RESUNIT_CENTIMETER)
+		{
+			xr*=2.54;
+			yr*=2.54;
+		}
+		xres=int(xr);
+		yres=int(yr);
+
+		char *profbuffer;
+		int proflen;
+		if(TIFFGetField(file, TIFFTAG_ICCPROFILE, &proflen, &profbuffer))
+			SetEmbeddedProfile(new CMSProfile(profbuffer,proflen),true);
+	}
+	catch(...)
+	{
+		TIFFClose(file);
+		throw;
+	}
+	TIFFClose(file);
+}
+
+
+// Uncompressed 8, 24 and 32-bit BMPs with a Windows (40-byte or larger) header.
+
+void ImageSource_MMap::ParseBMP()
+{
+	if(mapsize<54)
+		throw "ImageSource_MMap: BMP header truncated";
+
+	unsigned char *header=map+14;
+	int headerlen=GetLE(header,4);
+	if(headerlen<40 || size_t(14+headerlen)>mapsize)
+		throw "ImageSource_MMap: unsupported BMP header";
+
+	if(GetLE(header+16,4)!=0)
+		throw "ImageSource_MMap: compressed BMPs aren't supported";
+
+	width=int(GetLE(header+4,4));
+	height=int(GetLE(header+8,4));
+	// A negative height signifies a top-to-bottom image.
+	bottomup=true;
+	if(height<0)
+	{
+		height=-height;
+		bottomup=false;
+	}
+
+	int bitsperpixel=GetLE(header+14,2);
+	switch(bitsperpixel)
+	{
+		case 32:
+			samplesperpixel=4;
+			type=IS_TYPE_RGBA;
+			break;
+		case 24:
+			samplesperpixel=3;
+			type=IS_TYPE_RGB;
+			break;
+		case 8:
+			samplesperpixel=1;
+			type=IS_TYPE_GREY;
+			break;
+		default:
+			throw "ImageSource_MMap: unsupported BMP depth";
+	}
+	bgr=true;
+
+	// Resolution is stored in pixels per metre.
+	xres=(GetLE(header+24,4)*254+5000)/10000;
+	yres=(GetLE(header+28,4)*254+5000)/10000;
+
+	if(bitsperpixel==8)
+	{
+		// Greyscale is derived from the palette, with 0 corresponding to white.
+		int cmapentries=GetLE(header+32,4);
+		if(cmapentries==0 || cmapentries>256)
+			cmapentries=256;
+		unsigned char *pal=header+headerlen;
+		if(size_t(pal+cmapentries*4-map)>mapsize)
+			throw "ImageSource_MMap: BMP palette truncated";
+		for(int i=0;i<256;++i)
+			palette[i]=IS_SAMPLEMAX;
+		for(int i=0;i<cmapentries;++i)
+		{
+			int g=(pal[i*4+2]+pal[i*4+1]+pal[i*4])/3;
+			palette[i]=IS_SAMPLEMAX-EIGHTTOIS(g);
+		}
+	}
+
+	bytesperrow=((long(width)*samplesperpixel)+3)&~3;
+	rowsperstrip=height;
+	stripcount=1;
+	stripoffsets=(size_t *)malloc(sizeof(size_t));
+	stripoffsets[0]=GetLE(map+10,4);
+}
+
+
+// Binary greyscale (P5) and RGB (P6) PNMs.  16-bit samples are big-endian.
+
+void ImageSource_MMap::ParsePNM()
+{
+	unsigned char *p=map+2;
+	unsigned char *end=map+mapsize;
+	int values[3];
+
+	for(int i=0;i<3;++i)
+	{
+		// Skip whitespace and comments
+		while(p<end && (isspace(*p) || *p=='#'))
+		{
+			if(*p=='#')
+			{
+				while(p<end && *p!='\n')
+					++p;
+			}
+			else
+				++p;
+		}
+		if(p>=end || !isdigit(*p))
+			throw "ImageSource_MMap: malformed PNM header";
+		long v=0;
+		while(p<end && isdigit(*p))
+		{
+			v=v*10+(*p++-'0');
+			if(v>0x7fffffff)
+				throw "ImageSource_MMap: malformed PNM header";
+		}
+		if(v<1 || (i==2 && v>65535))
+			throw "ImageSource_MMap: malformed PNM header";
+		values[i]=v;
+	}
+	// A single whitespace character separates the header from the data.
+	if(p>=end || !isspace(*p))
+		throw "ImageSource_MMap: malformed PNM header";
+	++p;
+
+	width=values[0];
+	height=values[1];
+	maxval=values[2];
+
+	if(map[1]=='6')
+	{
+		type=IS_TYPE_RGB;
+		samplesperpixel=3;
+	}
+	else
+	{
+		type=IS_TYPE_GREY;
+		samplesperpixel=1;
+	}
+	bytespersample=(maxval>255) ? 2 : 1;
+	swapbytes=(bytespersample==2 && HostIsLittleEndian());
+
+	xres=72;
+	yres=72;
+
+	bytesperrow=long(width)*samplesperpixel*bytespersample;
+	rowsperstrip=height;
+	stripcount=1;
+	stripoffsets=(size_t *)malloc(sizeof(size_t));
+	stripoffsets[0]=p-map;
+}
+
+
+// Makes sure every row lies within the file, and decides whether rows
+// can be handed out directly.
+
+void ImageSource_MMap::CheckLayout()
+{
+	if(width<1 || height<1 || rowsperstrip<1)
+		throw "ImageSource_MMap: image has no data";
+	if((height+rowsperstrip-1)/rowsperstrip>stripcount)
+		throw "ImageSource_MMap: too few strips for image height";
+
+	direct=(bytespersample==2 && !swapbytes && !invert && !bgr && maxval==65535);
+
+	for(int s=0;s*rowsperstrip<height;++s)
+	{
+		long rows=height-s*rowsperstrip;
+		if(rows>rowsperstrip)
+			rows=rowsperstrip;
+		if(stripoffsets[s]>mapsize || size_t(rows*bytesperrow)>mapsize-stripoffsets[s])
+			throw "ImageSource_MMap: image data truncated";
+		// Rows handed out directly must be suitably aligned.
+		if(stripoffsets[s]&(sizeof(ISDataType)-1))
+			direct=false;
+	}
+}
+
+
+inline unsigned char *ImageSource_MMap::RowAddress(int row)
+{
+	row+=roiy;
+	if(bottomup)
+		row=(fullheight-1)-row;
+	int s=row/rowsperstrip;
+	return(map+stripoffsets[s]+long(row-s*rowsperstrip)*bytesperrow+roioffset);
+}
+
+
+bool ImageSource_MMap::SetROI(int x,int y,int w,int h)
+{
+	roiy+=y;
+	roioffset+=long(x)*bytespersample*samplesperpixel;
+	width=w;
+	height=h;
+	currentrow=-1;
+	lastrow=-1;
+	advisedwindow=-1;
+	return(true);
+}
+
+
+void ImageSource_MMap::ConvertRow(unsigned char *src,ISDataType *dst)
+{
+	int samples=width*samplesperpixel;
+
+	if(bgr)
+	{
+		switch(samplesperpixel)
+		{
+			case 4:
+				for(int x=0;x<width;++x)
+				{
+					*dst++=EIGHTTOIS(src[2]);
+					*dst++=EIGHTTOIS(src[1]);
+					*dst++=EIGHTTOIS(src[0]);
+					*dst++=EIGHTTOIS(src[3]);
+					src+=4;
+				}
+				break;
+			case 3:
+				for(int x=0;x<width;++x)
+				{
+					*dst++=EIGHTTOIS(src[2]);
+					*dst++=EIGHTTOIS(src[1]);
+					*dst++=EIGHTTOIS(src[0]);
+					src+=3;
+				}
+				break;
+			case 1:
+				for(int x=0;x<width;++x)
+					*dst++=palette[*src++];
+				break;
+		}
+		return;
+	}
+
+	if(bytespersample==1)
+	{
+		if(maxval==255)
+		{
+			for(int i=0;i<samples;++i)
+			{
+				int t=src[i];
+				if(invert)
+					t=255-t;
+				dst[i]=EIGHTTOIS(t);
+			}
+		}
+		else
+		{
+			for(int i=0;i<samples;++i)
+				dst[i]=(src[i]*IS_SAMPLEMAX)/maxval;
+		}
+	}
+	else
+	{
+		memcpy(dst,src,samples*2);
+		if(swapbytes)
+		{
+			for(int i=0;i<samples;++i)
+				dst[i]=(dst[i]>>8)|(dst[i]<<8);
+		}
+		if(invert)
+		{
+			for(int i=0;i<samples;++i)
+				dst[i]^=65535;
+		}
+		if(maxval!=65535)
+		{
+			for(int i=0;i<samples;++i)
+			{
+				unsigned int t=dst[i];
+				if(t>(unsigned int)maxval)
+					t=maxval;
+				dst[i]=(t*IS_SAMPLEMAX)/maxval;
+			}
+		}
+	}
+}
+
+
+// Asks the kernel to read ahead of the rows being requested, in whichever
+// direction they're being read.  Once the access pattern is seen to be
+// anything other than top-to-bottom, sequential readahead (which discards
+// pages behind the reader) is turned off.
+
+void ImageSource_MMap::Advise(int row,int count)
+{
+#ifndef WIN32
+	if(sequential && lastrow>=0 && row!=lastrow && row!=lastrow+1)
+	{
+		madvise(map,mapsize,MADV_NORMAL);
+		sequential=false;
+	}
+	bool backwards=(row<lastrow);
+	lastrow=row+count-1;
+
+	// The window containing the furthest row requested, plus the next one
+	// in the direction of travel.
+	int window=(backwards ? row : lastrow)/windowrows;
+	if(window==advisedwindow)
+		return;
+	advisedwindow=window;
+
+	int first=window*windowrows;
+	AdviseRows(first,first+windowrows-1);
+	if(backwards)
+		AdviseRows(first-windowrows,first-1);
+	else
+		AdviseRows(first+windowrows,first+2*windowrows-1);
+#endif
+}
+
+
+void ImageSource_MMap::AdviseRows(int first,int last)
+{
+#ifndef WIN32
+	if(first<0)
+		first=0;
+	if(last>=height)
+		last=height-1;
+
+	static long pagesize=sysconf(_SC_PAGESIZE);
+
+	// Strips needn't be adjacent in the file, so each is advised separately.
+	while(first<=last)
+	{
+		int stripend=((first+roiy)/rowsperstrip+1)*rowsperstrip-1-roiy;
+		if(bottomup)
+			stripend=last;	// Bottom-up images are always a single strip.
+		if(stripend>last)
+			stripend=last;
+		unsigned char *a=RowAddress(first)-roioffset;
+		unsigned char *b=RowAddress(stripend)-roioffset;
+		if(b<a)
+		{
+			unsigned char *t=a; a=b; b=t;
+		}
+		size_t start=(a-map)&~(pagesize-1);
+		madvise(map+start,(b-map)+bytesperrow-start,MADV_WILLNEED);
+		first=stripend+1;
+	}
+#endif
+}
+
+
+ISDataType *ImageSource_MMap::GetRow(int row)
+{
+	if(row==currentrow)
+		return(currentptr);
+
+	if(row<0 || row>=height)
+	{
+		Debug[WARN] << "ImageSource_MMap - Warning: row " << row+1 << " of " << height << " requested." << endl;
+		return(rowbuffer);
+	}
+
+	Advise(row,1);
+
+	unsigned char *src=RowAddress(row);
+	if(direct)
+		currentptr=(ISDataType *)src;
+	else
+	{
+		ConvertRow(src,rowbuffer);
+		currentptr=rowbuffer;
+	}
+	currentrow=row;
+	return(currentptr);
+}
+
+
+// Strips of native 16-bit data are returned directly from the mapping,
+// provided the rows are adjacent in the file, and not cropped horizontally.
+
+ISDataType *ImageSource_MMap::GetRows(int row,int count)
+{
+	if(count==1)
+		return(GetRow(row));
+
+	if(row<0 || row+count>height)
+		return(ImageSource::GetRows(row,count));
+
+	Advise(row,count);
+
+	unsigned char *src=RowAddress(row);
+	if(direct && !bottomup && bytesperrow==long(sizeof(ISDataType))*width*samplesperpixel
+		&& RowAddress(row+count-1)==src+long(count-1)*bytesperrow)
+		return((ISDataType *)src);
+
+	MakeStripBuffer(count);
+	int samplesperrow=width*samplesperpixel;
+	for(int i=0;i<count;++i)
+	{
+		ISDataType *dst=stripbuffer+i*samplesperrow;
+		src=RowAddress(row+i);
+		if(direct)
+			memcpy(dst,src,sizeof(ISDataType)*samplesperrow);
+		else
+			ConvertRow(src,dst);
+	}
+	return(stripbuffer);
+}
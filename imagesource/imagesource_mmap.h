@@ -0,0 +1,74 @@
+/*
+ * imagesource_mmap.h - ImageSource loader for uncompressed TIFF, BMP
+ * and PNM files, reading image data straight from a memory mapping.
+ *
+ * Supports 8 and 16 bit greyscale, RGB and CMYK TIFFs with contiguous
+ * samples, 8, 24 and 32-bit BMPs and binary (P5/P6) PNMs.
+ * Where the file's samples are already in native 16-bit format, rows are
+ * returned as pointers into the mapping without being copied at all;
+ * other layouts are converted a row at a time.
+ * Supports random access, and crops by simply offsetting into the mapping.
+ *
+ * Files in any other layout are rejected by throwing an exception, so the
+ * caller can fall back to the regular loader for that format.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#ifndef IMAGESOURCE_MMAP_H
+#define IMAGESOURCE_MMAP_H
+
+#include <stddef.h>
+#include "imagesource.h"
+
+// Amount of data to ask the kernel to read ahead of the current row
+#define IS_MMAP_READAHEAD (4*1024*1024)
+
+class ImageSource_MMap : public ImageSource
+{
+	public:
+	ImageSource_MMap(const char *filename);
+	~ImageSource_MMap();
+	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	bool SetROI(int x,int y,int w,int h);
+	private:
+	void MapFile(const char *filename);
+	void Unmap();
+	void ParseTIFF(const char *filename);
+	void ParseBMP();
+	void ParsePNM();
+	void CheckLayout();
+	unsigned char *RowAddress(int row);
+	void ConvertRow(unsigned char *src,ISDataType *dst);
+	void Advise(int row,int count);
+	void AdviseRows(int first,int last);
+	int fd;
+	unsigned char *map;
+	size_t mapsize;
+	size_t *stripoffsets;	// File offset of each strip's first row.
+	int stripcount;
+	int rowsperstrip;
+	long bytesperrow;
+	int bytespersample;
+	bool bottomup;		// Rows are stored bottom to top (BMP).
+	bool swapbytes;		// 16-bit samples aren't in native byte order.
+	bool invert;
+	bool bgr;			// Colour samples are stored blue first (BMP).
+	bool direct;		// Rows can be returned straight from the mapping.
+	int maxval;
+	int fullheight;		// Height of the image in the file, as opposed to the region of interest.
+	int roiy;
+	long roioffset;		// Byte offset of the region of interest within each row.
+	int palette[256];	// Greyscale values for 8-bit BMPs.
+	ISDataType *currentptr;
+	int lastrow;
+	int windowrows;
+	int advisedwindow;
+	bool sequential;
+};
+
+#endif
@@ -20,25 +20,38 @@
 
 
 #include <iostream>
+#include <map>
+#include <vector>
 
 #include "../support/debug.h"
 
+#include "imagesource_composite.h"
+#include "imagesource_crop.h"
 #include "imagesource_montage.h"
 
 using namespace std;
 
+// A component is either an image supplied up front, or a factory which
+// builds the image when the montage reaches the component's first row.
+
 class ISMontage_Component
 {
 	public:
 	ISMontage_Component(ImageSource_Montage *header,ImageSource *source,int xpos,int ypos);
+	ISMontage_Component(ImageSource_Montage *header,ISMontage_ComponentFactory *factory,int xpos,int ypos);
 	~ISMontage_Component();
-	ISDataType *GetRow(int row);
+	void Build();
+	void Instantiate(int row);
 	int	RowDistance(int row);
 	protected:
+	void Place();
 	ImageSource_Montage *header;
 	ImageSource *source;
+	ISMontage_ComponentFactory *factory;
 	int xpos,ypos;
-	ISMontage_Component *next,*prev;
+	int width,height;
+	int order;		// Components added later are composited underneath earlier ones.
+	bool started;	// Set once rows have been requested from the source.
 	friend class ImageSource_Montage;
 };
 
@@ -52,28 +65,63 @@ int ISMontage_Component::RowDistance(int row)
 	// Else, returns zero.
 	if(row<ypos)
 		return(row-ypos);
-	if(row>=(ypos+source->height))
-		return(row-(ypos+source->height));
+	if(row>=(ypos+height))
+		return(row-(ypos+height)+1);
 	return(0);
 }
 
 
-ISDataType *ISMontage_Component::GetRow(int row)
+// Builds a deferred component's image.
+
+void ISMontage_Component::Build()
 {
-	if(RowDistance(row)!=0)
-		return(NULL);
-	else
-		return(source->GetRow(row-ypos));
+	if(!source && factory)
+	{
+		Debug[TRACE] << "ISMontage - instantiating component at " << xpos << ", " << ypos << endl;
+		source=factory->GetImageSource();
+		delete factory;
+		factory=NULL;
+		if(source)
+		{
+			if(STRIP_ALPHA(source->type)!=STRIP_ALPHA(header->type))
+			{
+				delete source;
+				source=NULL;
+				throw "Can't yet mix different colour spaces on one page";
+			}
+			// The montage's size was fixed using the promised size, so the image mustn't exceed it.
+			if(source->width>width || source->height>height)
+			{
+				Debug[WARN] << "ISMontage - component is " << source->width << " x " << source->height
+					<< ", expected " << width << " x " << height << " - cropping." << endl;
+				source=ISCropImage(source,0,0,width,height);
+			}
+			width=source->width;
+			height=source->height;
+		}
+		else
+			Debug[WARN] << "ISMontage - factory failed to supply a component" << endl;
+	}
 }
 
 
-ISMontage_Component::ISMontage_Component(ImageSource_Montage *header,ImageSource *src,int xpos,int ypos)
-	: header(header), source(src), xpos(xpos), ypos(ypos), next(NULL), prev(NULL)
+// Builds a deferred component's image if need be, and gives a sequential source
+// the chance to skip any leading rows which aren't wanted.
+
+void ISMontage_Component::Instantiate(int row)
 {
-	if((next=header->first))
-		next->prev=this;
-	header->first=this;
+	Build();
+	if(source && !started)
+	{
+		if(row>ypos)
+			source->SkipToRow(row-ypos);
+		started=true;
+	}
+}
+
 
+void ISMontage_Component::Place()
+{
 	if(xpos<0)
 	{
 		Debug[WARN] << "ISMontage - Warning: xpos < 0 - clamping." << endl;
@@ -86,11 +134,30 @@ ISMontage_Component::ISMontage_Component(ImageSource_Montage *header,ImageSource
 		ypos=0;
 	}
 
-	if(header->height<(ypos+source->height))
-		header->height=ypos+source->height;
+	if(header->height<(ypos+height))
+		header->height=ypos+height;
+
+	if(header->width<(xpos+width))
+		header->width=xpos+width;
 
-	if(header->width<(xpos+source->width))
-		header->width=xpos+source->width;
+	order=header->componentcount++;
+	header->pending.insert(std::pair<int,ISMontage_Component *>(ypos,this));
+}
+
+
+ISMontage_Component::ISMontage_Component(ImageSource_Montage *header,ImageSource *src,int xpos,int ypos)
+	: header(header), source(src), factory(NULL), xpos(xpos), ypos(ypos), width(src->width), height(src->height),
+	order(0), started(false)
+{
+	Place();
+}
+
+
+ISMontage_Component::ISMontage_Component(ImageSource_Montage *header,ISMontage_ComponentFactory *factory,int xpos,int ypos)
+	: header(header), source(NULL), factory(factory), xpos(xpos), ypos(ypos), width(factory->width), height(factory->height),
+	order(0), started(false)
+{
+	Place();
 }
 
 
@@ -98,17 +165,13 @@ ISMontage_Component::~ISMontage_Component()
 {
 	if(source)
 		delete source;
-	if(prev)
-		prev->next=next;
-	else
-		header->first=next;
-	if(next)
-		next->prev=prev;
+	if(factory)
+		delete factory;
 }
 
 
 ImageSource_Montage::ImageSource_Montage(IS_TYPE type,int resolution, int samplesperpixel)
-	: ImageSource(), first(NULL)
+	: ImageSource(), componentcount(0)
 {
 	xres=resolution;
 	yres=resolution;
@@ -152,8 +215,10 @@ ImageSource_Montage::ImageSource_Montage(IS_TYPE type,int resolution, int sample
 
 ImageSource_Montage::~ImageSource_Montage()
 {
-	while(first)
-		delete first;
+	for(std::list<ISMontage_Component *>::iterator it=active.begin();it!=active.end();++it)
+		delete *it;
+	for(std::multimap<int,ISMontage_Component *>::iterator it=pending.begin();it!=pending.end();++it)
+		delete it->second;
 }
 
 
@@ -168,14 +233,211 @@ void ImageSource_Montage::Add(ImageSource *is,int xpos,int ypos)
 }
 
 
+void ImageSource_Montage::Add(ISMontage_ComponentFactory *factory,int xpos,int ypos)
+{
+	Debug[TRACE] << "Adding deferred " << factory->width << " x " << factory->height << " image at " << xpos << ", " << ypos << endl;
+	new ISMontage_Component(this,factory,xpos,ypos);
+
+	// There's no way of knowing whether the image will support random access.
+	randomaccess=false;
+}
+
+
+// Factories are normally called from whichever thread reads the montage, so
+// this must be used if that's not the thread which built it.
+
+void ImageSource_Montage::BuildComponents()
+{
+	for(std::multimap<int,ISMontage_Component *>::iterator it=pending.begin();it!=pending.end();++it)
+		it->second->Build();
+}
+
+
 ISDataType *ImageSource_Montage::GetRow(int row)
 {
 	if(!rowbuffer)
 		MakeRowBuffer();
 
-	ISDataType *src;
-	ISDataType *dst=rowbuffer;
+	Composite(row,1,rowbuffer);
+
+	return(rowbuffer);
+}
+
+
+ISDataType *ImageSource_Montage::GetRows(int row,int count)
+{
+	MakeStripBuffer(count);
+
+	Composite(row,count,stripbuffer);
+
+	return(stripbuffer);
+}
+
+
+// Moves components whose first row lies before lastrow from the pending index
+// to the active list, building any deferred images.  Components which the
+// montage has already passed are discarded without ever being built.
+
+void ImageSource_Montage::Activate(int row,int lastrow)
+{
+	while(!pending.empty() && pending.begin()->first<lastrow)
+	{
+		ISMontage_Component *mc=pending.begin()->second;
+		pending.erase(pending.begin());
+#ifndef MONTAGE_RANDOM_ACCESS
+		if(mc->RowDistance(row)>0)
+		{
+			delete mc;
+			continue;
+		}
+#endif
+		// Keep the active list in compositing order.
+		std::list<ISMontage_Component *>::iterator it=active.begin();
+		while(it!=active.end() && (*it)->order>mc->order)
+			++it;
+		active.insert(it,mc);
+
+		mc->Instantiate(row);
+	}
+}
+
+
+// Marks the span from start to end of a row as uniform or not.  The row is
+// described by a map from the start of each span to whether it's uniform.
+
+static void PaintRun(std::map<int,bool> &spans,int start,int end,int width,bool uniform)
+{
+	std::map<int,bool>::iterator it=spans.upper_bound(end);
+	--it;
+	bool after=it->second;
+	spans.erase(spans.lower_bound(start),spans.upper_bound(end));
+	spans[start]=uniform;
+	if(end<width)
+		spans[end]=after;
+}
+
+
+// Renders count rows starting at row into dst.  Each component overlapping
+// the strip is asked for its rows in a single GetRows() call.
+
+void ImageSource_Montage::Composite(int row,int count,ISDataType *dst)
+{
+	int samplesperrow=width*samplesperpixel;
+
+	// The background is uniform until components are drawn over it.
+	std::vector<std::map<int,bool> > spans(count);
+	for(int r=0;r<count;++r)
+	{
+		FillBackground(dst+r*samplesperrow);
+		spans[r][0]=true;
+	}
 
+	Activate(row,row+count);
+
+	std::list<ISMontage_Component *>::iterator it=active.begin();
+	while(it!=active.end())
+	{
+		ISMontage_Component *mc=*it;
+		if(mc->source)
+		{
+			int firstrow=row;
+			if(firstrow<mc->ypos)
+				firstrow=mc->ypos;
+			int lastrow=row+count;
+			if(lastrow>(mc->ypos+mc->height))
+				lastrow=mc->ypos+mc->height;
+
+			if(firstrow<lastrow)
+			{
+				int srcsamplesperrow=mc->source->width*mc->source->samplesperpixel;
+				ISDataType *src=mc->source->GetRows(firstrow-mc->ypos,lastrow-firstrow);
+				for(int r=firstrow;r<lastrow;++r)
+				{
+					CompositeRow(mc,src,dst+(r-row)*samplesperrow);
+					src+=srcsamplesperrow;
+
+					// Runs in an opaque component survive compositing unchanged.
+					int x=0;
+					while(x<mc->source->width)
+					{
+						int run=x-mc->source->width;
+						if(!HAS_ALPHA(mc->source->type))
+							run=mc->source->GetUniformRun(r-mc->ypos,x);
+						if(run==0)
+							run=x-mc->source->width;
+						int end=x+(run>0 ? run : -run);
+						PaintRun(spans[r-row],mc->xpos+x,mc->xpos+end,width,run>0);
+						x=end;
+					}
+				}
+			}
+		}
+#ifndef MONTAGE_RANDOM_ACCESS
+		// Once a component's last row has been composited it's no longer needed.
+		if(mc->RowDistance(row+count)>0)
+		{
+			delete mc;
+			it=active.erase(it);
+			continue;
+		}
+#endif
+		++it;
+	}
+
+	runs.Clear(row,width);
+	for(int r=0;r<count;++r)
+	{
+		std::map<int,bool>::iterator sp=spans[r].begin();
+		while(sp!=spans[r].end())
+		{
+			int start=sp->first;
+			bool uniform=sp->second;
+			++sp;
+			int end=(sp!=spans[r].end()) ? sp->first : width;
+			runs.AddRun(uniform ? end-start : start-end);
+		}
+		runs.EndRow();
+	}
+}
+
+
+int ImageSource_Montage::GetUniformRun(int row,int x)
+{
+	return(runs.GetUniformRun(row,x));
+}
+
+
+// Components which lie entirely above the row are no longer needed, and those
+// which straddle it can skip their leading rows.
+
+void ImageSource_Montage::SkipToRow(int row)
+{
+	Activate(row,row+1);
+
+	std::list<ISMontage_Component *>::iterator it=active.begin();
+	while(it!=active.end())
+	{
+		ISMontage_Component *mc=*it;
+		if(mc->source && row>mc->ypos && row<(mc->ypos+mc->height))
+		{
+			mc->source->SkipToRow(row-mc->ypos);
+			mc->started=true;
+		}
+#ifndef MONTAGE_RANDOM_ACCESS
+		if(mc->RowDistance(row)>0)
+		{
+			delete mc;
+			it=active.erase(it);
+			continue;
+		}
+#endif
+		++it;
+	}
+}
+
+
+void ImageSource_Montage::FillBackground(ISDataType *dst)
+{
 	switch(type)
 	{
 		case IS_TYPE_RGBA:
@@ -196,97 +458,37 @@ ISDataType *ImageSource_Montage::GetRow(int row)
 				dst[i]=0;
 			break;
 	}
+}
 
-	ISMontage_Component *mc=first;
-	while(mc)
+
+void ImageSource_Montage::CompositeRow(ISMontage_Component *mc,ISDataType *src,ISDataType *dst)
+{
+	if(HAS_ALPHA(mc->source->type))
+	{
+		// If the target image has an alpha channel too, then we must choose
+		// a target alpha value - the highest alpha level encountered.
+		ISCompositeRow(dst+mc->xpos*samplesperpixel,src,mc->source->samplesperpixel,HAS_ALPHA(type),mc->source->width);
+	}
+	else
 	{
-		if((src=mc->GetRow(row)))
+		// Source component has no alpha channel, but the target image does.
+		if(HAS_ALPHA(type))
 		{
-			if(HAS_ALPHA(mc->source->type))
+			for(int i=0;i<mc->source->width;++i)
 			{
-				if(HAS_ALPHA(type))
+				int j;
+				for(j=0;j<samplesperpixel-1;++j)
 				{
-					// If the target image has an alpha channel too, then we
-					// must choose a target alpha value.  Perhaps the highest alpha
-					// level encountered?
-					for(int i=0;i<mc->source->width;++i)
-					{
-						int a=src[(i+1)*mc->source->samplesperpixel-1];
-						int ia=IS_SAMPLEMAX-a;
-						int xp=(mc->xpos+i)*samplesperpixel;
-						int sp=i*mc->source->samplesperpixel;
-						int j;
-						for(j=0;j<samplesperpixel-1;++j)
-						{
-							int t=dst[xp+j];
-							t*=ia;
-							int t2=src[sp+j];
-							t2*=a;
-							dst[xp+j]=(t+t2)/IS_SAMPLEMAX;
-						}
-						if(a>0)
-						{
-							if(dst[xp+j]<a)
-								dst[xp+j]=a;
-//							dst[xp+j]=ia;
-						}
-//						if(dst[xp+j]>a)
-//							dst[xp+j]=0;
-//							dst[xp+j]=0;
-					}
-				}
-				else
-				{
-					// The source image has an alpha channel, but is being composited
-					// onto an image without.
-					for(int i=0;i<mc->source->width;++i)
-					{
-						int a=src[(i+1)*mc->source->samplesperpixel-1];
-//						Debug[TRACE] << "Alpha: " << a << endl;
-						int ia=IS_SAMPLEMAX-a;
-						int xp=(mc->xpos+i)*samplesperpixel;
-						int sp=i*mc->source->samplesperpixel;
-						for(int j=0;j<samplesperpixel;++j)
-						{
-							int t=dst[xp+j];
-							t*=ia;
-							int t2=src[sp+j];
-							t2*=a;
-							dst[xp+j]=(t+t2)/IS_SAMPLEMAX;
-						}
-					}
-				}
-			}
-			else
-			{
-				// Source component has no alpha channel, but the target image does.
-				if(HAS_ALPHA(type))
-				{
-					for(int i=0;i<mc->source->width;++i)
-					{
-						int j;
-						for(j=0;j<samplesperpixel-1;++j)
-						{
-							dst[(mc->xpos+i)*samplesperpixel+j]=src[i*mc->source->samplesperpixel+j];
-						}
-						dst[(mc->xpos+i)*samplesperpixel+j]=IS_SAMPLEMAX;
-					}
-				}
-				else
-				{
-					// Simplest case - neither source nor destination has an alpha channel.
-					for(int i=0;i<mc->source->width*samplesperpixel;++i)
-						dst[mc->xpos*samplesperpixel+i]=src[i];
+					dst[(mc->xpos+i)*samplesperpixel+j]=src[i*mc->source->samplesperpixel+j];
 				}
+				dst[(mc->xpos+i)*samplesperpixel+j]=IS_SAMPLEMAX;
 			}
 		}
-		ISMontage_Component *nmc=mc->next;
-#ifndef MONTAGE_RANDOM_ACCESS
-		if(mc->RowDistance(row)>0)
-			delete mc;
-#endif
-		mc=nmc;
+		else
+		{
+			// Simplest case - neither source nor destination has an alpha channel.
+			for(int i=0;i<mc->source->width*samplesperpixel;++i)
+				dst[mc->xpos*samplesperpixel+i]=src[i];
+		}
 	}
-
-	return(rowbuffer);
 }
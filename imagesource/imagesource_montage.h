@@ -3,6 +3,17 @@
  * Composites multiple images into a single image.
  * Supports Random Access if and only if all source images also support it.
  *
+ * Components can be supplied either as images, or as factories which build
+ * the image only when the montage reaches its first row, so a page with many
+ * images needn't have them all open at once - unless the montage is to be read
+ * from another thread, in which case BuildComponents() must be called first,
+ * since the factories needn't be thread-safe.  Components are held in an index
+ * sorted by their first row, and each is discarded after its last row.
+ *
+ * The background, and any runs reported by opaque components, are tracked
+ * while compositing, so that GetUniformRun() can describe the page's margins
+ * and gutters to later stages.
+ *
  * Copyright (c) 2004, 2005 by Alastair M. Robinson
  * Distributed under the terms of the GNU General Public License -
  * see the file named "COPYING" for more details.
@@ -12,20 +23,56 @@
 #ifndef IMAGESOURCE_MONTAGE_H
 #define IMAGESOURCE_MONTAGE_H
 
+#include <map>
+#include <list>
+
 #include "imagesource.h"
 #include "imagesource_util.h"
+#include "imagesource_runs.h"
 
 class ISMontage_Component;
 
+
+// Subclass this to add a component whose image is built on demand.  The size
+// of the image must be known in advance, since it determines the size of the
+// montage.  GetImageSource() may return NULL if the image can't be built, in
+// which case the component's area is left blank.
+
+class ISMontage_ComponentFactory
+{
+	public:
+	ISMontage_ComponentFactory(int width,int height) : width(width), height(height)
+	{
+	}
+	virtual ~ISMontage_ComponentFactory()
+	{
+	}
+	virtual ImageSource *GetImageSource()=0;
+	int width,height;
+};
+
+
 class ImageSource_Montage : public ImageSource
 {
 	public:
 	ImageSource_Montage(IS_TYPE type,int res=360,int samplesperpixel=0);	// Samplesperpixel is only needed for DeviceN type
 	~ImageSource_Montage();
 	virtual void Add(ImageSource *is,int xpos,int ypos);
+	virtual void Add(ISMontage_ComponentFactory *factory,int xpos,int ypos);	// Takes ownership of the factory.
+	void BuildComponents();	// Builds all deferred components immediately.
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	void SkipToRow(int row);
+	int GetUniformRun(int row,int x);
 	protected:
-	ISMontage_Component *first;
+	void Activate(int row,int lastrow);
+	void Composite(int row,int count,ISDataType *dst);
+	void FillBackground(ISDataType *dst);
+	void CompositeRow(ISMontage_Component *mc,ISDataType *src,ISDataType *dst);
+	std::multimap<int,ISMontage_Component *> pending;	// Components not yet reached, by first row.
+	std::list<ISMontage_Component *> active;	// Components in use, in compositing order.
+	int componentcount;
+	ISUniformRuns runs;	// Blank areas and solid components in the last strip.
 	friend class ISMontage_Component;
 };
 
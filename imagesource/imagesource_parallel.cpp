@@ -0,0 +1,270 @@
+/*
+ * imagesource_parallel.cpp - renders an ImageSource chain on several threads.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../support/debug.h"
+
+#include "imagesource_parallel.h"
+
+using namespace std;
+
+// Number of bands each worker may render ahead of the consumer.
+#define IS_PARALLEL_BUFFERS 2
+
+
+class ISParallel_Worker : public ThreadFunction
+{
+	public:
+	ISParallel_Worker(ImageSource_Parallel &header,ImageSource *chain,int index);
+	~ISParallel_Worker();
+	int Entry(Thread &t);
+	protected:
+	ImageSource_Parallel &header;
+	ImageSource *chain;
+	int index;
+	ISDataType *buffers[IS_PARALLEL_BUFFERS];
+	int readyband[IS_PARALLEL_BUFFERS];	// The band held in each buffer, or -1 if free.
+	ISUniformRuns runs[IS_PARALLEL_BUFFERS];
+	Thread thread;
+	friend class ImageSource_Parallel;
+};
+
+
+ISParallel_Worker::ISParallel_Worker(ImageSource_Parallel &header,ImageSource *chain,int index)
+	: ThreadFunction(), header(header), chain(chain), index(index), thread(this)
+{
+	for(int i=0;i<IS_PARALLEL_BUFFERS;++i)
+	{
+		buffers[i]=(ISDataType *)malloc(sizeof(ISDataType)*header.width*header.samplesperpixel*header.bandrows);
+		readyband[i]=-1;
+	}
+}
+
+
+ISParallel_Worker::~ISParallel_Worker()
+{
+	// The thread must be finished before the chain it's using is deleted.
+	if(!thread.TestFinished())
+		thread.WaitFinished();
+	if(chain)
+		delete chain;
+	for(int i=0;i<IS_PARALLEL_BUFFERS;++i)
+		free(buffers[i]);
+}
+
+
+int ISParallel_Worker::Entry(Thread &t)
+{
+	int samplesperrow=header.width*header.samplesperpixel;
+	for(int band=index;band<header.bandcount;band+=header.workercount)
+	{
+		int slot=(band/header.workercount)%IS_PARALLEL_BUFFERS;
+
+		// Wait for the consumer to finish with the band previously held in this slot.
+		header.cond.ObtainMutex();
+		while(readyband[slot]!=-1 && !header.cancelled)
+			header.cond.WaitCondition();
+		bool cancelled=header.cancelled;
+		header.cond.ReleaseMutex();
+		if(cancelled)
+			return(0);
+
+		int firstrow=band*header.bandrows;
+		int lastrow=firstrow+header.bandrows;
+		if(lastrow>header.height)
+			lastrow=header.height;
+
+		try
+		{
+			runs[slot].Clear(firstrow,header.width);
+			for(int row=firstrow;row<lastrow;row+=IS_STRIPROWS)
+			{
+				int count=lastrow-row;
+				if(count>IS_STRIPROWS)
+					count=IS_STRIPROWS;
+				ISDataType *src=chain->GetRows(row,count);
+				memcpy(buffers[slot]+(row-firstrow)*samplesperrow,src,sizeof(ISDataType)*samplesperrow*count);
+				for(int r=row;r<row+count;++r)
+					runs[slot].AddRow(chain,r);
+			}
+		}
+		catch(const char *err)
+		{
+			Debug[ERROR] << "ImageSource_Parallel - worker " << index << " failed: " << err << endl;
+			header.cond.ObtainMutex();
+			header.error=err;
+			header.cond.Broadcast();
+			header.cond.ReleaseMutex();
+			return(-1);
+		}
+		catch(...)
+		{
+			Debug[ERROR] << "ImageSource_Parallel - worker " << index << " failed" << endl;
+			header.cond.ObtainMutex();
+			header.error="ImageSource_Parallel: rendering failed";
+			header.cond.Broadcast();
+			header.cond.ReleaseMutex();
+			return(-1);
+		}
+
+		header.cond.ObtainMutex();
+		readyband[slot]=band;
+		header.cond.Broadcast();
+		header.cond.ReleaseMutex();
+	}
+	return(0);
+}
+
+
+ImageSource_Parallel::ImageSource_Parallel(ImageSource *source,ISParallel_ChainFactory *factory,int threads,int bandrows)
+	: ImageSource(source), factory(factory), workers(NULL), workercount(0), bandrows(bandrows),
+	currentband(-1), bandbuffer(NULL), bandruns(NULL), cancelled(false), error(NULL)
+{
+	randomaccess=false;
+
+	if(threads<1)
+		threads=Thread::GetProcessorCount();
+	bandcount=(height+bandrows-1)/bandrows;
+	if(threads>bandcount)
+		threads=bandcount;
+	if(threads<1)
+		threads=1;
+
+	Debug[TRACE] << "ImageSource_Parallel: rendering " << bandcount << " bands on " << threads << " threads" << endl;
+
+	// All chains are built before any thread starts, so the factory is only
+	// ever called from this thread.
+	workers=new ISParallel_Worker *[threads];
+	workers[workercount++]=new ISParallel_Worker(*this,source,0);
+	try
+	{
+		while(workercount<threads)
+		{
+			ImageSource *chain=factory->GetImageSource();
+			if(!chain)
+				throw "ImageSource_Parallel: factory didn't supply an image";
+			workers[workercount]=new ISParallel_Worker(*this,chain,workercount);
+			++workercount;
+		}
+	}
+	catch(...)
+	{
+		// No threads have been started yet, so the workers can simply be discarded.
+		for(int i=0;i<workercount;++i)
+			delete workers[i];
+		delete[] workers;
+		delete factory;
+		throw;
+	}
+
+	for(int i=0;i<workercount;++i)
+		workers[i]->thread.Start();
+}
+
+
+ImageSource_Parallel::~ImageSource_Parallel()
+{
+	cond.ObtainMutex();
+	cancelled=true;
+	cond.Broadcast();
+	cond.ReleaseMutex();
+
+	for(int i=0;i<workercount;++i)
+		delete workers[i];
+	delete[] workers;
+
+	// The factory may own resources used by the chains, so must outlive them.
+	delete factory;
+}
+
+
+// Frees any buffer holding a band the consumer has moved past.
+// Must be called with the mutex held.
+
+bool ImageSource_Parallel::ReleaseBands(int band)
+{
+	bool released=false;
+	for(int i=0;i<workercount;++i)
+	{
+		for(int j=0;j<IS_PARALLEL_BUFFERS;++j)
+		{
+			if(workers[i]->readyband[j]!=-1 && workers[i]->readyband[j]<band)
+			{
+				workers[i]->readyband[j]=-1;
+				released=true;
+			}
+		}
+	}
+	return(released);
+}
+
+
+void ImageSource_Parallel::WaitBand(int band)
+{
+	if(band<currentband)
+		throw "ImageSource_Parallel: rows must be requested in order";
+
+	ISParallel_Worker *w=workers[band%workercount];
+	int slot=(band/workercount)%IS_PARALLEL_BUFFERS;
+
+	cond.ObtainMutex();
+	if(ReleaseBands(band))
+		cond.Broadcast();
+	while(w->readyband[slot]!=band && !error)
+	{
+		cond.WaitCondition();
+		// If the consumer has skipped ahead, workers may still deliver bands
+		// it no longer needs - these must be released to let them continue.
+		if(ReleaseBands(band))
+			cond.Broadcast();
+	}
+	const char *err=error;
+	cond.ReleaseMutex();
+
+	if(err)
+		throw err;
+
+	bandbuffer=w->buffers[slot];
+	bandruns=&w->runs[slot];
+	currentband=band;
+}
+
+
+ISDataType *ImageSource_Parallel::GetRow(int row)
+{
+	int band=row/bandrows;
+	if(band!=currentband)
+		WaitBand(band);
+	return(bandbuffer+(row-band*bandrows)*width*samplesperpixel);
+}
+
+
+// Strips which lie within a single band are served directly from the band buffer.
+
+ISDataType *ImageSource_Parallel::GetRows(int row,int count)
+{
+	int band=row/bandrows;
+	if(((row+count-1)/bandrows)!=band)
+		return(ImageSource::GetRows(row,count));
+
+	if(band!=currentband)
+		WaitBand(band);
+	return(bandbuffer+(row-band*bandrows)*width*samplesperpixel);
+}
+
+
+int ImageSource_Parallel::GetUniformRun(int row,int x)
+{
+	if(!bandruns || row/bandrows!=currentband)
+		return(x-width);
+	return(bandruns->GetUniformRun(row,x));
+}
@@ -0,0 +1,84 @@
+/*
+ * imagesource_parallel.h - renders an ImageSource chain on several threads.
+ *
+ * The output is divided into horizontal bands, which are distributed
+ * round-robin between a number of worker threads.  Each worker owns an
+ * independent copy of the filter chain, obtained from a factory, and renders
+ * its bands ahead of the consumer into a small number of band buffers.
+ *
+ * Since each worker only pulls the rows its own bands need, stages which
+ * don't depend on state from earlier rows (scaling, colour management,
+ * compositing) are split between the workers, while sequential loaders
+ * simply read through the rows they don't need.
+ *
+ * The chain's GetUniformRun() reports are recorded along with each band,
+ * since the chain itself has moved on by the time the band is consumed.
+ *
+ * Rows must be requested in order - random access is not supported.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#ifndef IMAGESOURCE_PARALLEL_H
+#define IMAGESOURCE_PARALLEL_H
+
+#include "imagesource.h"
+#include "imagesource_runs.h"
+#include "../support/thread.h"
+
+#define IS_PARALLEL_BANDROWS 64
+
+
+// Subclass this to provide the parallel renderer with further independent
+// copies of a filter chain.  GetImageSource() is only called from the thread
+// which constructs the ImageSource_Parallel, and the factory must keep any
+// resources used by the chains (such as transform factories) alive until
+// it's deleted.  Since the chains are read on the worker threads, they must
+// be fully built - nothing should be built on demand as rows are read.
+
+class ISParallel_ChainFactory
+{
+	public:
+	ISParallel_ChainFactory()
+	{
+	}
+	virtual ~ISParallel_ChainFactory()
+	{
+	}
+	virtual ImageSource *GetImageSource()=0;
+};
+
+
+class ISParallel_Worker;
+
+class ImageSource_Parallel : public ImageSource
+{
+	public:
+	// Source is the first copy of the chain; any others are obtained from the factory.
+	// Takes ownership of both.  If threads is zero, one worker per processor is used.
+	ImageSource_Parallel(ImageSource *source,ISParallel_ChainFactory *factory,int threads=0,int bandrows=IS_PARALLEL_BANDROWS);
+	~ImageSource_Parallel();
+	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	int GetUniformRun(int row,int x);
+	protected:
+	void WaitBand(int band);
+	bool ReleaseBands(int band);
+	ISParallel_ChainFactory *factory;
+	ISParallel_Worker **workers;
+	int workercount;
+	int bandrows;
+	int bandcount;
+	int currentband;
+	ISDataType *bandbuffer;
+	ISUniformRuns *bandruns;
+	ThreadCondition cond;
+	bool cancelled;
+	const char *error;
+	friend class ISParallel_Worker;
+};
+
+#endif
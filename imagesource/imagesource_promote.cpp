@@ -16,6 +16,7 @@
 #include <math.h>
 
 #include "imagesource_promote.h"
+#include "imagesource_crop.h"
 
 using namespace std;
 
@@ -26,6 +27,18 @@ ImageSource_Promote::~ImageSource_Promote()
 }
 
 
+// Promotion works pixel by pixel, so the source need only supply the same window.
+
+bool ImageSource_Promote::SetROI(int x,int y,int w,int h)
+{
+	source=ISCropImage(source,x,y,w,h);
+	width=source->width;
+	height=source->height;
+	currentrow=-1;
+	return(true);
+}
+
+
 ISDataType *ImageSource_Promote::GetRow(int row)
 {
 	int i;
@@ -21,6 +21,7 @@ class ImageSource_Promote : public ImageSource
 	ImageSource_Promote(ImageSource *source,IS_TYPE type);
 	~ImageSource_Promote();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	private:
 	ImageSource *source;
 };
@@ -15,6 +15,7 @@
 
 #include "../support/debug.h"
 
+#include "imagesource_crop.h"
 #include "imagesource_rotate.h"
 
 using namespace std;
@@ -29,233 +30,278 @@ ImageSource_Rotate::~ImageSource_Rotate()
 
 
 ISDataType *ImageSource_Rotate::GetRow(int row)
+{
+	if(rotation==0)
+	{
+		// FIXME - if source doesn't support random access, image needs
+		// to be cached.
+		return(source->GetRow(row));
+	}
+
+	if((row<spanfirstrow) || (row>=(spanfirstrow+spanrows)))
+		FillSpan(row);
+
+	row-=spanfirstrow;
+	return(spanbuffer+row*samplesperrow);
+}
+
+
+// Since the span buffer already holds the rotated rows contiguously, a strip
+// can be served directly from it, provided it fits within a single span.
+
+ISDataType *ImageSource_Rotate::GetRows(int row,int count)
+{
+	if(rotation==0)
+		return(source->GetRows(row,count));
+
+	if(count>spanrows)
+		return(ImageSource::GetRows(row,count));
+
+	if((row<spanfirstrow) || ((row+count)>(spanfirstrow+spanrows)))
+		FillSpan(row);
+
+	row-=spanfirstrow;
+	return(spanbuffer+row*samplesperrow);
+}
+
+
+void ImageSource_Rotate::FillSpan(int row)
 {
 	int x;
 	int firstrow,lastrow;
 	ISDataType *dst;
 	ISDataType *src;
 	ISDataType c;
-	
+
+	spanfirstrow=row;
+
+	firstrow=row;
+	lastrow=row+spanrows;
+	if(lastrow>height)
+		lastrow=height;
+
 	switch(rotation)
 	{
-		case 0:
-			// FIXME - if source doesn't support random access, image needs
-			// to be cached.
-			return(source->GetRow(row));
-			break;
 		case 90:
-			if((row<spanfirstrow) || (row>=(spanfirstrow+spanrows)))
+			for(int i=0;i<source->height;++i)
 			{
-				spanfirstrow=row;
-
-				firstrow=row;
-				lastrow=row+spanrows;
-				if(lastrow>height)
-					lastrow=height;
-
-				for(int i=0;i<source->height;++i)
+				src=source->GetRow(i);
+				dst=spanbuffer+samplesperpixel*i;
+				switch(samplesperpixel)
 				{
-					src=source->GetRow(i);
-					dst=spanbuffer+samplesperpixel*i;
-					switch(samplesperpixel)
-					{
-						case 1:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=(source->width-1)-x;
-								c=src[sx];
-								dst[(x-firstrow)*samplesperrow]=c;
-							}
-							break;
-						case 3:
-							for(x=firstrow;x<lastrow;++x)
+					case 1:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=(source->width-1)-x;
+							c=src[sx];
+							dst[(x-firstrow)*samplesperrow]=c;
+						}
+						break;
+					case 3:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=(source->width-1)-x;
+							c=src[sx*3];
+							dst[(x-firstrow)*samplesperrow]=c;
+							c=src[sx*3+1];
+							dst[(x-firstrow)*samplesperrow+1]=c;
+							c=src[sx*3+2];
+							dst[(x-firstrow)*samplesperrow+2]=c;
+						}
+						break;
+					case 4:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=(source->width-1)-x;
+							c=src[sx*4];
+							dst[(x-firstrow)*samplesperrow]=c;
+							c=src[sx*4+1];
+							dst[(x-firstrow)*samplesperrow+1]=c;
+							c=src[sx*4+2];
+							dst[(x-firstrow)*samplesperrow+2]=c;
+							c=src[sx*4+3];
+							dst[(x-firstrow)*samplesperrow+3]=c;
+						}
+						break;
+					default:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=(source->width-1)-x;
+							for(int s=0;s<samplesperpixel;++s)
 							{
-								int sx=(source->width-1)-x;
-								c=src[sx*3];
-								dst[(x-firstrow)*samplesperrow]=c;
-								c=src[sx*3+1];
-								dst[(x-firstrow)*samplesperrow+1]=c;
-								c=src[sx*3+2];
-								dst[(x-firstrow)*samplesperrow+2]=c;
+								c=src[sx*samplesperpixel+s];
+								dst[(x-firstrow)*samplesperrow+s]=c;
 							}
-							break;
-						case 4:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=(source->width-1)-x;
-								c=src[sx*4];
-								dst[(x-firstrow)*samplesperrow]=c;
-								c=src[sx*4+1];
-								dst[(x-firstrow)*samplesperrow+1]=c;
-								c=src[sx*4+2];
-								dst[(x-firstrow)*samplesperrow+2]=c;
-								c=src[sx*4+3];
-								dst[(x-firstrow)*samplesperrow+3]=c;
-							}
-							break;
-						default:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=(source->width-1)-x;
-								for(int s=0;s<samplesperpixel;++s)
-								{
-									c=src[sx*samplesperpixel+s];
-									dst[(x-firstrow)*samplesperrow+s]=c;
-								}
-							}
-							break;
-					}
-					if(TestBreak())
-						i=source->height;
+						}
+						break;
 				}
+				if(TestBreak())
+					i=source->height;
 			}
-			row-=spanfirstrow;
-			return(spanbuffer+row*samplesperrow);		
 			break;
 		case 180:
 			// FIXME: support partial image caching here.
-
-			if((row<spanfirstrow) || (row>=(spanfirstrow+spanrows)))
+			// The entire image is cached, so the span always starts at row zero.
+			spanfirstrow=0;
+			for(int y=0;y<height;++y)
 			{
-				spanfirstrow=row;
-
-				firstrow=row;
-				lastrow=row+spanrows;
-				if(lastrow>height)
-					lastrow=height;
-
-				for(int y=0;y<height;++y)
+				src=source->GetRow(y);
+				dst=spanbuffer+((height-1)-y)*samplesperrow;
+				switch(samplesperpixel)
 				{
-					src=source->GetRow(y);
-					dst=spanbuffer+((height-1)-y)*samplesperrow;
-					switch(samplesperpixel)
-					{
-						case 1:
-							for(x=0;x<width;++x)
-							{
-								int sx=(width-1)-x;
-								c=src[sx];
-								dst[x]=c;
-							}
-							break;
-						case 3:
-							for(x=0;x<width;++x)
+					case 1:
+						for(x=0;x<width;++x)
+						{
+							int sx=(width-1)-x;
+							c=src[sx];
+							dst[x]=c;
+						}
+						break;
+					case 3:
+						for(x=0;x<width;++x)
+						{
+							int sx=(width-1)-x;
+							c=src[sx*3];
+							dst[x*3]=c;
+							c=src[sx*3+1];
+							dst[x*3+1]=c;
+							c=src[sx*3+2];
+							dst[x*3+2]=c;
+						}
+						break;
+					case 4:
+						for(x=0;x<width;++x)
+						{
+							int sx=(width-1)-x;
+							c=src[sx*4];
+							dst[x*4]=c;
+							c=src[sx*4+1];
+							dst[x*4+1]=c;
+							c=src[sx*4+2];
+							dst[x*4+2]=c;
+							c=src[sx*4+3];
+							dst[x*4+3]=c;
+						}
+						break;
+					default:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=(width-1)-x;
+							for(int s=0;s<samplesperpixel;++s)
 							{
-								int sx=(width-1)-x;
-								c=src[sx*3];
-								dst[x*3]=c;
-								c=src[sx*3+1];
-								dst[x*3+1]=c;
-								c=src[sx*3+2];
-								dst[x*3+2]=c;
+								c=src[sx*samplesperpixel+s];
+								dst[x*samplesperrow+s]=c;
 							}
-							break;
-						case 4:
-							for(x=0;x<width;++x)
-							{
-								int sx=(width-1)-x;
-								c=src[sx*4];
-								dst[x*4]=c;
-								c=src[sx*4+1];
-								dst[x*4+1]=c;
-								c=src[sx*4+2];
-								dst[x*4+2]=c;
-								c=src[sx*4+3];
-								dst[x*4+3]=c;
-							}
-							break;
-						default:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=(width-1)-x;
-								for(int s=0;s<samplesperpixel;++s)
-								{
-									c=src[sx*samplesperpixel+s];
-									dst[x*samplesperrow+s]=c;
-								}
-							}
-							break;
-					}
-					if(TestBreak())
-						y=source->height;
+						}
+						break;
 				}
+				if(TestBreak())
+					y=source->height;
 			}
-			row-=spanfirstrow;
-			return(spanbuffer+row*samplesperrow);		
 			break;
 		case 270:
-			if((row<spanfirstrow) || (row>=(spanfirstrow+spanrows)))
+			for(int i=source->height-1;i>=0;--i)
 			{
-				spanfirstrow=row;
-		
-				firstrow=row;
-				lastrow=row+spanrows;
-				if(lastrow>height)
-					lastrow=height;
-		
-				for(int i=source->height-1;i>=0;--i)
+				src=source->GetRow((source->height-1)-i);
+				dst=spanbuffer+samplesperpixel*i;
+				switch(samplesperpixel)
 				{
-					src=source->GetRow((source->height-1)-i);
-					dst=spanbuffer+samplesperpixel*i;
-					switch(samplesperpixel)
-					{
-						case 1:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=x;
-								c=src[sx];
-								dst[(x-firstrow)*samplesperrow]=c;
-							}
-							break;
-						case 3:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=x;
-								c=src[sx*3];
-								dst[(x-firstrow)*samplesperrow]=c;
-								c=src[sx*3+1];
-								dst[(x-firstrow)*samplesperrow+1]=c;
-								c=src[sx*3+2];
-								dst[(x-firstrow)*samplesperrow+2]=c;
-							}
-							break;
-						case 4:
-							for(x=firstrow;x<lastrow;++x)
-							{
-								int sx=x;
-								c=src[sx*4];
-								dst[(x-firstrow)*samplesperrow]=c;
-								c=src[sx*4+1];
-								dst[(x-firstrow)*samplesperrow+1]=c;
-								c=src[sx*4+2];
-								dst[(x-firstrow)*samplesperrow+2]=c;
-								c=src[sx*4+3];
-								dst[(x-firstrow)*samplesperrow+3]=c;
-							}
-							break;
-						default:
-							for(x=firstrow;x<lastrow;++x)
+					case 1:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=x;
+							c=src[sx];
+							dst[(x-firstrow)*samplesperrow]=c;
+						}
+						break;
+					case 3:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=x;
+							c=src[sx*3];
+							dst[(x-firstrow)*samplesperrow]=c;
+							c=src[sx*3+1];
+							dst[(x-firstrow)*samplesperrow+1]=c;
+							c=src[sx*3+2];
+							dst[(x-firstrow)*samplesperrow+2]=c;
+						}
+						break;
+					case 4:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=x;
+							c=src[sx*4];
+							dst[(x-firstrow)*samplesperrow]=c;
+							c=src[sx*4+1];
+							dst[(x-firstrow)*samplesperrow+1]=c;
+							c=src[sx*4+2];
+							dst[(x-firstrow)*samplesperrow+2]=c;
+							c=src[sx*4+3];
+							dst[(x-firstrow)*samplesperrow+3]=c;
+						}
+						break;
+					default:
+						for(x=firstrow;x<lastrow;++x)
+						{
+							int sx=x;
+							for(int s=0;s<samplesperpixel;++s)
 							{
-								int sx=x;
-								for(int s=0;s<samplesperpixel;++s)
-								{
-									c=src[sx*samplesperpixel+s];
-									dst[(x-firstrow)*samplesperrow+s]=c;
-								}
+								c=src[sx*samplesperpixel+s];
+								dst[(x-firstrow)*samplesperrow+s]=c;
 							}
-							break;
-					}
-					if(TestBreak())
-						i=source->height;
+						}
+						break;
 				}
+				if(TestBreak())
+					i=source->height;
 			}
-			row-=spanfirstrow;
-			return(spanbuffer+row*samplesperrow);
 			break;
 		default:
 			throw "Currently only multples of 90 degrees are supported";
 	}
-	return(rowbuffer);
+}
+
+
+// The window is mapped back through the rotation and cropped from the source,
+// then the span buffer is rebuilt to suit the smaller image.
+
+bool ImageSource_Rotate::SetROI(int x,int y,int w,int h)
+{
+	switch(rotation)
+	{
+		case 0:
+			source=ISCropImage(source,x,y,w,h);
+			break;
+		case 90:
+			source=ISCropImage(source,source->width-y-h,x,h,w);
+			break;
+		case 180:
+			source=ISCropImage(source,width-x-w,height-y-h,w,h);
+			break;
+		case 270:
+			source=ISCropImage(source,y,source->height-x-w,h,w);
+			break;
+	}
+	width=w;
+	height=h;
+	samplesperrow=width*samplesperpixel;
+	currentrow=-1;
+
+	if(rotation==0)
+	{
+		randomaccess=source->randomaccess;
+		return(true);
+	}
+
+	if(rotation==180)
+		spanrows=source->height+1;
+	else if(!source->randomaccess)
+		spanrows=source->width+1;
+	spanfirstrow=-spanrows-1;
+
+	free(spanbuffer);
+	spanbuffer=(ISDataType *)malloc(spanrows*(sizeof(ISDataType)*samplesperrow));
+	return(true);
 }
 
 
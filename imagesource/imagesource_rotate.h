@@ -23,7 +23,10 @@ class ImageSource_Rotate : public ImageSource_Interruptible
 	ImageSource_Rotate(ImageSource *source,int rotation,int spanrows=1024);
 	~ImageSource_Rotate();
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
+	bool SetROI(int x,int y,int w,int h);
 	private:
+	void FillSpan(int row);
 	ImageSource *source;
 	int rotation;
 	int spanfirstrow;
@@ -0,0 +1,79 @@
+/*
+ * imagesource_runs.cpp - records the runs of identical pixels reported by
+ * ImageSource::GetUniformRun() for a strip of rows.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#include "imagesource_runs.h"
+
+using namespace std;
+
+ISUniformRuns::ISUniformRuns() : firstrow(0), width(0)
+{
+	rowstart.push_back(0);
+}
+
+
+void ISUniformRuns::Clear(int firstrow,int width)
+{
+	this->firstrow=firstrow;
+	this->width=width;
+	runs.clear();
+	rowstart.clear();
+	rowstart.push_back(0);
+}
+
+
+// Adjacent non-uniform spans are merged, so a consumer can process them in one go.
+
+void ISUniformRuns::AddRun(int run)
+{
+	if(run<0 && int(runs.size())>rowstart.back() && runs.back()<0)
+		runs.back()+=run;
+	else if(run)
+		runs.push_back(run);
+}
+
+
+void ISUniformRuns::EndRow()
+{
+	rowstart.push_back(runs.size());
+}
+
+
+void ISUniformRuns::AddRow(ImageSource *source,int row)
+{
+	int x=0;
+	while(x<source->width)
+	{
+		int run=source->GetUniformRun(row,x);
+		if(run==0)
+			run=x-source->width;
+		AddRun(run);
+		x+=run>0 ? run : -run;
+	}
+	EndRow();
+}
+
+
+int ISUniformRuns::GetUniformRun(int row,int x)
+{
+	row-=firstrow;
+	if(row<0 || row>=int(rowstart.size())-1)
+		return(x-width);
+
+	int pos=0;
+	for(int i=rowstart[row];i<rowstart[row+1];++i)
+	{
+		int run=runs[i];
+		int end=pos+(run>0 ? run : -run);
+		if(x<end)
+			return(run>0 ? end-x : x-end);
+		pos=end;
+	}
+	return(x-width);
+}
@@ -0,0 +1,43 @@
+/*
+ * imagesource_runs.h - records the runs of identical pixels reported by
+ * ImageSource::GetUniformRun() for a strip of rows.
+ *
+ * Sources which assemble their rows from other sources (Montage) or hand
+ * them on between threads (Parallel) use this to remember the layout of
+ * the strip they last returned, so they can answer GetUniformRun() later.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#ifndef IMAGESOURCE_RUNS_H
+#define IMAGESOURCE_RUNS_H
+
+#include <vector>
+
+#include "imagesource.h"
+
+class ISUniformRuns
+{
+	public:
+	ISUniformRuns();
+	// Discards any recorded rows, and starts a new strip at firstrow.
+	void Clear(int firstrow,int width);
+	// Appends a run to the row being recorded - positive for a run of
+	// identical pixels, negative otherwise, as for GetUniformRun().
+	void AddRun(int run);
+	void EndRow();
+	// Records a whole row by querying the source's GetUniformRun().
+	void AddRow(ImageSource *source,int row);
+	// Answers GetUniformRun() for a recorded row.
+	int GetUniformRun(int row,int x);
+	protected:
+	std::vector<int> runs;
+	std::vector<int> rowstart;	// Index of each row's first run, plus one past the end.
+	int firstrow;
+	int width;
+};
+
+#endif
@@ -16,6 +16,7 @@
 #include <math.h>
 
 #include "imagesource_scale.h"
+#include "imagesource_crop.h"
 
 using namespace std;
 
@@ -65,8 +66,8 @@ ISDataType *ImageSource_VScale::GetRow(int row)
 	if(row==currentrow)
 		return(rowbuffer);
 
-	int srcrow=(row*source->height)/height;
-	ISDataType *srcdata=source->GetRow(srcrow);
+	int srcrow=((row+yorigin)*srcheight)/fullheight;
+	ISDataType *srcdata=source->GetRow(srcrow-srcyorigin);
 
 	for(i=0;i<width*samplesperpixel;++i)
 	{
@@ -80,8 +81,25 @@ ISDataType *ImageSource_VScale::GetRow(int row)
 
 
 
+// Only the source rows which fall within the window are needed.
+
+bool ImageSource_VScale::SetROI(int x,int y,int w,int h)
+{
+	y+=yorigin;
+	int first=(y*srcheight)/fullheight;
+	int last=((y+h-1)*srcheight)/fullheight;
+	source=ISCropImage(source,x,first-srcyorigin,w,last-first+1);
+	yorigin=y;
+	srcyorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+	return(true);
+}
+
+
 ImageSource_VScale::ImageSource_VScale(struct ImageSource *source,int height)
-	: ImageSource(source), source(source)
+	: ImageSource(source), source(source), fullheight(height), srcheight(source->height), yorigin(0), srcyorigin(0)
 {
 	this->height=height;
 	yres=height*source->yres; yres/=source->height;
@@ -113,14 +131,14 @@ ISDataType *ImageSource_HScale::GetRow(int row)
 		case 1:
 			for(i=0;i<width;++i)
 			{
-				int sx=(i*source->width)/width;
+				int sx=((i+xorigin)*srcwidth)/fullwidth-srcxorigin;
 				rowbuffer[i]=srcdata[sx];
 			}
 			break;
 		case 3:
 			for(i=0;i<width;++i)
 			{
-				int sx=(i*source->width)/width;
+				int sx=((i+xorigin)*srcwidth)/fullwidth-srcxorigin;
 				rowbuffer[i*3]=srcdata[sx*3];
 				rowbuffer[i*3+1]=srcdata[sx*3+1];
 				rowbuffer[i*3+2]=srcdata[sx*3+2];
@@ -129,7 +147,7 @@ ISDataType *ImageSource_HScale::GetRow(int row)
 		default:
 			for(i=0;i<width;++i)
 			{
-				int sx=(i*source->width)/width;
+				int sx=((i+xorigin)*srcwidth)/fullwidth-srcxorigin;
 				for(int j=0;j<samplesperpixel;++j)
 					rowbuffer[i*samplesperpixel+j]=srcdata[sx*samplesperpixel+j];
 			}
@@ -143,8 +161,23 @@ ISDataType *ImageSource_HScale::GetRow(int row)
 
 
 
+bool ImageSource_HScale::SetROI(int x,int y,int w,int h)
+{
+	x+=xorigin;
+	int first=(x*srcwidth)/fullwidth;
+	int last=((x+w-1)*srcwidth)/fullwidth;
+	source=ISCropImage(source,first-srcxorigin,y,last-first+1,h);
+	xorigin=x;
+	srcxorigin=first;
+	width=w;
+	height=h;
+	currentrow=-1;
+	return(true);
+}
+
+
 ImageSource_HScale::ImageSource_HScale(struct ImageSource *source,int width)
-	: ImageSource(source), source(source)
+	: ImageSource(source), source(source), fullwidth(width), srcwidth(source->width), xorigin(0), srcxorigin(0)
 {
 	this->width=width;
 	xres=width*source->xres; xres/=source->width;
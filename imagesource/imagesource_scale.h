@@ -31,8 +31,13 @@ class ImageSource_HScale : public ImageSource
 	ImageSource_HScale(ImageSource *source,int width);
 	~ImageSource_HScale();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	private:
 	ImageSource *source;
+	// Scaling is always calculated using the full image sizes; if a region of interest
+	// has been set these give the origin of the window, and of the source's window.
+	int fullwidth,srcwidth;
+	int xorigin,srcxorigin;
 };
 
 class ImageSource_VScale : public ImageSource
@@ -41,8 +46,11 @@ class ImageSource_VScale : public ImageSource
 	ImageSource_VScale(ImageSource *source,int height);
 	~ImageSource_VScale();
 	ISDataType *GetRow(int row);
+	bool SetROI(int x,int y,int w,int h);
 	private:
 	ImageSource *source;
+	int fullheight,srcheight;
+	int yorigin,srcyorigin;
 };
 
 #endif
@@ -28,7 +28,8 @@ ISDataType *ImageSource_Solid::GetRow(int row)
 {
 	int i;
 
-	if(row==currentrow)
+	// Every row is the same, so the buffer need only be filled once.
+	if(currentrow>=0)
 		return(rowbuffer);
 
 	for(int x=0;x<width;++x)
@@ -44,6 +45,14 @@ ISDataType *ImageSource_Solid::GetRow(int row)
 }
 
 
+// Every row is a single run.
+
+int ImageSource_Solid::GetUniformRun(int row,int x)
+{
+	return(width-x);
+}
+
+
 ImageSource_Solid::ImageSource_Solid(IS_TYPE type,int width,int height,ISDataType *sld)
 	: ImageSource()
 {
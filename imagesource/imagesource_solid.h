@@ -21,6 +21,7 @@ class ImageSource_Solid : public ImageSource
 	ImageSource_Solid(IS_TYPE type,int width,int height,ISDataType *solid=NULL);
 	~ImageSource_Solid();
 	ISDataType *GetRow(int row);
+	int GetUniformRun(int row,int x);
 	private:	
 	ISDataType solid[IS_MAX_SAMPLESPERPIXEL];
 };
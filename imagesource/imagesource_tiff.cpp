@@ -13,8 +13,9 @@
  *
  * BUGFIX: 200401030 - worked around a problem with RGBA images
  *
- * TODO: Support tile-based images
- * Test with 16-bit CMYK, Grey
+ * Tiled images are supported by treating each row of tiles as a strip.
+ *
+ * TODO: Test with 16-bit CMYK, Grey
  * Add support for Lab
  * Add indexed->RGB conversion
  *
@@ -37,228 +38,302 @@
 using namespace std;
 
 
+// A decoded strip - or for tiled images, a row of tiles - held as ISDataType
+// samples, so that rows can be returned directly from it.
+
 class IS_TIFFStrip
 {
 	public:
-	IS_TIFFStrip(ImageSource_TIFF *header,int row);
+	IS_TIFFStrip(ImageSource_TIFF *header,int strip);
 	~IS_TIFFStrip();
 	private:
-	void Dump(struct IS_TIFFStrip *strip);
+	void Link();
+	void Unlink();
+	int strip;
 	int firstrow;
 	int lastrow;
-	unsigned char *imgdata;
+	ISDataType *imgdata;
 	IS_TIFFStrip *next,*prev;
 	ImageSource_TIFF *header;
 	friend class ImageSource_TIFF;
+	friend class IS_TIFFPrefetcher;
+};
+
+
+// Decodes the strip following the one the consumer is reading, while the
+// consumer works on the current one.  The prefetcher has exclusive use of
+// the TIFF handle while prefetchstrip is set; at other times the consumer
+// owns it.
+
+class IS_TIFFPrefetcher : public ThreadFunction
+{
+	public:
+	IS_TIFFPrefetcher(ImageSource_TIFF *header) : ThreadFunction(), header(header), cancelled(false), thread(this)
+	{
+		thread.Start();
+	}
+	~IS_TIFFPrefetcher()
+	{
+		header->cond.ObtainMutex();
+		cancelled=true;
+		header->cond.Broadcast();
+		header->cond.ReleaseMutex();
+		thread.WaitFinished();
+	}
+	int Entry(Thread &t)
+	{
+		header->cond.ObtainMutex();
+		while(!cancelled)
+		{
+			if(header->prefetchstrip<0)
+			{
+				header->cond.WaitCondition();
+				continue;
+			}
+			int s=header->prefetchstrip;
+			header->cond.ReleaseMutex();
+
+			IS_TIFFStrip *strip=new IS_TIFFStrip(header,s);
+
+			header->cond.ObtainMutex();
+			strip->Link();
+			header->prefetchstrip=-1;
+			header->cond.Broadcast();
+		}
+		header->cond.ReleaseMutex();
+		return(0);
+	}
+	protected:
+	ImageSource_TIFF *header;
+	bool cancelled;
+	Thread thread;
 };
 
 
 ImageSource_TIFF::~ImageSource_TIFF()
 {
+	// The prefetch thread must be finished before the file is closed.
+	if(prefetcher)
+		delete prefetcher;
+
 	if(file)
 		TIFFClose(file);
 
 	while(strips)
 		delete strips;
+
+	if(tilebuffer)
+		free(tilebuffer);
+}
+
+
+IS_TIFFStrip::IS_TIFFStrip(ImageSource_TIFF *header,int strip)
+	: strip(strip), next(NULL), prev(NULL), header(header)
+{
+	firstrow=strip*header->stripheight;
+	lastrow=firstrow+header->stripheight-1;
+	if(lastrow>=header->height)
+		lastrow=header->height-1;
+
+	imgdata=(ISDataType *)malloc(sizeof(ISDataType)*header->width*header->samplesperpixel*header->stripheight);
+
+	if(header->tiled)
+		header->ReadTiles(strip,(unsigned char *)imgdata);
+	else
+		TIFFReadEncodedStrip(header->file, strip, imgdata, (tsize_t)-1);
+
+	header->ConvertStrip(imgdata,lastrow-firstrow+1);
 }
 
 
 IS_TIFFStrip::~IS_TIFFStrip()
+{
+	Unlink();
+
+	if(imgdata)
+		free(imgdata);
+}
+
+
+// Adds the strip to the head of the list of decoded strips.
+// Must be called with the header's mutex held.
+
+void IS_TIFFStrip::Link()
+{
+	prev=NULL;
+	if((next=header->strips))
+		next->prev=this;
+	header->strips=this;
+}
+
+
+void IS_TIFFStrip::Unlink()
 {
 	if(next)
 		next->prev=prev;
 	if(prev)
 		prev->next=next;
-	else
+	else if(header->strips==this)
 		header->strips=next;
-
-	if(imgdata)
-		free(imgdata);
+	next=prev=NULL;
 }
 
 
-IS_TIFFStrip::IS_TIFFStrip(ImageSource_TIFF *header,int row) : next(NULL), header(header)
+// Reads a row of tiles, assembling them into full-width rows in the same
+// layout as a strip.
+
+void ImageSource_TIFF::ReadTiles(int strip,unsigned char *dst)
 {
-	int i,j;
+	int rowbytes=(bps==16) ? spr*2 : spr;
+	int tilerowbytes=TIFFTileRowSize(file);
+	int rows=height-strip*stripheight;
+	if(rows>stripheight)
+		rows=stripheight;
 
-	if((prev=header->strips))
+	for(int x=0;x<width;x+=tilewidth)
 	{
-		while(prev->next)
-			prev=prev->next;
-		prev->next=this;
+		TIFFReadEncodedTile(file, TIFFComputeTile(file, x, strip*stripheight, 0, 0), tilebuffer, (tsize_t)-1);
+		int offset=(x/tilewidth)*tilerowbytes;
+		int bytes=rowbytes-offset;
+		if(bytes>tilerowbytes)
+			bytes=tilerowbytes;
+		for(int r=0;r<rows;++r)
+			memcpy(dst+r*rowbytes+offset,tilebuffer+r*tilerowbytes,bytes);
 	}
-	else
-		header->strips=this;
-	
-	i=row/header->stripheight;
-	header->filerow=i*header->stripheight;
+}
 
-	firstrow=header->filerow;
-	lastrow=header->filerow+header->stripheight-1;
-	if(lastrow>=header->height)
-		lastrow=header->height-1;
 
-	imgdata=(unsigned char *)malloc(header->stripsize);
+// Expands a freshly read strip from the file's sample format to ISDataType in
+// place.  Each sample takes at least as much space once expanded, so working
+// backwards from the end never overwrites data which hasn't yet been read.
+
+void ImageSource_TIFF::ConvertStrip(ISDataType *dst,int rows)
+{
+	unsigned char *src=(unsigned char *)dst;
+	int samplesperrow=width*samplesperpixel;
+	bool invert=(photometric==PHOTOMETRIC_MINISBLACK);
+	bool palette=(photometric==PHOTOMETRIC_PALETTE);
 
-	switch(header->photometric)
+	switch(bps)
 	{
-		case PHOTOMETRIC_MINISWHITE:
-			switch(header->bps)
+		case 1:
+			for(int r=rows-1;r>=0;--r)
 			{
-				case 1:
-					TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-					break;
-				case 8:
-//					switch(header->samplesperpixel)
-//					{
-//						case 1:
-							TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-							break;
-//						case 2:
-//							TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-//							for(j=0;j<(header->stripsize/2);++j)
-//								imgdata[j]=imgdata[j*2];
-//							break;
-//						default:
-//							break;
-//					}
-					break;
-				case 16:
-					switch(header->samplesperpixel)
-					{
-						case 1:
-							TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-							break;
-						default:
-							Debug[ERROR] << "FIXME - 16-bit greyscale data with 2 samples per pixel not yet handled" << endl;
-							break;
-					}
-					break;
+				unsigned char *srcrow=src+r*spr;
+				ISDataType *dstrow=dst+r*samplesperrow;
+				for(int i=spr-1;i>=0;--i)
+				{
+					int t=srcrow[i];
+					if(invert)
+						t^=255;
+					if(palette)
+						t=greypalette[t];
+					int bits=(width-i*8)>7 ? 8 : width-i*8;
+					for(int j=bits-1;j>=0;--j)
+						dstrow[i*8+j]=(t&(128>>j)) ? EIGHTTOIS(255) : 0;
+				}
 			}
 			break;
-		case PHOTOMETRIC_MINISBLACK:
-			switch(header->bps)
+		case 8:
+			for(int i=rows*samplesperrow-1;i>=0;--i)
 			{
-				case 1:
-					TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-					for(j=0;j<(header->stripsize);++j)
-						imgdata[j]=imgdata[j]^255;
-					break;
-				case 8:
-//					switch(header->samplesperpixel)
-//					{
-//						case 1:
-							TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-							for(j=0;j<(header->stripsize);++j)
-								imgdata[j]=255-imgdata[j];
-//							break;
-//						case 2:
-//							TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-//							for(j=0;j<(header->stripsize/2);++j)
-//								imgdata[j]=255-imgdata[j*2];
-//							break;
-//						default:
-//							break;
-//					}
-					break;
-				case 16:
-					switch(header->samplesperpixel)
-					{
-						case 1:
-							TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-							{
-								for(j=0;j<(header->stripsize/2);++j)
-									imgdata[j]=imgdata[j]^65535;
-							}
-							break;
-						default:
-							Debug[ERROR] << "FIXME - 16-bit greyscale data with 2 samples per pixel not yet handled" << endl;
-							break;
-					}
-					break;
+				int t=src[i];
+				if(invert)
+					t=255-t;
+				if(palette)
+					t=greypalette[t];
+				dst[i]=EIGHTTOIS(t);
 			}
 			break;
-		case PHOTOMETRIC_PALETTE:
-			TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
-			for(j=0;j<(header->stripsize);++j)
-				imgdata[j]=header->greypalette[imgdata[j]];
-			break;
-		case PHOTOMETRIC_RGB:
-		case PHOTOMETRIC_SEPARATED:
-			TIFFReadEncodedStrip(header->file, i, imgdata, (tsize_t)-1);
+		case 16:
+			// libtiff has already byte-swapped the data, so it's used as is.
+			if(invert)
+			{
+				for(int i=0;i<rows*samplesperrow;++i)
+					dst[i]^=65535;
+			}
 			break;
-		default:
-			break;	
 	}
 }
 
 
+IS_TIFFStrip *ImageSource_TIFF::FindStrip(int strip)
+{
+	IS_TIFFStrip *s=strips;
+	while(s && s->strip!=strip)
+		s=s->next;
+	return(s);
+}
+
+
 IS_TIFFStrip *ImageSource_TIFF::GetStrip(int row)
 {
+	// The current strip is only ever discarded by this thread, so can be
+	// checked without locking.
+	if(currentstrip && row>=currentstrip->firstrow && row<=currentstrip->lastrow)
+		return(currentstrip);
+
+	if(!prefetcher && stripcount>1)
+		prefetcher=new IS_TIFFPrefetcher(this);
+
+	int s=row/stripheight;
 	IS_TIFFStrip *strip;
 
-	strip=strips;
-	while((strip) && ((strip->firstrow>row) || (strip->lastrow<row)))
+	cond.ObtainMutex();
+	while(!(strip=FindStrip(s)))
 	{
-		IS_TIFFStrip *next=strip->next;
-		delete strip;
-		strip=next;
+		if(prefetchstrip<0)
+		{
+			// The file is ours while the prefetcher's idle.
+			strip=new IS_TIFFStrip(this,s);
+			break;
+		}
+		// Either the strip we want is being decoded, or the prefetcher's using
+		// the file - either way, wait for it to finish.
+		cond.WaitCondition();
+	}
+	strip->Unlink();
+	strip->Link();
+
+	// Discard the least recently used strips beyond the budget.
+	int count=0;
+	IS_TIFFStrip *t=strips;
+	while(t)
+	{
+		IS_TIFFStrip *next=t->next;
+		if(++count>maxstrips)
+			delete t;
+		t=next;
 	}
 
-	if(!(strip))
-		strip=new IS_TIFFStrip(this,row);
+	// Start decoding the next strip in the background.
+	if(prefetcher && prefetchstrip<0 && s+1<stripcount && !FindStrip(s+1))
+	{
+		prefetchstrip=s+1;
+		cond.Broadcast();
+	}
+	cond.ReleaseMutex();
 
+	currentstrip=strip;
 	return(strip);
 }
 
 
 ISDataType *ImageSource_TIFF::GetRow(int row)
 {
-	unsigned char *srcrow=NULL;
-	struct IS_TIFFStrip *strip;
-
-	if(currentrow==row)
-		return(rowbuffer);
+	IS_TIFFStrip *strip=GetStrip(row);
+	return(strip->imgdata+(row-strip->firstrow)*width*samplesperpixel);
+}
 
-	strip=GetStrip(row);
 
-	if(strip)
-	{
-		int i,j,t,t2;
-		if(bps==16)
-			srcrow=strip->imgdata+(row-strip->firstrow)*spr*2;
-		else
-			srcrow=strip->imgdata+(row-strip->firstrow)*spr;
-		
-		switch(bps)
-		{
-			case 1:
-				for(i=0;i<spr;++i)
-				{
-					t=srcrow[i];
-					for(j=0;j<((width-i*8)>7 ? 8 : width-i*8 );++j)
-					{
-						t2=0;
-						if(t&128) t2=255;
-						t<<=1;
-						rowbuffer[i*8+j]=EIGHTTOIS(t2);
-					}
-				}
-				break;
-			case 8:
-				for(i=0;i<spr;++i)
-					rowbuffer[i]=EIGHTTOIS(srcrow[i]);
-				break;
-			case 16:
-				unsigned short *srcrow16=(unsigned short *)srcrow;
-				for(i=0;i<spr;++i)
-					rowbuffer[i]=srcrow16[i];
-				break;
-		}
-	}
-	currentrow=row;
+// Strips which lie within a single decoded strip are returned directly from it.
 
-	return(rowbuffer);
+ISDataType *ImageSource_TIFF::GetRows(int row,int count)
+{
+	IS_TIFFStrip *strip=GetStrip(row);
+	if(row+count-1>strip->lastrow)
+		return(ImageSource::GetRows(row,count));
+	return(strip->imgdata+(row-strip->firstrow)*width*samplesperpixel);
 }
 
 
@@ -310,6 +385,10 @@ ImageSource_TIFF::ImageSource_TIFF(const char *filename) : ImageSource()
 	type=IS_TYPE_NULL;
 
 	strips=NULL;
+	currentstrip=NULL;
+	prefetcher=NULL;
+	prefetchstrip=-1;
+	tilebuffer=NULL;
 
 	int largestimage=0;
 	CountTIFFDirs(filename,largestimage);
@@ -331,6 +410,18 @@ ImageSource_TIFF::ImageSource_TIFF(const char *filename) : ImageSource()
 	// If striplength is undefined, assume the image data is in a single strip.
 	if(sl==0) sl=height;
 
+	// Tiled images are read a row of tiles at a time, which is then treated
+	// just like a strip.
+	uint32 tw=0,th=0;
+	if((tiled=TIFFIsTiled(file)))
+	{
+		TIFFGetField(file, TIFFTAG_TILEWIDTH, &tw);
+		TIFFGetField(file, TIFFTAG_TILELENGTH, &th);
+		if(tw==0 || th==0)
+			throw "Tiled TIFF has no tile dimensions";
+		sl=th;
+	}
+
 	switch(bps)
 	{
 		case 1:
@@ -342,8 +433,17 @@ ImageSource_TIFF::ImageSource_TIFF(const char *filename) : ImageSource()
 			break;
 	}
 	
-	stripsize=TIFFStripSize(file);
-	stripcount=TIFFNumberOfStrips(file);
+	if(tiled)
+	{
+		stripsize=TIFFTileSize(file);
+		stripcount=(height+th-1)/th;
+		tilebuffer=(unsigned char *)malloc(stripsize);
+	}
+	else
+	{
+		stripsize=TIFFStripSize(file);
+		stripcount=TIFFNumberOfStrips(file);
+	}
 
 	switch(photometric)
 	{
@@ -455,7 +555,7 @@ ImageSource_TIFF::ImageSource_TIFF(const char *filename) : ImageSource()
 	this->samplesperpixel=spp;
 	this->bps=bps;
 	this->photometric=photometric;
-	filerow=0;
+	this->tilewidth=tw;
 	
 	randomaccess=true;
 
@@ -474,6 +574,11 @@ ImageSource_TIFF::ImageSource_TIFF(const char *filename) : ImageSource()
 	
 	Debug[TRACE] << "TIFF Samples per pixel: " << samplesperpixel << endl;
 	Debug[TRACE] << "Samples per row: " << this->spr << endl;
-	
-	MakeRowBuffer();
+
+	// Keep enough decoded strips to fill the cache budget, but at least
+	// the current strip and the one being prefetched.
+	long decodedsize=sizeof(ISDataType)*width*samplesperpixel*sl;
+	maxstrips=IS_TIFF_CACHEBYTES/decodedsize;
+	if(maxstrips<2)
+		maxstrips=2;
 }
@@ -11,8 +11,11 @@
  * Distributed under the terms of the GNU General Public License -
  * see the file named "COPYING" for more details.
  *
- * TODO: Support tile-based images
- * Test with 16-bit CMYK, Grey
+ * Tiled images are supported by treating each row of tiles as a strip.
+ * Decoded strips are kept in a small LRU cache, and the strip following
+ * the current one is decoded ahead of time on a background thread.
+ *
+ * TODO: Test with 16-bit CMYK, Grey
  * Add support for Lab
  * Add indexed->RGB conversion
  *
@@ -23,8 +26,13 @@
 
 #include <tiffio.h>
 #include "imagesource.h"
+#include "../support/thread.h"
+
+// Memory budget for decoded strips
+#define IS_TIFF_CACHEBYTES (16*1024*1024)
 
 class IS_TIFFStrip;
+class IS_TIFFPrefetcher;
 
 class ImageSource_TIFF : public ImageSource
 {
@@ -32,9 +40,12 @@ class ImageSource_TIFF : public ImageSource
 	ImageSource_TIFF(const char *filename);
 	~ImageSource_TIFF();
 	ISDataType *GetRow(int row);
+	ISDataType *GetRows(int row,int count);
 	private:
 	IS_TIFFStrip *GetStrip(int row);
-	IS_TIFFStrip *LoadStrip(int row);
+	IS_TIFFStrip *FindStrip(int strip);
+	void ReadTiles(int strip,unsigned char *dst);
+	void ConvertStrip(ISDataType *dst,int rows);
 	int CountTIFFDirs(const char *filename,int &largestdir);
 	int resunit;
 	TIFF *file;
@@ -44,10 +55,18 @@ class ImageSource_TIFF : public ImageSource
 	long stripsize;
 	int stripheight;
 	int stripcount;
-	int filerow;
+	bool tiled;
+	int tilewidth;
+	unsigned char *tilebuffer;
 	int greypalette[256];
-	IS_TIFFStrip *strips;
+	int maxstrips;
+	IS_TIFFStrip *strips;	// Decoded strips, most recently used first.
+	IS_TIFFStrip *currentstrip;
+	ThreadCondition cond;	// Protects strips, prefetchstrip and the file.
+	IS_TIFFPrefetcher *prefetcher;
+	int prefetchstrip;	// The strip being prefetched, or -1 if idle.
 	friend class IS_TIFFStrip;
+	friend class IS_TIFFPrefetcher;
 };
 
 #endif
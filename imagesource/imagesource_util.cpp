@@ -10,6 +10,7 @@
 #include "imagesource_pnm.h"
 #include "imagesource_gdkpixbuf.h"
 #include "imagesource_gs.h"
+#include "imagesource_mmap.h"
 
 #include "imagesource_scale.h"
 #include "imagesource_downsample.h"
@@ -51,19 +52,48 @@ static const char *findextension(const char *filename)
 }
 
 
-static ImageSource *ISLoadImage_core(const char *filename)
+// Uncompressed TIFF, BMP and PNM files can be read directly from a memory
+// mapping, which avoids a read() and a copy for every strip.  Returns NULL
+// if the file's layout isn't suitable, so the regular loader can be used.
+
+static ImageSource *ISMapImage(const char *filename,const char *ext)
+{
+	static const char *extensions[]={".TIF",".TIFF",".BMP",".PPM",".PGM",".PNM",NULL};
+	for(int i=0;extensions[i];++i)
+	{
+		if(strcasecmp(ext,extensions[i])==0)
+		{
+			try
+			{
+				return(new ImageSource_MMap(filename));
+			}
+			catch(const char *err)
+			{
+				Debug[TRACE] << "Not mapping " << filename << ": " << err << endl;
+			}
+			break;
+		}
+	}
+	return(NULL);
+}
+
+
+static ImageSource *ISLoadImage_core(const char *filename,int minwidth,int minheight)
 {
 	const char *ext=findextension(filename);
 	try
 	{
 		Debug[COMMENT] << "Loading filename: " << filename << endl;
 		Debug[COMMENT] << "Extension: " << ext << endl; 
+		ImageSource *result;
+		if((result=ISMapImage(filename,ext)))
+			return(result);
 		if(strncasecmp(ext,".JPG",4)==0)
-			return(new ImageSource_JPEG(filename));
+			return(new ImageSource_JPEG(filename,minwidth,minheight));
 		else if(strncasecmp(ext,".JPEG",5)==0)
-			return(new ImageSource_JPEG(filename));
+			return(new ImageSource_JPEG(filename,minwidth,minheight));
 		else if(strncasecmp(ext,".JFIF",5)==0)
-			return(new ImageSource_JPEG(filename));
+			return(new ImageSource_JPEG(filename,minwidth,minheight));
 		else if(strncasecmp(ext,".BMP",4)==0)
 			return(new ImageSource_BMP(filename));
 		else if(strncasecmp(ext,".TIF",4)==0)
@@ -97,9 +127,9 @@ static ImageSource *ISLoadImage_core(const char *filename)
 
 // Enforce sane defaults for resolution if the loader leaves it at zero.
 
-ImageSource *ISLoadImage(const char *filename)
+ImageSource *ISLoadImage(const char *filename,int minwidth,int minheight)
 {
-	ImageSource *result=ISLoadImage_core(filename);
+	ImageSource *result=ISLoadImage_core(filename,minwidth,minheight);
 	if(result)
 	{
 		if(result->xres==0)
@@ -20,7 +20,10 @@ struct IS_ScalingQualityDescription
 };
 
 
-ImageSource *ISLoadImage(const char *filename);
+// If minwidth and minheight are given, loaders which can decode at reduced
+// size (currently only JPEG) may return a smaller image, but never smaller
+// than that.  The resolution is adjusted to match.
+ImageSource *ISLoadImage(const char *filename,int minwidth=0,int minheight=0);
 ImageSource *ISScaleImageByResolution(ImageSource *source,double xres,double yres,IS_ScalingQuality quality=IS_SCALING_AUTOMATIC);
 ImageSource *ISScaleImageBySize(ImageSource *source,int w,int h,IS_ScalingQuality quality=IS_SCALING_AUTOMATIC);
 const IS_ScalingQualityDescription *DescribeScalingQuality(IS_ScalingQuality quality);
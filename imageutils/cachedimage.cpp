@@ -1,28 +1,158 @@
 #include <iostream>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
 
 #include "profilemanager/lcmswrapper.h"
 #include "support/debug.h"
+#include "support/tempfile.h"
 
 #include "cachedimage.h"
 
 using namespace std;
 
+
+struct CachedImage_Tile
+{
+	CachedImage_Deferred *image;
+	int index;
+	ISDataType *data;	// NULL unless the tile is in memory.
+	int locks;
+	bool ondisk;		// The temporary file holds a copy of the tile.
+	bool dirty;			// The tile has been written to since it was last paged in.
+	CachedImage_Tile *prev,*next;	// Position in the budget's list while in memory and unlocked.
+};
+
+
+// Keeps track of the memory used by every cached image's tiles.  A single lock
+// covers the tiles of all images, so paging out another image's tiles can't
+// deadlock against that image paging out ours.  It's only taken when a tile is
+// locked or unlocked, not for every row.
+
+class CachedImage_Budget
+{
+	public:
+	CachedImage_Budget();
+	static CachedImage_Budget &Get();
+	void Reserve(size_t bytes);
+	void Remove(CachedImage_Tile *t);
+	void Append(CachedImage_Tile *t);
+	PTMutex mutex;
+	long long budget;
+	long long used;
+	CachedImage_Tile *first,*last;	// Unlocked tiles in memory, least recently used first.
+	TempFileTracker tempfiles;
+};
+
+
+CachedImage_Budget::CachedImage_Budget() : mutex(), budget(CACHEDIMAGE_DEFAULTBUDGET), used(0), first(NULL), last(NULL), tempfiles()
+{
+#if !defined WIN32 && defined _SC_PHYS_PAGES
+	long pages=sysconf(_SC_PHYS_PAGES);
+	long pagesize=sysconf(_SC_PAGESIZE);
+	if(pages>0 && pagesize>0)
+		budget=((long long)pages*pagesize)/CACHEDIMAGE_BUDGETFRACTION;
+#endif
+	Debug[TRACE] << "CachedImage: memory budget " << budget/(1024*1024) << "MB" << endl;
+}
+
+
+CachedImage_Budget &CachedImage_Budget::Get()
+{
+	static CachedImage_Budget budget;
+	return(budget);
+}
+
+
+// Pages out the least recently used tiles until there's room for another
+// bytes.  If nothing more can be paged out the budget is simply exceeded.
+// Must be called with the mutex held.
+
+void CachedImage_Budget::Reserve(size_t bytes)
+{
+	CachedImage_Tile *t=first;
+	while(t && used+(long long)bytes>budget)
+	{
+		CachedImage_Tile *next=t->next;
+		t->image->PageOut(t->index);
+		t=next;
+	}
+}
+
+
+void CachedImage_Budget::Remove(CachedImage_Tile *t)
+{
+	if(t->prev)
+		t->prev->next=t->next;
+	else
+		first=t->next;
+	if(t->next)
+		t->next->prev=t->prev;
+	else
+		last=t->prev;
+	t->prev=t->next=NULL;
+}
+
+
+void CachedImage_Budget::Append(CachedImage_Tile *t)
+{
+	t->next=NULL;
+	if((t->prev=last))
+		last->next=t;
+	else
+		first=t;
+	last=t;
+}
+
+
+void CachedImage_Deferred::SetMemoryBudget(long long bytes)
+{
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	b.mutex.ObtainMutex();
+	b.budget=bytes;
+	b.Reserve(0);
+	b.mutex.ReleaseMutex();
+}
+
+
+// CachedImage_Deferred
+
+
 CachedImage_Deferred::CachedImage_Deferred(ImageSource *source)
 	: source(source), width(source->width), height(source->height),
 	samplesperpixel(source->samplesperpixel), type(source->type), embeddedprofile(NULL),
-	xres(source->xres), yres(source->yres)
+	xres(source->xres), yres(source->yres), rowsread(0), mutex(), tiles(NULL), lockedtile(-1), writetile(-1),
+	tempfile(NULL), fd(-1), map(NULL), mapsize(0), mapstate(MAP_NONE)
 {
 	Debug[TRACE] << "In CachedImage_Deferred constructor" << endl;
 	Debug[TRACE] << "Image type: " << type << ", width: " << width << ", height: " << height << endl;
 	Debug[TRACE] << "(" << source->type << ")" << endl;
-	try
-	{
-		imagedata=new ISDataType[width*height*samplesperpixel];
-	}
-	catch (bad_alloc&)
-	{
+
+	// Tiles are allocated as they're used, rather than all up front.
+	tilerows=1;
+	if(width*samplesperpixel>0)
+		tilerows=CACHEDIMAGE_TILEBYTES/(width*samplesperpixel*sizeof(ISDataType));
+	if(tilerows<1)
+		tilerows=1;
+	tilecount=(height+tilerows-1)/tilerows;
+	if(!(tiles=(CachedImage_Tile *)malloc(sizeof(CachedImage_Tile)*tilecount)) && tilecount)
 		throw "Can't allocate pixel buffer";
+	for(int i=0;i<tilecount;++i)
+	{
+		tiles[i].image=this;
+		tiles[i].index=i;
+		tiles[i].data=NULL;
+		tiles[i].locks=0;
+		tiles[i].ondisk=false;
+		tiles[i].dirty=false;
+		tiles[i].prev=tiles[i].next=NULL;
 	}
+
 	CMSProfile *prof=source->GetEmbeddedProfile();
 	if(prof)
 		embeddedprofile=new CMSProfile(*prof);
@@ -31,8 +161,30 @@ CachedImage_Deferred::CachedImage_Deferred(ImageSource *source)
 
 CachedImage_Deferred::~CachedImage_Deferred()
 {
-	if(imagedata)
-		delete[] imagedata;
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	b.mutex.ObtainMutex();
+	for(int i=0;i<tilecount;++i)
+	{
+		if(tiles[i].data)
+		{
+			if(tiles[i].locks==0)
+				b.Remove(&tiles[i]);
+			b.used-=TileSamples(i)*sizeof(ISDataType);
+			free(tiles[i].data);
+		}
+	}
+	b.mutex.ReleaseMutex();
+	free(tiles);
+
+#ifndef WIN32
+	if(map)
+		munmap(map,mapsize);
+	if(fd>=0)
+		close(fd);
+#endif
+	if(tempfile)
+		delete tempfile;
+
 	if(source)
 		delete source;
 	if(embeddedprofile)
@@ -40,6 +192,174 @@ CachedImage_Deferred::~CachedImage_Deferred()
 }
 
 
+size_t CachedImage_Deferred::TileSamples(int tile)
+{
+	int rows=height-tile*tilerows;
+	if(rows>tilerows)
+		rows=tilerows;
+	return(size_t(rows)*width*samplesperpixel);
+}
+
+
+// Creates the temporary file to which tiles are paged out, big enough for the
+// whole image.  Returns false if it can't be created, in which case tiles
+// simply stay in memory.  This is slow, so is done without the budget's mutex,
+// which is only taken to publish the result.  LockRow() sees to it that it's
+// only called once for each image.
+
+bool CachedImage_Deferred::MapTempFile()
+{
+#ifdef WIN32
+	return(false);
+#else
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	TempFile *tf=b.tempfiles.GetTempFile("PPCI");
+	const char *fn=tf->Filename();
+	size_t size=size_t(width)*height*samplesperpixel*sizeof(ISDataType);
+	int f=-1;
+	void *p=MAP_FAILED;
+	if(fn && (f=open(fn,O_RDWR|O_CREAT|O_EXCL,0600))>=0 && ftruncate(f,size)==0)
+		p=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,f,0);
+
+	b.mutex.ObtainMutex();
+	tempfile=tf;
+	fd=f;
+	if(p!=MAP_FAILED)
+	{
+		map=(ISDataType *)p;
+		mapsize=size;
+	}
+	b.mutex.ReleaseMutex();
+
+	if(p==MAP_FAILED)
+	{
+		Debug[WARN] << "CachedImage: can't create a file to page tiles to - keeping them in memory" << endl;
+		return(false);
+	}
+	Debug[TRACE] << "CachedImage: paging tiles to " << fn << endl;
+	return(true);
+#endif
+}
+
+
+// Moves an unlocked tile out to the temporary file.  A tile which hasn't changed
+// since it was paged in is already there, so is simply discarded.  If there's no
+// temporary file yet, the tile stays put, and the file is created the next time
+// one of this image's tiles is locked.
+// Must be called with the budget's mutex held.
+
+bool CachedImage_Deferred::PageOut(int tile)
+{
+	CachedImage_Tile &t=tiles[tile];
+	if(!t.data || t.locks)
+		return(false);
+	if(!t.ondisk || t.dirty)
+	{
+		if(!map)
+		{
+			if(mapstate==MAP_NONE)
+				mapstate=MAP_WANTED;
+			return(false);
+		}
+		memcpy(map+size_t(tile)*tilerows*width*samplesperpixel,t.data,TileSamples(tile)*sizeof(ISDataType));
+	}
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	b.Remove(&t);
+	b.used-=TileSamples(tile)*sizeof(ISDataType);
+	free(t.data);
+	t.data=NULL;
+	t.ondisk=true;
+	t.dirty=false;
+	return(true);
+}
+
+
+// Brings a tile into memory, reading it back from the temporary file if it's
+// been paged out.  Must be called with the budget's mutex held.
+
+void CachedImage_Deferred::PageIn(int tile)
+{
+	CachedImage_Tile &t=tiles[tile];
+	size_t bytes=TileSamples(tile)*sizeof(ISDataType);
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	b.Reserve(bytes);
+	if(!(t.data=(ISDataType *)malloc(bytes)))
+		throw "Can't allocate pixel buffer";
+	b.used+=bytes;
+	if(t.ondisk)
+		memcpy(t.data,map+size_t(tile)*tilerows*width*samplesperpixel,bytes);
+}
+
+
+ISDataType *CachedImage_Deferred::LockRow(int row,int &tile)
+{
+	if(row>=height)
+		row=height-1;
+	if(row<0)
+		row=0;
+	tile=row/tilerows;
+
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	b.mutex.ObtainMutex();
+	if(mapstate==MAP_WANTED)
+	{
+		mapstate=MAP_CREATED;
+		b.mutex.ReleaseMutex();
+		MapTempFile();
+		b.mutex.ObtainMutex();
+	}
+	CachedImage_Tile &t=tiles[tile];
+	try
+	{
+		if(!t.data)
+			PageIn(tile);
+		else if(t.locks==0)
+			b.Remove(&t);
+	}
+	catch(...)
+	{
+		b.mutex.ReleaseMutex();
+		throw;
+	}
+	++t.locks;
+	b.mutex.ReleaseMutex();
+
+	return(t.data+size_t(row-tile*tilerows)*width*samplesperpixel);
+}
+
+
+// Once unlocked, the tile becomes the most recently used.  Locked tiles can't be
+// paged out, so the budget may have been exceeded while they were held.
+
+void CachedImage_Deferred::UnlockTile(int tile)
+{
+	CachedImage_Budget &b=CachedImage_Budget::Get();
+	b.mutex.ObtainMutex();
+	CachedImage_Tile &t=tiles[tile];
+	if(--t.locks==0)
+	{
+		b.Append(&t);
+		if(b.used>b.budget)
+			b.Reserve(0);
+	}
+	b.mutex.ReleaseMutex();
+}
+
+
+// Releases the tile ReadRow() has been filling, once there's nothing more to read.
+// Must be called with the image's mutex held.
+
+void CachedImage_Deferred::FinishReading()
+{
+	if(writetile>=0)
+		UnlockTile(writetile);
+	writetile=-1;
+	if(source)
+		delete source;
+	source=NULL;
+}
+
+
 void CachedImage_Deferred::ReadImage(Progress *prog)
 {
 	Debug[TRACE] << "CachedImage: ReadImage()" << endl;
@@ -54,42 +374,101 @@ void CachedImage_Deferred::ReadImage(Progress *prog)
 
 	bool cont=true;
 
-	for(int row=0;row<height && cont==true;++row)
+	mutex.ObtainMutex();
+	for(int row=rowsread;row<height && cont==true;++row)
 	{
 		ReadRow(row);
+		rowsread=row+1;
 		if((row % progressmodulo)==0 && prog)
 			cont=prog->DoProgress(row,height);
 	}
-	if(source)
-		delete source;
-	source=NULL;
+	FinishReading();
+	mutex.ReleaseMutex();
+}
+
+
+// The source is deleted as soon as the last row has been read, freeing any
+// resources it holds while the cached image is still in use.
+
+int CachedImage_Deferred::ReadRowsTo(int row)
+{
+	mutex.ObtainMutex();
+	try
+	{
+		if(row>=height)
+			row=height-1;
+		while(rowsread<=row && source)
+		{
+			ReadRow(rowsread);
+			++rowsread;
+		}
+		if(rowsread==height && source)
+			FinishReading();
+	}
+	catch(...)
+	{
+		mutex.ReleaseMutex();
+		throw;
+	}
+	int result=rowsread;
+	mutex.ReleaseMutex();
+	return(result);
 }
 
 
+// The tile being filled stays locked until its last row has been read, so the
+// budget's mutex is only taken once per tile.
+
 void CachedImage_Deferred::ReadRow(int row)
 {
 	ISDataType *srcdata=source->GetRow(row);
-	ISDataType *dstdata=GetRow(row);
+	int tile=row/tilerows;
+	if(tile!=writetile)
+	{
+		if(writetile>=0)
+			UnlockTile(writetile);
+		writetile=-1;
+		LockRow(row,tile);
+		writetile=tile;
+		tiles[tile].dirty=true;
+	}
+	ISDataType *dstdata=tiles[tile].data+size_t(row-tile*tilerows)*width*samplesperpixel;
 	int spr=width*samplesperpixel;
 	for(int s=0;s<spr;++s)
 		dstdata[s]=srcdata[s];
+	if(row==height-1 || row-tile*tilerows==tilerows-1)
+	{
+		UnlockTile(tile);
+		writetile=-1;
+	}
 }
 
 
+// Rows from the tile already locked are returned without touching the budget.
+
 ISDataType *CachedImage_Deferred::GetRow(int row)
 {
 	if(row>=height)
 		row=height-1;
 	if(row<0)
 		row=0;
-	return(imagedata+row*width*samplesperpixel);
+	int tile=row/tilerows;
+	if(tile!=lockedtile)
+	{
+		LockRow(row,tile);
+		if(lockedtile>=0)
+			UnlockTile(lockedtile);
+		lockedtile=tile;
+	}
+	return(tiles[tile].data+size_t(row-tile*tilerows)*width*samplesperpixel);
 }
 
 
 ISDeviceNValue CachedImage_Deferred::GetPixel(int x, int y)
 {
 	ISDeviceNValue result(samplesperpixel);
-	ISDataType *row=GetRow(y);
+	int tile;
+	ISDataType *row=LockRow(y,tile);
 	if(x<0)
 		x=0;
 	if(x>=width)
@@ -97,6 +476,7 @@ ISDeviceNValue CachedImage_Deferred::GetPixel(int x, int y)
 	row+=x*samplesperpixel;
 	for(int s=0;s<samplesperpixel;++s)
 		result[s]=row[s];
+	UnlockTile(tile);
 	return(result);
 }
 
@@ -110,7 +490,7 @@ ImageSource *CachedImage_Deferred::GetImageSource()
 // ImageSource_CachedImage
 
 
-ImageSource_CachedImage::ImageSource_CachedImage(CachedImage_Deferred *img) : ImageSource(), image(img)
+ImageSource_CachedImage::ImageSource_CachedImage(CachedImage_Deferred *img) : ImageSource(), image(img), lockedtile(-1), rowsready(0)
 {
 	width=img->width;
 	height=img->height;
@@ -130,11 +510,31 @@ ImageSource_CachedImage::ImageSource_CachedImage(CachedImage_Deferred *img) : Im
 
 ImageSource_CachedImage::~ImageSource_CachedImage()
 {
+	if(lockedtile>=0)
+		image->UnlockTile(lockedtile);
 }
 
 
+// The tile holding the row returned stays locked until a row from another tile is
+// requested, so neither the image's mutex nor the budget's is taken for the rest
+// of the tile's rows.
+
 ISDataType *ImageSource_CachedImage::GetRow(int row)
 {
-	return(image->GetRow(row));
+	if(row>=height)
+		row=height-1;
+	if(row<0)
+		row=0;
+	if(row>=rowsready)
+		rowsready=image->ReadRowsTo(row);
+	int tile=row/image->tilerows;
+	if(tile!=lockedtile)
+	{
+		image->LockRow(row,tile);
+		if(lockedtile>=0)
+			image->UnlockTile(lockedtile);
+		lockedtile=tile;
+	}
+	return(image->tiles[tile].data+size_t(row-tile*image->tilerows)*width*samplesperpixel);
 }
 
@@ -4,14 +4,33 @@
 #include <iostream>
 
 #include "progress.h"
+#include "ptmutex.h"
 #include "imagesource/imagesource.h"
 
+// Cached images are stored as tiles of whole rows, each roughly this size.
+#define CACHEDIMAGE_TILEBYTES (1024*1024)
+
+// Tiles of all cached images share a memory budget, by default this fraction of
+// physical memory.  Once it's used up, the least recently used tiles are paged
+// out to a temporary file for each image, which is mapped into memory.
+#define CACHEDIMAGE_BUDGETFRACTION 4
+#define CACHEDIMAGE_DEFAULTBUDGET (512LL*1024*1024)
+
 // CachedImage_Deferred - the base class for cached images.  Sets up the width, height, type, etc.
-// and allocated storage, but doesn't actually read the data from the ImageSource until asked.
+// but doesn't actually read the data from the ImageSource until asked.  Storage for each tile
+// is allocated when it's first used.
 // ReadImage() reads and caches the entire image.
 // ReadRow() reads and caches a single row.
+// ReadRowsTo() reads and caches rows in order as far as the one requested, and may be
+// called from several threads at once - ImageSource_CachedImage uses it, so rows are
+// read the first time anything asks for them.  It returns the number of rows read so far.
+// GetRow()'s result is only valid until the next call, so when several threads share an
+// image they should use LockRow() and UnlockTile() instead, as ImageSource_CachedImage does.
 // Generally you won't use this except with ImageSource_Tee.
 
+struct CachedImage_Tile;
+class TempFile;
+
 class CachedImage_Deferred
 {
 	public:
@@ -19,19 +38,42 @@ class CachedImage_Deferred
 	virtual ~CachedImage_Deferred();
 	virtual void ReadImage(Progress *prog=NULL);
 	virtual void ReadRow(int row);
+	virtual int ReadRowsTo(int row);
 	virtual ISDataType *GetRow(int row);
+	// Returns a row, keeping its tile in memory until UnlockTile() is called with the
+	// tile number returned in tile.
+	virtual ISDataType *LockRow(int row,int &tile);
+	virtual void UnlockTile(int tile);
 	virtual ImageSource *GetImageSource();
 	virtual ISDeviceNValue GetPixel(int x, int y);
+	static void SetMemoryBudget(long long bytes);
 	protected:
+	void PageIn(int tile);
+	bool PageOut(int tile);
+	bool MapTempFile();
+	void FinishReading();
+	size_t TileSamples(int tile);
 	ImageSource *source;
 	int width, height;
 	int samplesperpixel;
 	IS_TYPE type;
-	ISDataType *imagedata;
 	CMSProfile *embeddedprofile;
 	double xres,yres;
+	int rowsread;
+	PTMutex mutex;
+	int tilerows;
+	int tilecount;
+	CachedImage_Tile *tiles;
+	int lockedtile;		// The tile holding the row last returned by GetRow().
+	int writetile;		// The tile ReadRow() is filling.
+	TempFile *tempfile;
+	int fd;
+	ISDataType *map;	// The temporary file, if any tiles have been paged out.
+	size_t mapsize;
+	enum {MAP_NONE,MAP_WANTED,MAP_CREATED} mapstate;	// MAP_WANTED if a tile couldn't be paged out for want of the temporary file.
 	friend class ImageSource_CachedImage;
 	friend class ImageSource_Tee;
+	friend class CachedImage_Budget;
 };
 
 
@@ -64,7 +106,8 @@ class ImageSource_CachedImage : public ImageSource
 	ISDataType *GetRow(int row);
 	protected:
 	CachedImage_Deferred *image;
+	int lockedtile;
+	int rowsready;	// Rows known to have been read into the image.
 };
 
 #endif
-
@@ -52,6 +52,8 @@ void TIFFSaver::Save()
 			if(lastrow>(height))
 				lastrow=height;
 
+			ISDataType *strip=imagesource->GetRows(firstrow,lastrow-firstrow);
+
 			for(row=firstrow;row<lastrow;++row)
 			{
 				if(progress && !(row&31))
@@ -62,7 +64,7 @@ void TIFFSaver::Save()
 
 				dst=tmpbuffer+(row-firstrow)*(deep ? bytesperrow*2 : bytesperrow);
 				
-				src=imagesource->GetRow(row);
+				src=strip+(row-firstrow)*imagesource->width*imagesource->samplesperpixel;
 				
 				switch(bitsperpixel)
 				{
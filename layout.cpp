@@ -8,6 +8,8 @@
  */
 
 #include <iostream>
+#include <vector>
+#include <map>
 #include <string.h>
 #include <gtk/gtk.h>
 
@@ -29,6 +31,7 @@
 #include "imagesource/imagesource_mask.h"
 #include "imagesource/imagesource_rotate.h"
 #include "imagesource/imagesource_promote.h"
+#include "imagesource/imagesource_parallel.h"
 
 #include "photoprint_state.h"
 
@@ -107,8 +110,17 @@ Layout::Layout(PhotoPrint_State &state,Layout *oldlayout)
 	backgroundtransformed(NULL), imagelist(NULL), factory(NULL), gc(NULL), jobdispatcher(0)
 {
 	factory=state.profilemanager.GetTransformFactory();
-	jobdispatcher.AddWorker(new ImageInfo_Worker(jobdispatcher,state.profilemanager));
-	jobdispatcher.AddWorker(new ImageInfo_Worker(jobdispatcher,state.profilemanager));
+
+	// One preview worker per processor unless the user has asked otherwise.
+	// Each worker owns its own transform factory, so they share no CMS state.
+	int threads=state.previewthreads;
+	if(threads<0)
+		threads=state.FindInt("PreviewThreads");
+	if(threads<1)
+		threads=Thread::GetProcessorCount();
+	Debug[TRACE] << "Layout: using " << threads << " preview threads" << endl;
+	for(int i=0;i<threads;++i)
+		jobdispatcher.AddWorker(new ImageInfo_Worker(jobdispatcher,state.profilemanager));
 }
 
 
@@ -179,13 +191,73 @@ void Layout::CopyImage(Layout_ImageInfo *ii)
 }
 
 
-ImageSource *Layout::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage)
+ImageSource *Layout::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage,int flags)
 {
 	Debug[ERROR] << "GetImageSource: Dummy function - should be overridden" << endl;
 	return(NULL);
 }
 
 
+// Supplies ImageSource_Parallel with copies of a page's chain.  Each copy
+// gets its own transform factory, since the transforms aren't shared between
+// threads, and only the first records the images' histograms.  The chains are
+// read by the worker threads, so must be complete before they start.
+
+class Layout_PageChainFactory : public ISParallel_ChainFactory
+{
+	public:
+	Layout_PageChainFactory(Layout &layout,int page,CMColourDevice target,int res,bool completepage)
+		: ISParallel_ChainFactory(), layout(layout), page(page), target(target), res(res), completepage(completepage), flags(PPLAYOUT_CHAIN_PARALLEL)
+	{
+	}
+	~Layout_PageChainFactory()
+	{
+		while(!factories.empty())
+		{
+			delete factories.front();
+			factories.pop_front();
+		}
+	}
+	ImageSource *GetImageSource()
+	{
+		CMTransformFactory *factory=layout.state.profilemanager.GetTransformFactory();
+		factories.push_back(factory);
+		ImageSource *is=layout.GetImageSource(page,target,factory,res,completepage,flags);
+		flags|=PPLAYOUT_CHAIN_COPY;
+		return(is);
+	}
+	protected:
+	Layout &layout;
+	int page;
+	CMColourDevice target;
+	int res;
+	bool completepage;
+	int flags;
+	std::list<CMTransformFactory *> factories;
+};
+
+
+ImageSource *Layout::GetParallelImageSource(int page,CMColourDevice target,int res,bool completepage)
+{
+	Layout_PageChainFactory *chainfactory=new Layout_PageChainFactory(*this,page,target,res,completepage);
+	ImageSource *is=chainfactory->GetImageSource();
+	if(!is)
+	{
+		delete chainfactory;
+		return(NULL);
+	}
+	return(new ImageSource_Parallel(is,chainfactory));
+}
+
+
+// Subclasses which know how their pages are built override this.
+
+std::string Layout::GetPageFingerprint(int page)
+{
+	return(std::string());
+}
+
+
 IS_TYPE Layout::GetColourSpace(CMColourDevice target)
 {
 	enum IS_TYPE colourspace=IS_TYPE_RGB;
@@ -287,6 +359,15 @@ int Layout::GetCurrentPage()
 void Layout::SetCurrentPage(int page)
 {
 	currentpage=page;
+
+	// Previews for the new page should now be rendered ahead of any for the old one.
+	LayoutIterator it(*this);
+	Layout_ImageInfo *ii=it.FirstImage();
+	while(ii)
+	{
+		ii->UpdatePreviewPriority();
+		ii=it.NextImage();
+	}
 }
 
 
@@ -296,20 +377,88 @@ int Layout::FreeSlots()
 }
 
 
+// Pages which print identically to an earlier page in the job aren't rendered
+// again - the earlier page's output is kept and sent to the printer once more.
+
 void Layout::Print(Progress *p)
 {
 	state.printer.SetProgress(p);
-	CMTransformFactory *factory=state.profilemanager.GetTransformFactory();
-	for(int p=0;p<GetPages();++p)
+
+	int pages=GetPages();
+	vector<string> keys(pages);
+	vector<bool> repeated(pages,false);
+	vector<bool> keep(pages,false);
+	map<string,int> firstpage;
+	for(int page=0;page<pages;++page)
 	{
-		ImageSource *is=GetImageSource(p,CM_COLOURDEVICE_PRINTER,factory);
-		if(is)
+		if((keys[page]=GetPageFingerprint(page)).size())
 		{
-			state.printer.Print(is,xoffset,yoffset);
-			delete is;
+			map<string,int>::iterator it=firstpage.find(keys[page]);
+			if(it!=firstpage.end())
+			{
+				keep[it->second]=true;
+				repeated[page]=true;
+			}
+			else
+				firstpage[keys[page]]=page;
 		}
 	}
-	delete factory;
+
+	// Building a page's ImageSource may set xoffset and yoffset (Layout_Poster does so
+	// for each tile), so they're saved along with each page's ImageSource.
+	ImageSource *is=NULL;
+	int isxoffset=xoffset,isyoffset=yoffset;
+	if(pages>0)
+	{
+		is=GetParallelImageSource(0,CM_COLOURDEVICE_PRINTER);
+		isxoffset=xoffset;
+		isyoffset=yoffset;
+	}
+	for(int p=0;p<pages;++p)
+	{
+		// The next page's render threads start work while this page is printed.
+		ImageSource *next=NULL;
+		int nextxoffset=xoffset,nextyoffset=yoffset;
+		try
+		{
+			if(p+1<pages && !repeated[p+1])
+			{
+				next=GetParallelImageSource(p+1,CM_COLOURDEVICE_PRINTER);
+				nextxoffset=xoffset;
+				nextyoffset=yoffset;
+			}
+			if(repeated[p] && state.printer.Replay(keys[p].c_str()))
+				Debug[TRACE] << "Page " << p << " replayed from page " << firstpage[keys[p]] << endl;
+			else
+			{
+				// If the earlier page's output couldn't be kept, this page is rendered after all.
+				if(!is)
+				{
+					is=GetParallelImageSource(p,CM_COLOURDEVICE_PRINTER);
+					isxoffset=xoffset;
+					isyoffset=yoffset;
+				}
+				if(is)
+					state.printer.Print(is,isxoffset,isyoffset,NULL,keep[p] ? keys[p].c_str() : NULL);
+			}
+		}
+		catch(...)
+		{
+			if(is)
+				delete is;
+			if(next)
+				delete next;
+			state.printer.ClearReplays();
+			state.printer.SetProgress(NULL);
+			throw;
+		}
+		if(is)
+			delete is;
+		is=next;
+		isxoffset=nextxoffset;
+		isyoffset=nextyoffset;
+	}
+	state.printer.ClearReplays();
 	state.printer.SetProgress(NULL);
 }
 
@@ -418,10 +567,17 @@ void Layout::DrawPreviewBG(GtkWidget *widget,int xpos,int ypos,int width,int hei
 
 	if(background)
 	{
-		if(backgroundtransformed)
+		// The transformed background only needs rebuilding if the preview's size has changed.
+		if(backgroundtransformed && (gdk_pixbuf_get_width(backgroundtransformed)!=width
+			|| gdk_pixbuf_get_height(backgroundtransformed)!=height))
+		{
 			g_object_unref(backgroundtransformed);
-		backgroundtransformed=NULL;
-		
+			backgroundtransformed=NULL;
+		}
+	}
+
+	if(background && !backgroundtransformed)
+	{
 		int bw=gdk_pixbuf_get_width(background);
 		int bh=gdk_pixbuf_get_height(background);
 
@@ -441,7 +597,10 @@ void Layout::DrawPreviewBG(GtkWidget *widget,int xpos,int ypos,int width,int hei
 				g_object_unref(G_OBJECT(tmp));
 				break;
 		}
-	
+	}
+
+	if(backgroundtransformed)
+	{
 		gdk_draw_pixbuf(widget->window,NULL,backgroundtransformed,
 			0,0,
 			xpos,ypos,
@@ -588,6 +747,10 @@ void Layout::SetBackground(const char *filename)
 
 void Layout::FlushThumbnails()
 {
+	if(backgroundtransformed)
+		g_object_unref(G_OBJECT(backgroundtransformed));
+	backgroundtransformed=NULL;
+
 	LayoutIterator it(*this);
 	Layout_ImageInfo *ii=it.FirstImage();
 	while(ii)
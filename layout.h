@@ -2,6 +2,7 @@
 #define LAYOUT_H
 
 #include <list>
+#include <string>
 #include <stdio.h>
 #include <glib.h>
 #include <gtk/gtk.h>
@@ -31,6 +32,10 @@ class Progress;
 #define PPLAYOUT_EFFECTS 32
 #define PPLAYOUT_DUPLICATE 64
 
+// Flags for GetImageSource():
+#define PPLAYOUT_CHAIN_COPY 1	// A further copy of a chain for ImageSource_Parallel - doesn't record histograms.
+#define PPLAYOUT_CHAIN_PARALLEL 2	// The chain will be read from another thread, so mustn't build anything on demand.
+
 
 class LayoutIterator
 {
@@ -67,7 +72,15 @@ class Layout : public virtual PageExtent
 	virtual void Reflow();
 
 	virtual ImageSource *GetImageSource(int page,CMColourDevice target=CM_COLOURDEVICE_PRINTER,
-		CMTransformFactory *factory=NULL,int res=0,bool completepage=false);
+		CMTransformFactory *factory=NULL,int res=0,bool completepage=false,int flags=0);
+	// Renders the page on a pool of threads, each with its own copy of the chain
+	// built by GetImageSource().  Rows must be read in order.
+	virtual ImageSource *GetParallelImageSource(int page,CMColourDevice target=CM_COLOURDEVICE_PRINTER,
+		int res=0,bool completepage=false);
+	// Identifies the printed output of a page, so pages which would print identically
+	// within a job need only be rendered once.  Returns an empty string if the page
+	// can't be fingerprinted.
+	virtual std::string GetPageFingerprint(int page);
 	virtual IS_TYPE GetColourSpace(CMColourDevice target);	// Do we still need this?
 	virtual void UpdatePageSize();
 	virtual void LayoutToDB(LayoutDB &db);
@@ -170,7 +170,7 @@ void Layout_Carousel::CopyImage(Layout_ImageInfo *ii)
 }
 
 
-ImageSource *Layout_Carousel::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage)
+ImageSource *Layout_Carousel::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage,int flags)
 {
 	ImageSource *result=NULL;
 	try
@@ -204,7 +204,7 @@ ImageSource *Layout_Carousel::GetImageSource(int page,CMColourDevice target,CMTr
 
 			if(img)
 			{
-				source=img->GetImageSource(target,factory);
+				source=img->GetImageSource(target,factory,0,0,!(flags&PPLAYOUT_CHAIN_COPY));
 				LayoutRectangle r(source->width,source->height);
 
 				targetseg=c.GetSegmentExtent(s);
@@ -229,7 +229,7 @@ ImageSource *Layout_Carousel::GetImageSource(int page,CMColourDevice target,CMTr
 
 			if(img)
 			{
-				source=img->GetImageSource(target,factory);
+				source=img->GetImageSource(target,factory,0,0,!(flags&PPLAYOUT_CHAIN_COPY));
 				LayoutRectangle r(source->width,source->height);
 
 				targetseg=c.GetSegmentExtent(s);
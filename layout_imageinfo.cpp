@@ -8,6 +8,7 @@
  */
 
 #include <iostream>
+#include <sstream>
 #include <string.h>
 #include <gtk/gtk.h>
 
@@ -30,6 +31,8 @@
 #include "imagesource/imagesource_rotate.h"
 #include "imagesource/imagesource_promote.h"
 #include "imagesource/imagesource_invert.h"
+#include "imagesource/imagesource_parallel.h"
+#include "effects/ppeffect_unsharpmask.h"
 
 #include "imageutils/cachedimage.h"
 #include "imageutils/tiffsave.h"
@@ -76,6 +79,7 @@ class PPIS_Histogram : public ImageSource
 Layout_ImageInfo::Layout_ImageInfo(Layout &layout, const char *filename, int page, bool allowcropping, PP_ROTATION rotation)
 	: PPEffectHeader(), RefCountUI(), page(page), allowcropping(allowcropping), crop_hpan(CENTRE), crop_vpan(CENTRE),
 	rotation(rotation), layout(layout), maskfilename(NULL), thumbnail(NULL), mask(NULL), hrpreview(NULL),
+	previewcache(NULL), previewcache_source(NULL), previewcache_mask(NULL), previewcache_dw(0), previewcache_dh(0),
 	selected(false), customprofile(NULL), customintent(LCMSWRAPPER_INTENT_DEFAULT),
 	threadevents(), histogram(threadevents), hrrenderjob(NULL)
 {
@@ -109,6 +113,7 @@ Layout_ImageInfo::Layout_ImageInfo(Layout &layout, const char *filename, int pag
 Layout_ImageInfo::Layout_ImageInfo(Layout &layout, Layout_ImageInfo *ii, int page)
 	: PPEffectHeader(*ii), RefCountUI(), page(page), allowcropping(false), crop_hpan(CENTRE), crop_vpan(CENTRE),
 	rotation(PP_ROTATION_AUTO), layout(layout), maskfilename(NULL), thumbnail(NULL), mask(NULL), hrpreview(NULL),
+	previewcache(NULL), previewcache_source(NULL), previewcache_mask(NULL), previewcache_dw(0), previewcache_dh(0),
 	selected(false), customprofile(NULL), customintent(LCMSWRAPPER_INTENT_DEFAULT),
 	threadevents(), histogram(threadevents), hrrenderjob(NULL)
 {
@@ -166,6 +171,33 @@ Layout_ImageInfo::~Layout_ImageInfo()
 }
 
 
+// Supplies further copies of a preview's filter chain, each with its own
+// transform factory, so the preview can be rendered on several threads.
+
+class HRRenderJob;
+
+class HRRenderChainFactory : public ISParallel_ChainFactory
+{
+	public:
+	HRRenderChainFactory(HRRenderJob &job,ProfileManager &pm) : ISParallel_ChainFactory(), job(job), profilemanager(pm)
+	{
+	}
+	~HRRenderChainFactory()
+	{
+		while(!factories.empty())
+		{
+			delete factories.front();
+			factories.pop_front();
+		}
+	}
+	ImageSource *GetImageSource();
+	protected:
+	HRRenderJob &job;
+	ProfileManager &profilemanager;
+	std::list<CMTransformFactory *> factories;
+};
+
+
 // Jobqueue-based replacement for the previous high-res preview code.
 // This should be cleaner, and should take care of some of the concurrency issues behind the scenes.
 
@@ -173,7 +205,8 @@ class HRRenderJob : public Job, public Progress
 {
 	public:
 	HRRenderJob(Layout_ImageInfo *ii,GtkWidget *wid,int x,int y,int w,int h)
-		: Job(), Progress(), ii(ii), widget(wid), xpos(x), ypos(y), width(w), height(h), transformed(NULL), sync()
+		: Job(ii->GetPreviewPriority()), Progress(), ii(ii), widget(wid), xpos(x), ypos(y), width(w), height(h), tdev(CM_COLOURDEVICE_NONE),
+		transformed(NULL), sync(), worker(NULL), preemptible(false)
 	{
 		// Need to ref the ImageInfo here.
 		Debug[TRACE] << "Creating HRRenderJob " << hex << this << endl;
@@ -182,22 +215,53 @@ class HRRenderJob : public Job, public Progress
 	virtual ~HRRenderJob()
 	{
 		Debug[TRACE] << "Deleting HRRenderJob " << hex << this << " - unreferencing ImageInfo..." << endl;
+		// Jobs are only deleted from the main thread, so it's safe to clear the ImageInfo's pointer here.
+		if(ii->hrrenderjob==this)
+			ii->hrrenderjob=NULL;
 		ii->UnRef();
 		Debug[TRACE] << "Done - HRRenderJob disposed" << endl;
 	}
 	bool DoProgress(int i, int maxi)
 	{
-		return(GetJobStatus()!=JOBSTATUS_CANCELLED);
+		if(GetJobStatus()==JOBSTATUS_CANCELLED)
+			return(false);
+		// Until the result is handed to the main thread we give way to any more important previews.
+		if(preemptible && worker && worker->ShouldYield(this))
+			return(false);
+		return(true);
 	}
 	static bool testbreak(void *p)
 	{
 		HRRenderJob *j=(HRRenderJob *)p;
 		return(j->DoProgress(0,0)==false);
 	}
+	// Builds the chain which renders the preview, using the supplied transform factory.
+	ImageSource *GetPreviewImageSource(CMTransformFactory *factory,bool recordhistogram=true)
+	{
+		ImageSource *is=ii->GetImageSource(tdev,factory,0,0,recordhistogram);
+
+		LayoutRectangle r(is->width,is->height);
+		LayoutRectangle target(xpos,ypos,width,height);
+
+		RectFit *fit=r.Fit(target,ii->allowcropping,ii->rotation,ii->crop_hpan,ii->crop_vpan);
+
+		if(fit->rotation)
+		{
+			ImageSource_Interruptible *ii=new ImageSource_Rotate(is,fit->rotation);
+			ii->SetTestBreak(testbreak,this);
+			is=ii;
+		}
+
+		is=ISScaleImageBySize(is,fit->width,fit->height,IS_SCALING_AUTOMATIC);
+		delete fit;
+		// We create new Fit in the idle-function because the hpan/vpan may have changed.
+		return(is);
+	}
 	virtual void Run(Worker *w)
 	{
 		ImageInfo_Worker *iw=(ImageInfo_Worker *)w;
-
+		worker=w;
+		preemptible=true;
 
 		try
 		{
@@ -251,7 +315,7 @@ class HRRenderJob : public Job, public Progress
 
 			CMSProfile *targetprof;
 
-			CMColourDevice tdev=CM_COLOURDEVICE_NONE;
+			tdev=CM_COLOURDEVICE_NONE;
 			if((targetprof=iw->profilemanager.GetProfile(CM_COLOURDEVICE_PRINTERPROOF)))
 				tdev=CM_COLOURDEVICE_PRINTERPROOF;
 			else if((targetprof=iw->profilemanager.GetProfile(CM_COLOURDEVICE_DISPLAY)))
@@ -261,32 +325,22 @@ class HRRenderJob : public Job, public Progress
 			if(targetprof)
 				delete targetprof;
 
-			ImageSource *is=ii->GetImageSource(tdev,iw->factory);
+			ImageSource *is=GetPreviewImageSource(iw->factory);
 
-			LayoutRectangle r(is->width,is->height);
-			LayoutRectangle target(xpos,ypos,width,height);
-
-			RectFit *fit=r.Fit(target,ii->allowcropping,ii->rotation,ii->crop_hpan,ii->crop_vpan);
-
-			if(fit->rotation)
-			{
-				ImageSource_Interruptible *ii=new ImageSource_Rotate(is,fit->rotation);
-				ii->SetTestBreak(testbreak,this);
-				is=ii;
-			}
-
-			is=ISScaleImageBySize(is,fit->width,fit->height,IS_SCALING_AUTOMATIC);
-			delete fit;
-			// We create new Fit in the idle-function because the hpan/vpan may have changed.
+			// If fewer previews are pending than there are processors, split this one between the spare ones.
+			int threads=iw->GetSpareThreads();
+			if(threads>1)
+				is=new ImageSource_Parallel(is,new HRRenderChainFactory(*this,iw->profilemanager),threads);
 
 			// Instead of build the GdkPixbuf here we create a cached image and convert to pixbuf in the main thread.
-			transformed=new CachedImage(is);
+			transformed=new CachedImage(is,this);
 
 			if(transformed)
 			{
 				// Now we defer to the main thread...
  				if(DoProgress(0,0))
 				{
+					preemptible=false;
 					g_timeout_add(1,finish_main,this);
 					sync.WaitCondition();
 					Debug[TRACE] << "Received sync from main thread - Job complete, deleting transformed..." << endl;
@@ -377,11 +431,22 @@ class HRRenderJob : public Job, public Progress
 	GtkWidget *widget;
 	int xpos,ypos;
 	int width,height;
+	CMColourDevice tdev;
 	CachedImage *transformed;
 //	GdkPixbuf *transformed;
 	ThreadSync sync;
+	Worker *worker;
+	bool preemptible;
 };
 
+
+ImageSource *HRRenderChainFactory::GetImageSource()
+{
+	CMTransformFactory *factory=profilemanager.GetTransformFactory();
+	factories.push_back(factory);
+	return(job.GetPreviewImageSource(factory,false));
+}
+
 #if 0
 // Subthread for rendering high-resolution previews.
 // This code uses the subthread to create a GdkPixbuf from
@@ -696,93 +761,93 @@ class hr_payload : public PTMutex, public ThreadFunction
 
 void Layout_ImageInfo::DrawThumbnail(GtkWidget *widget,int xpos,int ypos,int width,int height)
 {
-	GdkPixbuf *thumbnail=hrpreview;
-	GdkPixbuf *transformed=NULL;
-	RectFit *fit=NULL;
-	int dw,dh;
-
-	if(thumbnail)
+	// If we have a high-res preview it's already rotated and scaled, so need only be masked.
+	GdkPixbuf *source=hrpreview;
+	PP_ROTATION rot=PP_ROTATION_NONE;
+	if(!source)
 	{
-		LayoutRectangle r(gdk_pixbuf_get_width(thumbnail),gdk_pixbuf_get_height(thumbnail));
-		LayoutRectangle target(xpos,ypos,width,height);
+		source=GetThumbnail();
+		rot=rotation;
+	}
 
-		fit=r.Fit(target,allowcropping,PP_ROTATION_NONE,crop_hpan,crop_vpan);
+	LayoutRectangle r(gdk_pixbuf_get_width(source),gdk_pixbuf_get_height(source));
+	LayoutRectangle target(xpos,ypos,width,height);
 
-		dw=fit->width;
-		dh=fit->height;
-		
-		if(dw > width)
-			dw=width;
+	RectFit *fit=r.Fit(target,allowcropping,rot,crop_hpan,crop_vpan);
 
-		if(dh > height)
-			dh=height;
-		
-		if(dw>gdk_pixbuf_get_width(thumbnail))
-			dw=gdk_pixbuf_get_width(thumbnail);
+	int tw=fit->width;
+	int th=fit->height;
+	if(hrpreview)
+	{
+		tw=gdk_pixbuf_get_width(source);
+		th=gdk_pixbuf_get_height(source);
+	}
 
-		if(dh>gdk_pixbuf_get_height(thumbnail))
-			dh=gdk_pixbuf_get_height(thumbnail);
+	int dw=fit->width;
+	int dh=fit->height;
+	
+	if(dw > width)
+		dw=width;
 
-		if(mask)
-		{
-			transformed=gdk_pixbuf_copy(hrpreview);
-			maskpixbuf(transformed,fit->xoffset,fit->yoffset,dw,dh,mask,
-				layout.bgcol.red>>8,layout.bgcol.green>>8,layout.bgcol.blue>>8);
-			thumbnail=transformed;
-		}
-	}
-	else
-	{
-		thumbnail=GetThumbnail();
-		
-		LayoutRectangle r(gdk_pixbuf_get_width(thumbnail),gdk_pixbuf_get_height(thumbnail));
-		LayoutRectangle target(xpos,ypos,width,height);
+	if(dh > height)
+		dh=height;
+	
+	if(dw>tw)
+		dw=tw;
 
-		fit=r.Fit(target,allowcropping,rotation,crop_hpan,crop_vpan);
+	if(dh>th)
+		dh=th;
 
-		GdkPixbuf *tmp;
-		switch(fit->rotation)
+	// Exposes will usually redraw the image at the same size as last time, so we keep
+	// the transformed pixbuf until something changes.
+	if(!PreviewCacheValid(source,fit,dw,dh))
+	{
+		GdkPixbuf *transformed=NULL;
+		if(hrpreview)
 		{
-			case 0:
-				transformed=gdk_pixbuf_scale_simple(thumbnail,fit->width,fit->height,GDK_INTERP_NEAREST);
-				break;
-			case 270:
-				tmp=gdk_pixbuf_rotate_simple(thumbnail,GDK_PIXBUF_ROTATE_CLOCKWISE);
-				transformed=gdk_pixbuf_scale_simple(tmp,fit->width,fit->height,GDK_INTERP_NEAREST);
-				g_object_unref(G_OBJECT(tmp));
-				break;
-			case 180:
-				tmp=gdk_pixbuf_rotate_simple(thumbnail,GDK_PIXBUF_ROTATE_UPSIDEDOWN);
-				transformed=gdk_pixbuf_scale_simple(tmp,fit->width,fit->height,GDK_INTERP_NEAREST);
-				g_object_unref(G_OBJECT(tmp));
-				break;
-			case 90:
-				tmp=gdk_pixbuf_rotate_simple(thumbnail,GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
-				transformed=gdk_pixbuf_scale_simple(tmp,fit->width,fit->height,GDK_INTERP_NEAREST);
-				g_object_unref(G_OBJECT(tmp));
-				break;
+			if(mask)
+				transformed=gdk_pixbuf_copy(hrpreview);
+			else
+			{
+				transformed=hrpreview;
+				g_object_ref(G_OBJECT(transformed));
+			}
+		}
+		else
+		{
+			GdkPixbuf *tmp;
+			switch(fit->rotation)
+			{
+				case 0:
+					transformed=gdk_pixbuf_scale_simple(source,fit->width,fit->height,GDK_INTERP_NEAREST);
+					break;
+				case 270:
+					tmp=gdk_pixbuf_rotate_simple(source,GDK_PIXBUF_ROTATE_CLOCKWISE);
+					transformed=gdk_pixbuf_scale_simple(tmp,fit->width,fit->height,GDK_INTERP_NEAREST);
+					g_object_unref(G_OBJECT(tmp));
+					break;
+				case 180:
+					tmp=gdk_pixbuf_rotate_simple(source,GDK_PIXBUF_ROTATE_UPSIDEDOWN);
+					transformed=gdk_pixbuf_scale_simple(tmp,fit->width,fit->height,GDK_INTERP_NEAREST);
+					g_object_unref(G_OBJECT(tmp));
+					break;
+				case 90:
+					tmp=gdk_pixbuf_rotate_simple(source,GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+					transformed=gdk_pixbuf_scale_simple(tmp,fit->width,fit->height,GDK_INTERP_NEAREST);
+					g_object_unref(G_OBJECT(tmp));
+					break;
+			}
 		}
-
-		dw=fit->width;
-		dh=fit->height;
-		
-		if(dw > width)
-			dw=width;
-
-		if(dh > height)
-			dh=height;
-		
-		if(dw>gdk_pixbuf_get_width(transformed))
-			dw=gdk_pixbuf_get_width(transformed);
-
-		if(dh>gdk_pixbuf_get_height(transformed))
-			dh=gdk_pixbuf_get_height(transformed);
 
 		if(mask)
 			maskpixbuf(transformed,fit->xoffset,fit->yoffset,dw,dh,mask,
 				layout.bgcol.red>>8,layout.bgcol.green>>8,layout.bgcol.blue>>8);
-		thumbnail=transformed;
 
+		SetPreviewCache(transformed,source,fit,dw,dh);
+	}
+
+	if(!hrpreview)
+	{
 		// Trigger a rendering thread if there isn't one already
 		// and if high-res previews are enabled
 		if(hrrenderjob==NULL && layout.state.FindInt("HighresPreviews"))
@@ -798,19 +863,58 @@ void Layout_ImageInfo::DrawThumbnail(GtkWidget *widget,int xpos,int ypos,int wid
 		}
 	}
 
-	gdk_draw_pixbuf(widget->window,NULL,thumbnail,
+	gdk_draw_pixbuf(widget->window,NULL,previewcache,
 		fit->xoffset,fit->yoffset,
 		fit->xpos,fit->ypos,
 		dw,dh,
 		GDK_RGB_DITHER_NONE,0,0);
 
-	if(transformed)
-		g_object_unref(transformed);
-
 	delete fit;
 }
 
 
+// The cached preview is identified by the pixbuf it was generated from and the details
+// of its fit - the source pointer is only meaningful because FlushPreviewCache() is called
+// whenever the thumbnail, high-res preview or mask is replaced.
+
+bool Layout_ImageInfo::PreviewCacheValid(GdkPixbuf *source,RectFit *fit,int dw,int dh)
+{
+	if(!previewcache || source!=previewcache_source || mask!=previewcache_mask)
+		return(false);
+	if(fit->width!=previewcache_fit.width || fit->height!=previewcache_fit.height
+		|| fit->rotation!=previewcache_fit.rotation)
+		return(false);
+	if(fit->xoffset!=previewcache_fit.xoffset || fit->yoffset!=previewcache_fit.yoffset
+		|| dw!=previewcache_dw || dh!=previewcache_dh)
+		return(false);
+	if(mask && !gdk_color_equal(&layout.bgcol,&previewcache_bgcol))
+		return(false);
+	return(true);
+}
+
+
+void Layout_ImageInfo::SetPreviewCache(GdkPixbuf *preview,GdkPixbuf *source,RectFit *fit,int dw,int dh)
+{
+	FlushPreviewCache();
+	previewcache=preview;
+	previewcache_source=source;
+	previewcache_mask=mask;
+	previewcache_fit=*fit;
+	previewcache_dw=dw;
+	previewcache_dh=dh;
+	previewcache_bgcol=layout.bgcol;
+}
+
+
+void Layout_ImageInfo::FlushPreviewCache()
+{
+	if(previewcache)
+		g_object_unref(previewcache);
+	previewcache=NULL;
+	previewcache_source=NULL;
+}
+
+
 void Layout_ImageInfo::SetMask(const char *filename)
 {
 	if(mask)
@@ -848,7 +952,9 @@ GdkPixbuf *Layout_ImageInfo::GetThumbnail()
 			Debug[WARN] << "Mask loading failed - trying ImageSource method" << endl;
 			try
 			{
-				ImageSource *src=ISLoadImage(maskfilename);
+				// Thumbnails are no more than 256 pixels in either dimension,
+				// so the loader needn't decode any more than that.
+				ImageSource *src=ISLoadImage(maskfilename,256,256);
 				if(src)
 				{
 					int w,h;
@@ -889,7 +995,7 @@ GdkPixbuf *Layout_ImageInfo::GetThumbnail()
 	if(!thumbnail)
 	{
 		Debug[WARN] << "Can't get pixbuf - loading thumbnail via ImageSource..." << endl;
-		src=ISLoadImage(filename);
+		src=ISLoadImage(filename,256,256);
 		if(src)
 		{
 			int w,h;
@@ -944,7 +1050,7 @@ GdkPixbuf *Layout_ImageInfo::GetThumbnail()
 	{
 		if(!src)
 		{
-			src=ISLoadImage(filename);
+			src=ISLoadImage(filename,256,256);
 		}
 
 		CMSTransform *transform=NULL;
@@ -1033,10 +1139,16 @@ RectFit *Layout_ImageInfo::GetFit(double scale)
 }
 
 
-ImageSource *Layout_ImageInfo::GetImageSource(CMColourDevice target,CMTransformFactory *factory)
+// If minwidth and minheight are given, the image may be loaded at reduced size,
+// provided it's still at least that large.  This is skipped if the image is
+// to be sharpened, since the unsharp mask's radius is measured in pixels.
+
+ImageSource *Layout_ImageInfo::GetImageSource(CMColourDevice target,CMTransformFactory *factory,int minwidth,int minheight,bool recordhistogram)
 {
 	ImageSource *result=NULL;
-	ImageSource *is=ISLoadImage(filename);
+	if(Find(PPEffect_UnsharpMask::ID))
+		minwidth=minheight=0;
+	ImageSource *is=ISLoadImage(filename,minwidth,minheight);
 
 	is=ApplyEffects(is,PPEFFECT_PRESCALE);
 
@@ -1049,9 +1161,10 @@ ImageSource *Layout_ImageInfo::GetImageSource(CMColourDevice target,CMTransformF
 		is=new ImageSource_Promote(is,colourspace);
 
 	// If this fails we don't bother with the histogram, since another thread has it
-	// locked for writing.
+	// locked for writing.  The mutex is reentrant, so it can't tell further copies
+	// of a chain from the first - they must say so themselves.
 
-	if(histogram.AttemptMutexShared())
+	if(recordhistogram && histogram.AttemptMutexShared())
 	{
 		is=new PPIS_Histogram(is,histogram);
 		histogram.ReleaseMutexShared();	// ReleaseShared because the Histogram itself holds an exclusive lock
@@ -1114,12 +1227,31 @@ bool Layout_ImageInfo::GetSelected()
 void Layout_ImageInfo::SetSelected(bool sel)
 {
 	selected=sel;
+	UpdatePreviewPriority();
 }
 
 
 void Layout_ImageInfo::ToggleSelected()
 {
 	selected=!selected;
+	UpdatePreviewPriority();
+}
+
+
+int Layout_ImageInfo::GetPreviewPriority()
+{
+	if(selected)
+		return(HRPREVIEW_PRIORITY_SELECTED);
+	if(page==layout.GetCurrentPage())
+		return(HRPREVIEW_PRIORITY_CURRENTPAGE);
+	return(HRPREVIEW_PRIORITY_OFFPAGE);
+}
+
+
+void Layout_ImageInfo::UpdatePreviewPriority()
+{
+	if(hrrenderjob)
+		layout.jobdispatcher.SetJobPriority(hrrenderjob,GetPreviewPriority());
 }
 
 
@@ -1155,6 +1287,7 @@ void Layout_ImageInfo::CancelRenderThread()
 void Layout_ImageInfo::FlushHRPreview()
 {
 	CancelRenderThread();
+	FlushPreviewCache();
 	if(hrpreview)
 		g_object_unref(hrpreview);
 	hrpreview=NULL;
@@ -1163,6 +1296,7 @@ void Layout_ImageInfo::FlushHRPreview()
 
 void Layout_ImageInfo::SetHRPreview(GdkPixbuf *preview)
 {
+	FlushPreviewCache();
 	if(hrpreview)
 		g_object_unref(hrpreview);
 	hrpreview=NULL;
@@ -1200,6 +1334,27 @@ LCMSWrapper_Intent Layout_ImageInfo::GetRenderingIntent()
 }
 
 
+bool Layout_ImageInfo::Fingerprint(MD5Digest &digest)
+{
+	if(EffectCount(PPEFFECT_DONTCARE))
+		return(false);
+
+	LayoutRectangle *bounds=GetBounds();
+	ostringstream s;
+	s << filename << '\n';
+	s << (maskfilename ? maskfilename : "") << '\n';
+	s << (customprofile ? customprofile : "") << '\n';
+	s << customintent << ' ' << allowcropping << ' ' << crop_hpan << ' ' << crop_vpan << ' ' << rotation << ' ';
+	s << width << ' ' << height << ' ';
+	s << bounds->x << ' ' << bounds->y << ' ' << bounds->w << ' ' << bounds->h << '\n';
+	delete bounds;
+
+	string str=s.str();
+	digest.Update(str.c_str(),str.size());
+	return(true);
+}
+
+
 int Layout_ImageInfo::GetWidth()
 {
 	return(width);
@@ -14,6 +14,7 @@
 #include "support/thread.h"
 #include "support/threadevent.h"
 #include "support/jobqueue.h"
+#include "support/md5.h"
 #include "effects/ppeffect.h"
 #include "cmtransformworker.h"
 #include "miscwidgets/refcountui.h"
@@ -35,9 +36,24 @@ class ImageInfo_Worker : public CMTransformWorker
 	virtual ~ImageInfo_Worker()
 	{
 	}
+	// Each worker renders one preview at a time, but when fewer previews are
+	// pending than there are processors, a job can split its rendering
+	// between the spare ones.  Returns the number of threads it may use.
+	int GetSpareThreads()
+	{
+		queue.ObtainMutex();
+		int active=queue.ActiveJobCount();
+		queue.ReleaseMutex();
+		if(active<1)
+			active=1;
+		return(Thread::GetProcessorCount()/active);
+	}
 };
 
 
+// Priorities for high-res preview jobs - previews the user is looking at are rendered first.
+enum HRPreviewPriority {HRPREVIEW_PRIORITY_OFFPAGE,HRPREVIEW_PRIORITY_CURRENTPAGE,HRPREVIEW_PRIORITY_SELECTED};
+
 class HRRenderJob;
 class hr_payload;
 class Layout_ImageInfo : public PPEffectHeader, public RefCountUI
@@ -71,7 +87,12 @@ class Layout_ImageInfo : public PPEffectHeader, public RefCountUI
 	virtual const char *GetAssignedProfile();
 	virtual void SetRenderingIntent(LCMSWrapper_Intent intent);
 	virtual LCMSWrapper_Intent GetRenderingIntent();
-	virtual ImageSource *GetImageSource(CMColourDevice target=CM_COLOURDEVICE_PRINTER,CMTransformFactory *factory=NULL);
+	// Adds everything which affects how the image is printed to digest.  Returns false
+	// if the image has effects applied, since they can't be compared.
+	virtual bool Fingerprint(MD5Digest &digest);
+	// Only one copy of a chain built for ImageSource_Parallel should record the histogram.
+	virtual ImageSource *GetImageSource(CMColourDevice target=CM_COLOURDEVICE_PRINTER,CMTransformFactory *factory=NULL,
+		int minwidth=0,int minheight=0,bool recordhistogram=true);
 
 	// Thumbnail/preview related
 
@@ -81,6 +102,8 @@ class Layout_ImageInfo : public PPEffectHeader, public RefCountUI
 	virtual void FlushThumbnail();	// Top-level flush routine - flushes low and high-res previews, and cancels render thread
 	virtual void FlushHRPreview();	// Flushes just the high-res preview, cancels thread
 	virtual void CancelRenderThread();	// Cancels rendering thread.
+	virtual int GetPreviewPriority();	// Priority for the rendering thread, based on page and selection.
+	virtual void UpdatePreviewPriority();	// Call when the page or selection changes.
 
 										// WARNING - for efficiency, these routines may return before a rendering thread
 										// has actually finished running.  Thus, you should call ObtainMutex() on this
@@ -88,6 +111,7 @@ class Layout_ImageInfo : public PPEffectHeader, public RefCountUI
 										// transform factory.
 
 	virtual void SetHRPreview(GdkPixbuf *preview); // Called by idle handler once render thread has completed.
+	virtual void FlushPreviewCache();	// Discards the transformed preview kept between redraws.
 	virtual PPHistogram &GetHistogram();
 
 	int page;
@@ -104,6 +128,14 @@ class Layout_ImageInfo : public PPEffectHeader, public RefCountUI
 	GdkPixbuf *thumbnail;
 	GdkPixbuf *mask;
 	GdkPixbuf *hrpreview;
+	// The thumbnail or high-res preview as last drawn, rotated, scaled and masked to fit its slot,
+	// along with the details needed to tell whether it can be reused.
+	GdkPixbuf *previewcache;
+	GdkPixbuf *previewcache_source;
+	GdkPixbuf *previewcache_mask;
+	RectFit previewcache_fit;
+	int previewcache_dw,previewcache_dh;
+	GdkColor previewcache_bgcol;
 	bool selected;
 	char *customprofile;
 	LCMSWrapper_Intent customintent;
@@ -111,6 +143,8 @@ class Layout_ImageInfo : public PPEffectHeader, public RefCountUI
 	ThreadEventHandler threadevents;
 	PPHistogram histogram;
 	Job *hrrenderjob;
+	bool PreviewCacheValid(GdkPixbuf *source,RectFit *fit,int dw,int dh);
+	void SetPreviewCache(GdkPixbuf *preview,GdkPixbuf *source,RectFit *fit,int dw,int dh);
 	friend class Layout;
 	friend class hr_payload;
 	friend class HRRenderJob;
@@ -249,7 +249,84 @@ void Layout_NUp::CopyImage(Layout_ImageInfo *ii)
 }
 
 
-ImageSource *Layout_NUp::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage)
+// Builds an image's chain once the page's montage reaches it, so only the
+// images on the rows being rendered need be open at any one time.  This isn't
+// thread-safe, so a montage which will be read from another thread must
+// build its components up front.
+
+class Layout_NUp_ComponentFactory : public ISMontage_ComponentFactory
+{
+	public:
+	Layout_NUp_ComponentFactory(Layout_NUp_ImageInfo *ii,RectFit *fit,LayoutRectangle *target,CMColourDevice device,
+		CMTransformFactory *factory,IS_ScalingQuality qual,int res,bool recordhistogram)
+		: ISMontage_ComponentFactory(fit->width,fit->height), ii(ii), device(device), factory(factory), qual(qual), res(res),
+		recordhistogram(recordhistogram),
+		rotation(fit->rotation), scaledwidth(fit->width), scaledheight(fit->height), xoffset(fit->xoffset), yoffset(fit->yoffset)
+	{
+		// The image is decoded at reduced size where the loader supports it.
+		minwidth=fit->width;
+		minheight=fit->height;
+		if(rotation==90 || rotation==270)
+		{
+			minwidth=fit->height;
+			minheight=fit->width;
+		}
+
+		if(ii->allowcropping)
+		{
+			if(width>target->w)
+				width=target->w;
+			if(height>target->h)
+				height=target->h;
+		}
+
+		// The image mustn't be freed while the page is being rendered.
+		ii->Ref();
+	}
+	~Layout_NUp_ComponentFactory()
+	{
+		ii->UnRef();
+	}
+	ImageSource *GetImageSource()
+	{
+		ImageSource *img=ii->GetImageSource(device,factory,minwidth,minheight,recordhistogram);
+		if(!img)
+			return(NULL);
+
+		if(rotation)
+			img=new ImageSource_Rotate(img,rotation);
+
+		img=ISScaleImageBySize(img,scaledwidth,scaledheight,qual);
+		img->SetResolution(res,res);
+
+		Debug[TRACE] << "xoffset: " << xoffset << endl;
+		Debug[TRACE] << "yoffset: " << yoffset << endl;
+
+		if(ii->allowcropping)
+		{
+			Debug[TRACE] << "Cropping" << endl;
+			img=ISCropImage(img,xoffset,yoffset,width,height);
+		}
+		else
+			Debug[TRACE] << "Not cropping" << endl;
+
+		return(ii->ApplyMask(img));
+	}
+	protected:
+	Layout_NUp_ImageInfo *ii;
+	CMColourDevice device;
+	CMTransformFactory *factory;
+	IS_ScalingQuality qual;
+	int res;
+	bool recordhistogram;
+	int rotation;
+	int scaledwidth,scaledheight;
+	int xoffset,yoffset;
+	int minwidth,minheight;
+};
+
+
+ImageSource *Layout_NUp::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage,int flags)
 {
 	ImageSource *result=NULL;
 	enum IS_TYPE colourspace=GetColourSpace(target);
@@ -266,54 +343,27 @@ ImageSource *Layout_NUp::GetImageSource(int page,CMColourDevice target,CMTransfo
 	{
 		if(ii->page==page)
 		{
-			ImageSource *img=ii->GetImageSource(target,factory);
-			if(img)
-			{
-				LayoutRectangle r(img->width,img->height);
-				LayoutRectangle *target=ii->GetBounds();
-				double scale=res;
-				scale/=72.0;
-				target->Scale(scale);
-				
-				RectFit *fit=r.Fit(*target,ii->allowcropping,ii->rotation,ii->crop_hpan,ii->crop_vpan);
-
-				if(fit->rotation)
-					img=new ImageSource_Rotate(img,fit->rotation);
-				
-				img=ISScaleImageBySize(img,fit->width,fit->height,qual);
-				img->SetResolution(res,res);
-				
-				if(fit->width>target->w)
-					fit->width=target->w;
-				if(fit->height>target->h)
-					fit->height=target->h;
-
-				if(img->width<fit->width)
-					fit->width=img->width;
-				if(img->height<fit->height)
-					fit->height=img->height;
-
-				Debug[TRACE] << "xoffset: " << fit->xoffset << endl;
-				Debug[TRACE] << "yoffset: " << fit->yoffset << endl;
-
-				if(ii->allowcropping)
-				{
-					Debug[TRACE] << "Cropping" << endl;
-					img=new ImageSource_Crop(img,fit->xoffset,fit->yoffset,fit->width,fit->height);
-				}
-				else
-					Debug[TRACE] << "Not cropping" << endl;
-
-				img=ii->ApplyMask(img);
-
-				mon->Add(img,fit->xpos,fit->ypos);
-				delete fit;
-			}
+			// The image's placement is worked out from its full size, so the montage
+			// can be sized before any image is opened.
+			LayoutRectangle full(ii->GetWidth(),ii->GetHeight());
+			LayoutRectangle *bounds=ii->GetBounds();
+			bounds->Scale(res/72.0);
+			RectFit *fit=full.Fit(*bounds,ii->allowcropping,ii->rotation,ii->crop_hpan,ii->crop_vpan);
+
+			mon->Add(new Layout_NUp_ComponentFactory(ii,fit,bounds,target,factory,qual,res,!(flags&PPLAYOUT_CHAIN_COPY)),fit->xpos,fit->ypos);
+
+			delete fit;
+			delete bounds;
 		}
 		ii=(Layout_NUp_ImageInfo *)it.NextImage();
 	}
 	result=mon;
 
+	// Images are normally opened as the montage reaches them, but that mustn't
+	// happen on ImageSource_Parallel's worker threads.
+	if(flags&PPLAYOUT_CHAIN_PARALLEL)
+		mon->BuildComponents();
+
 	// Load background image, if present...
 	if(backgroundfilename)
 	{
@@ -360,6 +410,29 @@ ImageSource *Layout_NUp::GetImageSource(int page,CMColourDevice target,CMTransfo
 }
 
 
+// A page's output depends only on its images, their slots and the background,
+// since the resolution, scaling quality and printer settings are the same for
+// every page in a job.
+
+std::string Layout_NUp::GetPageFingerprint(int page)
+{
+	MD5Digest digest;
+	digest.Update(GetType(),strlen(GetType()));
+	if(backgroundfilename)
+		digest.Update(backgroundfilename,strlen(backgroundfilename)+1);
+
+	LayoutIterator it(*this);
+	Layout_ImageInfo *ii=it.FirstImage();
+	while(ii)
+	{
+		if(ii->page==page && !ii->Fingerprint(digest))
+			return(std::string());
+		ii=it.NextImage();
+	}
+	return(std::string(digest.GetPrintableDigest()));
+}
+
+
 void Layout_NUp::DBToLayout(LayoutDB &db)
 {
 	Layout::DBToLayout(db);
@@ -27,6 +27,8 @@
 #include "imagesource/imagesource_flatten.h"
 #include "imagesource/imagesource_montage.h"
 #include "imagesource/imagesource_solid.h"
+#include "imagesource/imagesource_parallel.h"
+#include "imageutils/cachedimage.h"
 
 #include "photoprint_state.h"
 #include "pp_layout_poster.h"
@@ -87,7 +89,7 @@ LayoutRectangle *Layout_Poster_ImageInfo::GetBounds()
 
 
 Layout_Poster::Layout_Poster(PhotoPrint_State &state,Layout *oldlayout)
-	: Layout(state,oldlayout), posters(1), currentposter(0), htiles(1), vtiles(1)
+	: Layout(state,oldlayout), posters(1), currentposter(0), htiles(1), vtiles(1), cache(NULL), cachetiles(false)
 {
 }
 
@@ -168,7 +170,292 @@ void Layout_Poster::CopyImage(Layout_ImageInfo *ii)
 
 // FIXME - this routine is *UGLY*.
 
-ImageSource *Layout_Poster::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage)
+// Supplies the parallel renderer with copies of the chain for the part of the
+// image covered by the poster's tiles.
+
+class Layout_Poster_ChainFactory : public ISParallel_ChainFactory
+{
+	public:
+	Layout_Poster_ChainFactory(Layout_Poster &layout,Layout_Poster_ImageInfo *ii,int rotation,double scale,
+		CMColourDevice target,int res,int l,int t,int w,int h)
+		: ISParallel_ChainFactory(), layout(layout), ii(ii), rotation(rotation), scale(scale),
+		target(target), res(res), l(l), t(t), w(w), h(h), recordhistogram(true)
+	{
+	}
+	~Layout_Poster_ChainFactory()
+	{
+		while(!factories.empty())
+		{
+			delete factories.front();
+			factories.pop_front();
+		}
+	}
+	ImageSource *GetImageSource()
+	{
+		CMTransformFactory *factory=layout.state.profilemanager.GetTransformFactory();
+		factories.push_back(factory);
+		ImageSource *is=layout.GetRegionImageSource(ii,rotation,scale,target,factory,res,l,t,w,h,recordhistogram);
+		recordhistogram=false;
+		return(is);
+	}
+	protected:
+	Layout_Poster &layout;
+	Layout_Poster_ImageInfo *ii;
+	int rotation;
+	double scale;
+	CMColourDevice target;
+	int res;
+	int l,t,w,h;
+	bool recordhistogram;	// Only the first copy of the chain records the histogram.
+	std::list<CMTransformFactory *> factories;
+};
+
+
+// The image rendered at print resolution, shared by all its tiles.  Rows are
+// rendered the first time any tile needs them, so the first page prints while
+// the rest of the image is still being rendered.  Each tile's ImageSource holds
+// a reference, since Layout::Print() builds the next page's chain before the
+// current page is finished with.
+
+class Layout_Poster_Cache : public CachedImage_Deferred
+{
+	public:
+	Layout_Poster_Cache(ImageSource *source,Layout_Poster_ImageInfo *ii,CMColourDevice target,int res,int left,int top)
+		: CachedImage_Deferred(source), left(left), top(top), ii(ii), target(target), res(res), refcount(1), refmutex()
+	{
+	}
+	bool Matches(Layout_Poster_ImageInfo *i,CMColourDevice t,int r)
+	{
+		return(ii==i && target==t && res==r);
+	}
+	void Ref()
+	{
+		refmutex.ObtainMutex();
+		++refcount;
+		refmutex.ReleaseMutex();
+	}
+	void UnRef()
+	{
+		refmutex.ObtainMutex();
+		int r=--refcount;
+		refmutex.ReleaseMutex();
+		if(r==0)
+			delete this;
+	}
+	ImageSource *GetImageSource();
+	int GetWidth()
+	{
+		return(width);
+	}
+	int GetHeight()
+	{
+		return(height);
+	}
+	int left,top;	// Position of the cached area within the rotated image, in the image's pixels.
+	protected:
+	Layout_Poster_ImageInfo *ii;
+	CMColourDevice target;
+	int res;
+	int refcount;
+	PTMutex refmutex;
+};
+
+
+class ImageSource_PosterCache : public ImageSource_CachedImage
+{
+	public:
+	ImageSource_PosterCache(Layout_Poster_Cache *cache) : ImageSource_CachedImage(cache), cache(cache)
+	{
+		cache->Ref();
+	}
+	~ImageSource_PosterCache()
+	{
+		// The tile we hold must be unlocked before the cache can go.
+		if(lockedtile>=0)
+			image->UnlockTile(lockedtile);
+		lockedtile=-1;
+		cache->UnRef();
+	}
+	protected:
+	Layout_Poster_Cache *cache;
+};
+
+
+ImageSource *Layout_Poster_Cache::GetImageSource()
+{
+	return(new ImageSource_PosterCache(this));
+}
+
+
+// Works out which part of the image, rotated and of the given size, appears
+// on a tile, allowing for the overlap between tiles.  Also sets xoffset and
+// yoffset to the tile's position on the page - Layout::Print() saves them along
+// with each page's ImageSource, since it builds the next page's early.
+
+void Layout_Poster::GetTileRect(RectFit *fit,int width,int height,int ht,int vt,int &l,int &t,int &r,int &b)
+{
+	l=ht*(imageablewidth-hoverlap);
+	r=(ht+1)*imageablewidth-ht*hoverlap;
+	t=vt*(imageableheight-voverlap);
+	b=(vt+1)*imageableheight-vt*voverlap;
+
+	Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
+	Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
+
+	xoffset=leftmargin;
+	yoffset=topmargin;
+
+	l-=fit->xpos;
+	r-=fit->xpos;
+	t-=fit->ypos;
+	b-=fit->ypos;
+
+	Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
+	Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
+
+	if(l<0)
+	{
+		l=0;
+		xoffset+=fit->xpos;
+	}
+	
+	if(t<0)
+	{
+		t=0;
+		yoffset+=fit->ypos;
+	}
+	
+	if(r>fit->width) r=fit->width;
+	if(b>fit->height) b=fit->height;
+
+	l+=fit->xoffset;
+	r+=fit->xoffset;
+	t+=fit->yoffset;
+	b+=fit->yoffset;
+	
+	Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
+	Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
+
+	l=(width*l)/fit->width;
+	r=(width*r)/fit->width;
+	t=(height*t)/fit->height;
+	b=(height*b)/fit->height;
+
+	Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
+	Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
+}
+
+
+// Builds the chain for part of the image, given in the rotated image's pixels,
+// scaled to the output resolution.
+
+ImageSource *Layout_Poster::GetRegionImageSource(Layout_Poster_ImageInfo *ii,int rotation,double scale,
+	CMColourDevice target,CMTransformFactory *factory,int res,int l,int t,int w,int h,bool recordhistogram)
+{
+	ImageSource *is=ii->GetImageSource(target,factory,0,0,recordhistogram);
+
+	if(rotation)
+		is=new ImageSource_Rotate(is,rotation);
+
+	is=ii->ApplyMask(is);
+	is=new ImageSource_Flatten(is);
+
+	Debug[TRACE] << "Old resolution: " << is->xres << " x " << is->yres << " dpi" << endl;
+	is->SetResolution(72.0/scale,72.0/scale);
+
+	is=ISCropImage(is,l,t,w,h);
+
+	IS_ScalingQuality qual=IS_ScalingQuality(state.FindInt("ScalingQuality"));
+	return(ISScaleImageByResolution(is,res,res,qual));
+}
+
+
+// Returns a tile cut from the cached rendering of the image, rendering it first if
+// the image hasn't been cached yet.  The cache covers every tile, so the image is
+// loaded, colour managed and scaled only once.  Returns NULL if the rendering
+// would be too large to keep.
+
+ImageSource *Layout_Poster::GetCachedTile(Layout_Poster_ImageInfo *ii,RectFit *fit,int width,int height,
+	int ht,int vt,CMColourDevice target,int res)
+{
+	double srcres=72.0/fit->scale;
+	int l,t,r,b;
+
+	if(!cache || !cache->Matches(ii,target,res))
+	{
+		if(cache)
+			cache->UnRef();
+		cache=NULL;
+
+		int r1,b1;
+		GetTileRect(fit,width,height,htiles-1,vtiles-1,l,t,r1,b1);
+		GetTileRect(fit,width,height,0,0,l,t,r,b);
+
+		// The rendering's size is worked out the same way as the tiles' positions
+		// within it below, so there's no need to build the chain to find it.
+		int samples=STRIP_ALPHA(GetColourSpace(target))==IS_TYPE_CMYK ? 4 : 3;
+		long long cw=(long long)(((r1-l)*res)/srcres);
+		long long ch=(long long)(((b1-t)*res)/srcres);
+		if(cw*ch*samples*sizeof(ISDataType)>LAYOUT_POSTER_CACHELIMIT)
+		{
+			Debug[TRACE] << "Poster image too large to cache - rendering each tile separately" << endl;
+			return(NULL);
+		}
+
+		Layout_Poster_ChainFactory *chainfactory=new Layout_Poster_ChainFactory(*this,ii,fit->rotation,fit->scale,
+			target,res,l,t,r1-l,b1-t);
+		ImageSource *is=chainfactory->GetImageSource();
+		if(!is)
+		{
+			delete chainfactory;
+			return(NULL);
+		}
+		cache=new Layout_Poster_Cache(new ImageSource_Parallel(is,chainfactory),ii,target,res,l,t);
+	}
+
+	GetTileRect(fit,width,height,ht,vt,l,t,r,b);
+
+	int cl=int(((l-cache->left)*res)/srcres);
+	int ct=int(((t-cache->top)*res)/srcres);
+	int cw=int(((r-l)*res)/srcres);
+	int ch=int(((b-t)*res)/srcres);
+	if(cl+cw>cache->GetWidth())
+		cw=cache->GetWidth()-cl;
+	if(ct+ch>cache->GetHeight())
+		ch=cache->GetHeight()-ct;
+
+	Debug[TRACE] << "Tile from cache: " << cl << ", " << ct << " (" << cw << " x " << ch << ")" << endl;
+
+	return(ISCropImage(cache->GetImageSource(),cl,ct,cw,ch));
+}
+
+
+// Tiles are only served from the cache while printing, when the layout can't
+// change and the pages are requested in order.
+
+void Layout_Poster::Print(Progress *p)
+{
+	cachetiles=true;
+	try
+	{
+		Layout::Print(p);
+	}
+	catch(...)
+	{
+		cachetiles=false;
+		if(cache)
+			cache->UnRef();
+		cache=NULL;
+		throw;
+	}
+	cachetiles=false;
+	if(cache)
+		cache->UnRef();
+	cache=NULL;
+}
+
+
+ImageSource *Layout_Poster::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage,int flags)
 {
 	ImageSource *is=NULL;
 	try
@@ -183,83 +470,35 @@ ImageSource *Layout_Poster::GetImageSource(int page,CMColourDevice target,CMTran
 
 		Layout_Poster_ImageInfo *ii=(Layout_Poster_ImageInfo *)ImageAt(p);
 		
+		if(!res)
+			res=state.FindInt("RenderingResolution");
+
 		if(ii)
 		{
 			GetImageableArea();
 
-			is=ii->GetImageSource(target,factory);
-			LayoutRectangle srcr(is->width,is->height);
-			LayoutRectangle target(posterwidth,posterheight);
+			LayoutRectangle srcr(ii->GetWidth(),ii->GetHeight());
+			LayoutRectangle poster(posterwidth,posterheight);
 			
-			RectFit *fit=srcr.Fit(target,ii->allowcropping,ii->rotation,ii->crop_hpan,ii->crop_vpan);
-
-			if(fit->rotation)
-				is=new ImageSource_Rotate(is,fit->rotation);
-
-			int l=ht*(imageablewidth-hoverlap);
-			int r=(ht+1)*imageablewidth-ht*hoverlap;
-			int t=vt*(imageableheight-voverlap);
-			int b=(vt+1)*imageableheight-vt*voverlap;
-
-			Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
-			Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
-
-			xoffset=leftmargin;
-			yoffset=topmargin;
-
-			l-=fit->xpos;
-			r-=fit->xpos;
-			t-=fit->ypos;
-			b-=fit->ypos;
-
-			Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
-			Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
+			RectFit *fit=srcr.Fit(poster,ii->allowcropping,ii->rotation,ii->crop_hpan,ii->crop_vpan);
 
-			if(l<0)
+			int width=ii->GetWidth();
+			int height=ii->GetHeight();
+			if(fit->rotation==90 || fit->rotation==270)
 			{
-				l=0;
-				xoffset+=fit->xpos;
+				width=ii->GetHeight();
+				height=ii->GetWidth();
 			}
-			
-			if(t<0)
-			{
-				t=0;
-				yoffset+=fit->ypos;
-			}
-			
-			if(r>fit->width) r=fit->width;
-			if(b>fit->height) b=fit->height;
-
-			l+=fit->xoffset;
-			r+=fit->xoffset;
-			t+=fit->yoffset;
-			b+=fit->yoffset;
-			
-			Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
-			Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
-
-			l=(is->width*l)/fit->width;
-			r=(is->width*r)/fit->width;
-			t=(is->height*t)/fit->height;
-			b=(is->height*b)/fit->height;
 
-			Debug[TRACE] << "Left: " << l << ", Right: " << r << endl;
-			Debug[TRACE] << "Top: " << t << ", Bottom: " << b << endl;
+			if(cachetiles)
+				is=GetCachedTile(ii,fit,width,height,ht,vt,target,res);
 
-			is=ii->ApplyMask(is);
-			is=new ImageSource_Flatten(is);
-
-			Debug[TRACE] << "Old resolution: " << is->xres << " x " << is->yres << " dpi" << endl;
-			is->SetResolution(72.0/fit->scale,72.0/fit->scale);
-
-			is=new ImageSource_Crop(is,l,t,r-l,b-t);
-
-
-			IS_ScalingQuality qual=IS_ScalingQuality(state.FindInt("ScalingQuality"));
-			if(!res)
-				res=state.FindInt("RenderingResolution");
-
-			is=ISScaleImageByResolution(is,res,res,qual);
+			if(!is)
+			{
+				int l,t,r,b;
+				GetTileRect(fit,width,height,ht,vt,l,t,r,b);
+				is=GetRegionImageSource(ii,fit->rotation,fit->scale,target,factory,res,l,t,r-l,b-t,!(flags&PPLAYOUT_CHAIN_COPY));
+			}
 
 			delete fit;
 		}
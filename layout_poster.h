@@ -14,8 +14,14 @@
 #include "layout.h"
 
 class Layout_Poster_ImageInfo;
+class Layout_Poster_Cache;
 class PhotoPrint_State;
 
+// Tiles are served from a single rendering of the image while printing.  The
+// rendering is paged out to disk beyond CachedImage's memory budget, so this
+// limit only keeps it from filling the temporary directory.
+#define LAYOUT_POSTER_CACHELIMIT (8LL*1024*1024*1024)
+
 struct PosterFit
 {
 	int width,height;
@@ -46,7 +52,8 @@ class Layout_Poster : public Layout
 	virtual void DrawGridLines(GtkWidget *widget);
 	virtual void SetCurrentPage(int page);
 	ImageSource *GetImageSource(int page,CMColourDevice target=CM_COLOURDEVICE_PRINTER,
-		CMTransformFactory *factory=NULL,int res=0,bool completepage=false);
+		CMTransformFactory *factory=NULL,int res=0,bool completepage=false,int flags=0);
+	virtual void Print(Progress *p);	// Overridden so the tiles can share a cached rendering.
 	Layout_Poster_ImageInfo *ImageAt(int page);
 	void DrawPreview(GtkWidget *widget,int xpos,int ypos,int width,int height);
 	virtual void (*SetUnitFunc())(GtkWidget *wid,enum Units unit);
@@ -55,7 +62,16 @@ class Layout_Poster : public Layout
 	int paperwidth,paperheight;
 	int hoverlap,voverlap;
 	int htiles,vtiles;
+	protected:
+	void GetTileRect(RectFit *fit,int width,int height,int ht,int vt,int &l,int &t,int &r,int &b);
+	ImageSource *GetRegionImageSource(Layout_Poster_ImageInfo *ii,int rotation,double scale,
+		CMColourDevice target,CMTransformFactory *factory,int res,int l,int t,int w,int h,bool recordhistogram=true);
+	ImageSource *GetCachedTile(Layout_Poster_ImageInfo *ii,RectFit *fit,int width,int height,
+		int ht,int vt,CMColourDevice target,int res);
+	Layout_Poster_Cache *cache;	// The image currently being printed, rendered once for all its tiles.
+	bool cachetiles;
 	friend class Layout_Poster_ImageInfo;
+	friend class Layout_Poster_ChainFactory;
 };
 
 
@@ -184,9 +184,9 @@ void Layout_Single_ImageInfo::DrawThumbnail(GtkWidget *widget,int xpos,int ypos,
 }
 
 
-ImageSource *Layout_Single_ImageInfo::GetImageSource(CMColourDevice target,CMTransformFactory *factory)
+ImageSource *Layout_Single_ImageInfo::GetImageSource(CMColourDevice target,CMTransformFactory *factory,int minwidth,int minheight,bool recordhistogram)
 {
-	ImageSource *is=Layout_ImageInfo::GetImageSource(target,factory);
+	ImageSource *is=Layout_ImageInfo::GetImageSource(target,factory,minwidth,minheight,recordhistogram);
 
 	// Need to swap H and V scale if the image is rotated.
 	switch(rotation)
@@ -202,6 +202,13 @@ ImageSource *Layout_Single_ImageInfo::GetImageSource(CMColourDevice target,CMTra
 			is->yres=(yres*100)/hscale;
 			break;
 	}
+
+	// Allow for the image having been loaded at reduced size.
+	if(is->width!=width)
+	{
+		is->xres=(is->xres*is->width)/width;
+		is->yres=(is->yres*is->height)/height;
+	}
 	return(is);
 }
 
@@ -333,7 +340,7 @@ void Layout_Single::CopyImage(Layout_ImageInfo *ii)
 }
 
 
-ImageSource *Layout_Single::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage)
+ImageSource *Layout_Single::GetImageSource(int page,CMColourDevice target,CMTransformFactory *factory,int res,bool completepage,int flags)
 {
 	ImageSource *result=NULL;
 	try
@@ -341,7 +348,7 @@ ImageSource *Layout_Single::GetImageSource(int page,CMColourDevice target,CMTran
 		Layout_Single_ImageInfo *ii=(Layout_Single_ImageInfo *)ImageAt(page);
 		if(ii)
 		{
-			ImageSource *is=ii->GetImageSource(target,factory);
+			ImageSource *is=ii->GetImageSource(target,factory,0,0,!(flags&PPLAYOUT_CHAIN_COPY));
 			switch(ii->rotation)
 			{
 				case PP_ROTATION_90:
@@ -376,6 +383,17 @@ ImageSource *Layout_Single::GetImageSource(int page,CMColourDevice target,CMTran
 }
 
 
+std::string Layout_Single::GetPageFingerprint(int page)
+{
+	MD5Digest digest;
+	digest.Update(GetType(),strlen(GetType()));
+	Layout_ImageInfo *ii=ImageAt(page);
+	if(!ii || !ii->Fingerprint(digest))
+		return(std::string());
+	return(std::string(digest.GetPrintableDigest()));
+}
+
+
 void Layout_Single::SetPageExtent(PageExtent &pe)
 {
 	pe.GetImageableArea();
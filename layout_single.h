@@ -34,7 +34,8 @@ class Layout_Single : public Layout
 	virtual void RefreshWidget(GtkWidget *widget);
 	virtual void Print(Progress *p);	// Overridden so we can set the top/left position...
 	virtual ImageSource *GetImageSource(int page,CMColourDevice target=CM_COLOURDEVICE_PRINTER,
-		CMTransformFactory *factory=NULL,int res=0,bool completepage=false);
+		CMTransformFactory *factory=NULL,int res=0,bool completepage=false,int flags=0);
+	virtual std::string GetPageFingerprint(int page);
 	Layout_Single_ImageInfo *ImageAt(int page);
 	virtual void (*SetUnitFunc())(GtkWidget *wid,enum Units unit);
 	friend class Layout_Single_ImageInfo;
@@ -49,7 +50,8 @@ class Layout_Single_ImageInfo : public Layout_ImageInfo
 	Layout_Single_ImageInfo(Layout_Single &layout,Layout_ImageInfo *ii,int page);
 	virtual ~Layout_Single_ImageInfo();
 	void DrawThumbnail(GtkWidget *widget,int xpos,int ypos,int width,int height);
-	virtual ImageSource *GetImageSource(CMColourDevice target=CM_COLOURDEVICE_PRINTER,CMTransformFactory *factory=NULL);
+	virtual ImageSource *GetImageSource(CMColourDevice target=CM_COLOURDEVICE_PRINTER,CMTransformFactory *factory=NULL,
+		int minwidth=0,int minheight=0,bool recordhistogram=true);
 	virtual LayoutRectangle *GetBounds();	// The dimensions of the image's "slot".
 	virtual RectFit *GetFit(double scale);	// Details of the image's size after fitting to its slot.
 	virtual bool GetSelected();
@@ -41,7 +41,7 @@
 
 using namespace std;
 
-bool ParseOptions(int argc,char *argv[],char **presetname)
+bool ParseOptions(int argc,char *argv[],char **presetname,int *threads)
 {
 	int batchmode=false;
 	static struct option long_options[] =
@@ -51,13 +51,14 @@ bool ParseOptions(int argc,char *argv[],char **presetname)
 		{"preset",required_argument,NULL,'p'},
 		{"batch",no_argument,NULL,'b'},
 		{"debug",required_argument,NULL,'d'},
+		{"threads",required_argument,NULL,'t'},
 		{0, 0, 0, 0}
 	};
 
 	while(1)
 	{
 		int c;
-		c = getopt_long(argc,argv,"hvp:bd:",long_options,NULL);
+		c = getopt_long(argc,argv,"hvp:bd:t:",long_options,NULL);
 		if(c==-1)
 			break;
 		switch (c)
@@ -69,6 +70,7 @@ bool ParseOptions(int argc,char *argv[],char **presetname)
 				printf("\t -p --preset\t\tread a specific preset file\n");
 				printf("\t -b --batch\t\trun without user interface\n");
 				printf("\t -d --debug\t\tset debugging level - 0 for silent, 4 for verbose\n");
+				printf("\t -t --threads\t\tnumber of preview rendering threads - 0 for one per processor\n");
 				throw 0;
 				break;
 			case 'v':
@@ -84,6 +86,9 @@ bool ParseOptions(int argc,char *argv[],char **presetname)
 			case 'd':
 				Debug.SetLevel(DebugLevel(atoi(optarg)));
 				break;
+			case 't':
+				*threads=atoi(optarg);
+				break;
 		}
 	}
 	return(batchmode);
@@ -102,6 +107,7 @@ int main(int argc,char **argv)
 	Debug[TRACE] << "Photoprint starting..." << endl;
 	gboolean have_gtk=false;
 	char *presetname=NULL;
+	int threads=-1;
 
 	Debug.SetLevel(WARN);
 #ifdef WIN32
@@ -112,7 +118,7 @@ int main(int argc,char **argv)
 
 	try
 	{
-		bool batchmode=ParseOptions(argc,argv,&presetname);
+		bool batchmode=ParseOptions(argc,argv,&presetname,&threads);
 		if(!batchmode)
 			have_gtk=gtk_init_check (&argc, &argv);
 
@@ -149,6 +155,8 @@ int main(int argc,char **argv)
 			splash->SetMessage(_("Loading preset..."));
 		state.ParseConfigFile();
 
+		state.previewthreads=threads;
+
 		if(have_gtk)
 		{
 			splash->SetMessage(_("Creating layout..."));
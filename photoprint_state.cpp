@@ -53,6 +53,7 @@ ConfigTemplate PhotoPrint_State::Template[]=
 	ConfigTemplate("Win_W",int(0)),
 	ConfigTemplate("Win_H",int(0)),
 	ConfigTemplate("HighresPreviews",int(1)),
+	ConfigTemplate("PreviewThreads",int(0)),
 	ConfigTemplate("ExpanderState_SigControl",int(1)),
 	ConfigTemplate("ExpanderState_Carousel",int(1)),
 	ConfigTemplate("ExpanderState_Single",int(1)),
@@ -129,7 +130,7 @@ class PPPathDBHandler : public ConfigDBHandler
 
 PhotoPrint_State::PhotoPrint_State(bool batchmode)
 	: ConfigFile(), ConfigDB(Template), layout(NULL), filename(NULL), layoutdb(this,"[Layout]"), printoutput(this,"[Output]"),
-	printer(printoutput,this,"[Print]"), profilemanager(this,"[ColourManagement]"), bordersearchpath(), backgroundsearchpath(), batchmode(batchmode)
+	printer(printoutput,this,"[Print]"), profilemanager(this,"[ColourManagement]"), bordersearchpath(), backgroundsearchpath(), batchmode(batchmode), previewthreads(-1)
 {
 	new PPPathDBHandler(this,"[General]",this,*this);
 	SetDefaultFilename();
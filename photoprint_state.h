@@ -36,6 +36,7 @@ class PhotoPrint_State : public ConfigFile, public ConfigDB
 	SearchPathHandler bordersearchpath;
 	SearchPathHandler backgroundsearchpath;
 	bool batchmode;
+	int previewthreads;	// Overrides PreviewThreads for this session only, if not -1.
 	protected:
 	static ConfigTemplate Template[];
 };
@@ -18,8 +18,10 @@
 #include <iostream>
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
 
 #include "../support/debug.h"
+#include "../support/cpufeatures.h"
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
@@ -34,6 +36,10 @@
 
 using namespace std;
 
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 CMSRGBPrimaries CMSPrimaries_Rec709(.64,.33,.3,.6,.15,.06);
 CMSRGBPrimaries CMSPrimaries_Adobe(0.64, 0.33,0.21, 0.71,0.15, 0.06);
 CMSRGBPrimaries CMSPrimaries_NTSC(0.67, 0.33, 0.21, 0.71,0.14, 0.08);
@@ -482,6 +488,24 @@ void CMSTransform::Transform(unsigned short *src,unsigned short *dst,int pixels)
 }
 
 
+// Saves the transform as a device link profile, from which an equivalent
+// transform can be built far more quickly than from the original profiles.
+
+bool CMSTransform::SaveDeviceLink(const char *filename)
+{
+	if(!transform)
+		return(false);
+
+	cmsHPROFILE link=cmsTransform2DeviceLink(transform,4.3,0);
+	if(!link)
+		return(false);
+
+	bool result=cmsSaveProfileToFile(link,filename);
+	cmsCloseProfile(link);
+	return(result);
+}
+
+
 IS_TYPE CMSTransform::GetInputColourSpace()
 {
 	return(inputtype);
@@ -758,3 +782,195 @@ CMSProofingTransform::CMSProofingTransform(CMSProfile *devicelink,CMSProfile *pr
 		CMS_GetLCMSIntent(proofintent),
 		CMS_GetLCMSIntent(viewintent), CMS_GetLCMSFlags(proofintent)|cmsFLAGS_SOFTPROOFING);
 }
+
+
+// CMSLUTTransform
+
+CMSLUTTransform::CMSLUTTransform(CMSTransform *source,int gridpoints)
+	: CMSTransform(), gridpoints(gridpoints), lut(NULL)
+{
+	transform=NULL;
+	inputtype=source->GetInputColourSpace();
+	outputtype=source->GetOutputColourSpace();
+
+	if(inputtype!=IS_TYPE_RGB)
+		throw "CMSLUTTransform: only RGB input is supported";
+
+	switch(outputtype)
+	{
+		case IS_TYPE_GREY:
+			outchannels=1;
+			break;
+		case IS_TYPE_RGB:
+		case IS_TYPE_LAB:
+			outchannels=3;
+			break;
+		case IS_TYPE_CMYK:
+			outchannels=4;
+			break;
+		default:
+			throw "Unsupported colour space (output)";
+			break;
+	}
+
+	// Push the whole grid through the source transform in one call.
+	int nodes=gridpoints*gridpoints*gridpoints;
+	unsigned short *in=(unsigned short *)malloc(sizeof(unsigned short)*nodes*3);
+	unsigned short *out=(unsigned short *)malloc(sizeof(unsigned short)*nodes*outchannels);
+	int n=0;
+	for(int r=0;r<gridpoints;++r)
+	{
+		for(int g=0;g<gridpoints;++g)
+		{
+			for(int b=0;b<gridpoints;++b)
+			{
+				in[n++]=(r*65535+(gridpoints-1)/2)/(gridpoints-1);
+				in[n++]=(g*65535+(gridpoints-1)/2)/(gridpoints-1);
+				in[n++]=(b*65535+(gridpoints-1)/2)/(gridpoints-1);
+			}
+		}
+	}
+	source->Transform(in,out,nodes);
+
+	lut=(float *)malloc(sizeof(float)*nodes*4);
+	for(int i=0;i<nodes;++i)
+	{
+		for(int c=0;c<4;++c)
+			lut[i*4+c]=c<outchannels ? out[i*outchannels+c] : 0.0;
+	}
+	free(in);
+	free(out);
+}
+
+
+CMSLUTTransform::~CMSLUTTransform()
+{
+	if(lut)
+		free(lut);
+}
+
+
+// Finds the tetrahedron within the grid cell containing an RGB value,
+// returning the offsets of its four nodes and their weights.
+
+static inline void LUT_Tetrahedron(const unsigned short *rgb,int gridpoints,float scale,int *node,float *w)
+{
+	int stride[3]={gridpoints*gridpoints*4,gridpoints*4,4};
+	int base=0;
+	float f[3];
+	for(int i=0;i<3;++i)
+	{
+		float p=rgb[i]*scale;
+		int ip=int(p);
+		if(ip>gridpoints-2)
+			ip=gridpoints-2;
+		f[i]=p-ip;
+		base+=ip*stride[i];
+	}
+
+	// Order the axes by decreasing fraction - the tetrahedron's path from the
+	// cell's origin to its far corner steps along them in that order.
+	int a=0,b=1,c=2,t;
+	if(f[a]<f[b]) { t=a; a=b; b=t; }
+	if(f[b]<f[c]) { t=b; b=c; c=t; }
+	if(f[a]<f[b]) { t=a; a=b; b=t; }
+
+	node[0]=base;
+	node[1]=node[0]+stride[a];
+	node[2]=node[1]+stride[b];
+	node[3]=node[2]+stride[c];
+	w[0]=1.0-f[a];
+	w[1]=f[a]-f[b];
+	w[2]=f[b]-f[c];
+	w[3]=f[c];
+}
+
+
+static void LUT_Transform_Scalar(const float *lut,int gridpoints,int outchannels,
+	const unsigned short *src,unsigned short *dst,int pixels)
+{
+	float scale=gridpoints-1; scale/=65535.0;
+	for(int x=0;x<pixels;++x)
+	{
+		// Runs of identical pixels are common, so reuse the previous result.
+		if(x && src[0]==src[-3] && src[1]==src[-2] && src[2]==src[-1])
+		{
+			for(int c=0;c<outchannels;++c)
+				dst[c]=dst[c-outchannels];
+		}
+		else
+		{
+			int node[4];
+			float w[4];
+			LUT_Tetrahedron(src,gridpoints,scale,node,w);
+			for(int c=0;c<outchannels;++c)
+			{
+				float v=lut[node[0]+c]*w[0]+lut[node[1]+c]*w[1]+lut[node[2]+c]*w[2]+lut[node[3]+c]*w[3]+0.5;
+				if(v<0.0) v=0.0;
+				if(v>65535.0) v=65535.0;
+				dst[c]=(unsigned short)v;
+			}
+		}
+		src+=3;
+		dst+=outchannels;
+	}
+}
+
+
+#ifdef HAVE_X86_SIMD
+
+// Each grid node holds four floats, so all output channels of a pixel
+// are interpolated together in a single vector.
+
+__attribute__((target("sse4.1")))
+static void LUT_Transform_SSE41(const float *lut,int gridpoints,int outchannels,
+	const unsigned short *src,unsigned short *dst,int pixels)
+{
+	float scale=gridpoints-1; scale/=65535.0;
+	for(int x=0;x<pixels;++x)
+	{
+		if(x && src[0]==src[-3] && src[1]==src[-2] && src[2]==src[-1])
+		{
+			for(int c=0;c<outchannels;++c)
+				dst[c]=dst[c-outchannels];
+		}
+		else
+		{
+			int node[4];
+			float w[4];
+			LUT_Tetrahedron(src,gridpoints,scale,node,w);
+			__m128 v=_mm_mul_ps(_mm_loadu_ps(lut+node[0]),_mm_set1_ps(w[0]));
+			v=_mm_add_ps(v,_mm_mul_ps(_mm_loadu_ps(lut+node[1]),_mm_set1_ps(w[1])));
+			v=_mm_add_ps(v,_mm_mul_ps(_mm_loadu_ps(lut+node[2]),_mm_set1_ps(w[2])));
+			v=_mm_add_ps(v,_mm_mul_ps(_mm_loadu_ps(lut+node[3]),_mm_set1_ps(w[3])));
+			__m128i i=_mm_cvtps_epi32(v);
+			i=_mm_packus_epi32(i,i);
+			if(outchannels==4)
+				_mm_storel_epi64((__m128i *)dst,i);
+			else
+			{
+				unsigned short tmp[8];
+				_mm_storeu_si128((__m128i *)tmp,i);
+				for(int c=0;c<outchannels;++c)
+					dst[c]=tmp[c];
+			}
+		}
+		src+=3;
+		dst+=outchannels;
+	}
+}
+
+#endif
+
+
+void CMSLUTTransform::Transform(unsigned short *src,unsigned short *dst,int pixels)
+{
+#ifdef HAVE_X86_SIMD
+	if(GetCPUFeatures()&CPUFEATURE_SSE41)
+	{
+		LUT_Transform_SSE41(lut,gridpoints,outchannels,src,dst,pixels);
+		return;
+	}
+#endif
+	LUT_Transform_Scalar(lut,gridpoints,outchannels,src,dst,pixels);
+}
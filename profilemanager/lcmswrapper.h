@@ -90,6 +90,7 @@ class CMSTransform
 	virtual void Transform(unsigned short *src,unsigned short *dst,int pixels);
 	enum IS_TYPE GetInputColourSpace();
 	enum IS_TYPE GetOutputColourSpace();
+	bool SaveDeviceLink(const char *filename);
 	protected:
 	virtual void MakeTransform(CMSProfile *in,CMSProfile *out,LCMSWrapper_Intent intent);
 	enum IS_TYPE inputtype;
@@ -106,6 +107,27 @@ class CMSProofingTransform : public CMSTransform
 };
 
 
+// A transform which samples another transform over a regular grid of RGB
+// input values, then converts pixels by tetrahedral interpolation within
+// that grid.  This is considerably quicker than LittleCMS for large images
+// at the cost of a little accuracy.  Only RGB input is supported, and the
+// source transform isn't needed once the LUT has been built.
+
+#define CMSLUT_GRIDPOINTS 33
+
+class CMSLUTTransform : public CMSTransform
+{
+	public:
+	CMSLUTTransform(CMSTransform *source,int gridpoints=CMSLUT_GRIDPOINTS);
+	virtual ~CMSLUTTransform();
+	virtual void Transform(unsigned short *src,unsigned short *dst,int pixels);
+	protected:
+	int gridpoints;
+	int outchannels;
+	float *lut;	// Four floats per grid node, with blue varying fastest.
+};
+
+
 class CMSWhitePoint
 {
 	public:
@@ -7,9 +7,22 @@
 #endif
 
 #include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <utime.h>
+#include <sstream>
+#include <vector>
+#include <algorithm>
 
 #include "../support/debug.h"
 
+#include "../support/pathsupport.h"
+#include "../support/util.h"
+#include "../support/dirtreewalker.h"
+
 #include "profilemanager.h"
 #include "searchpathdbhandler.h"
 
@@ -42,6 +55,7 @@ ConfigTemplate ProfileManager::Template[]=
 	ConfigTemplate("MonitorProfileActive",int(1)),
 	ConfigTemplate("RenderingIntent",int(LCMSWRAPPER_INTENT_PERCEPTUAL)),
 	ConfigTemplate("ProofMode",int(CM_PROOFMODE_NONE)),
+	ConfigTemplate("PrecomputeTransforms",int(0)),
 #ifdef WIN32
 	ConfigTemplate("ProfilePath","c:\\winnt\\system32\\spool\\drivers\\color\\;c:\\windows\\system32\\spool\\drivers\\color"),
 #else
@@ -100,7 +114,7 @@ CMSProfile *ProfileManager::GetProfile(const char *name)
 		}
 		else if(strcmp(name,BUILTINSRGB_ESCAPESTRING)==0)
 		{
-			result=new CMSProfile();
+			result=profiles.GetBuiltInProfile();
 		}
 		else
 		{
@@ -109,7 +123,7 @@ CMSProfile *ProfileManager::GetProfile(const char *name)
 			{
 				try
 				{
-					result=new CMSProfile(fn);
+					result=profiles.GetProfile(fn);
 				}
 				catch(const char *err)
 				{
@@ -231,66 +245,405 @@ CMTransformFactory *ProfileManager::GetTransformFactory()
 
 
 
-// CMTransformFactory
+// CMSProfileCache
+
+CMSProfileCache::CMSProfileCache() : PTMutex()
+{
+}
+
+
+CMSProfileCache::~CMSProfileCache()
+{
+	Flush();
+}
+
+
+void CMSProfileCache::Flush()
+{
+	ObtainMutex();
+	for(std::unordered_map<std::string,CMSProfileCacheEntry>::iterator it=entries.begin();it!=entries.end();++it)
+		delete it->second.profile;
+	entries.clear();
+	ReleaseMutex();
+}
+
 
-// CMTransformFactoryNode
+// Returns a copy of the cached profile if it's still current, otherwise NULL.
 
-CMTransformFactoryNode::CMTransformFactoryNode(CMTransformFactory *header,CMSTransform *transform,MD5Digest &d1,MD5Digest &d2,LCMSWrapper_Intent intent,bool proof)
-	: header(header), prev(NULL), next(NULL), transform(transform), digest1(d1), digest2(d2), intent(intent), proof(proof)
+CMSProfile *CMSProfileCache::Copy(const std::string &key,time_t mtime,off_t size)
 {
-	prev=header->first;
-	if((prev=header->first))
+	CMSProfile *result=NULL;
+	ObtainMutex();
+	try
 	{
-		while(prev->next)
-			prev=prev->next;
-		prev->next=this;
+		std::unordered_map<std::string,CMSProfileCacheEntry>::iterator it=entries.find(key);
+		if(it!=entries.end() && it->second.mtime==mtime && it->second.size==size)
+			result=new CMSProfile(*it->second.profile);
 	}
-	else
-		header->first=this;
+	catch(const char *err)
+	{
+		ReleaseMutex();
+		throw;
+	}
+	ReleaseMutex();
+	return(result);
+}
+
+
+// Takes ownership of a newly opened profile, replacing any stale entry,
+// and returns a copy of it.
+
+CMSProfile *CMSProfileCache::Store(const std::string &key,time_t mtime,off_t size,CMSProfile *profile)
+{
+	CMSProfile *result=NULL;
+	ObtainMutex();
+	CMSProfileCacheEntry &e=entries[key];
+	if(e.profile)
+		delete e.profile;
+	e.profile=profile;
+	e.mtime=mtime;
+	e.size=size;
+	try
+	{
+		result=new CMSProfile(*profile);
+	}
+	catch(const char *err)
+	{
+		ReleaseMutex();
+		throw;
+	}
+	ReleaseMutex();
+	return(result);
 }
 
 
-CMTransformFactoryNode::~CMTransformFactoryNode()
+CMSProfile *CMSProfileCache::GetProfile(const char *filename)
 {
-	if(next)
-		next->prev=prev;
-	if(prev)
-		prev->next=next;
-	else
-		header->first=next;
+	struct stat st;
+	if(stat(filename,&st)!=0)
+		throw "Can't open profile";
+
+	CMSProfile *result=Copy(filename,st.st_mtime,st.st_size);
+	if(!result)
+	{
+		Debug[TRACE] << "Reading profile " << filename << endl;
+		result=Store(filename,st.st_mtime,st.st_size,new CMSProfile(filename));
+	}
+	return(result);
+}
 
-	if(transform)
+
+CMSProfile *CMSProfileCache::GetBuiltInProfile()
+{
+	CMSProfile *result=Copy(BUILTINSRGB_ESCAPESTRING,0,0);
+	if(!result)
+		result=Store(BUILTINSRGB_ESCAPESTRING,0,0,new CMSProfile());
+	return(result);
+}
+
+
+// CMTransformRegistry
+
+CMTransformRegistry::CMTransformRegistry() : PTMutex()
+{
+}
+
+
+CMTransformRegistry::~CMTransformRegistry()
+{
+	for(std::unordered_map<std::string,CMTransformRegistryEntry>::iterator it=entries.begin();it!=entries.end();++it)
+		delete it->second.transform;
+}
+
+
+// Returns the transform registered under key with a reference added, or NULL.
+
+CMSTransform *CMTransformRegistry::Obtain(const std::string &key)
+{
+	CMSTransform *result=NULL;
+	ObtainMutex();
+	std::unordered_map<std::string,CMTransformRegistryEntry>::iterator it=entries.find(key);
+	if(it!=entries.end())
+	{
+		++it->second.refcount;
+		result=it->second.transform;
+	}
+	ReleaseMutex();
+	return(result);
+}
+
+
+// Registers a newly built transform, and returns it with a reference added.
+// Another thread may have registered the same transform while this one was
+// being built, in which case the new one is discarded in favour of it.
+
+CMSTransform *CMTransformRegistry::Add(const std::string &key,CMSTransform *transform)
+{
+	ObtainMutex();
+	CMTransformRegistryEntry &e=entries[key];
+	if(e.transform)
 		delete transform;
+	else
+		e.transform=transform;
+	++e.refcount;
+	transform=e.transform;
+	ReleaseMutex();
+	return(transform);
 }
 
 
-// CMTransformFactory proper
+void CMTransformRegistry::Release(const std::string &key)
+{
+	ObtainMutex();
+	std::unordered_map<std::string,CMTransformRegistryEntry>::iterator it=entries.find(key);
+	if(it!=entries.end() && --it->second.refcount==0)
+	{
+		delete it->second.transform;
+		entries.erase(it);
+	}
+	ReleaseMutex();
+}
+
 
+// CMTransformFactory
 
 CMTransformFactory::CMTransformFactory(ProfileManager &pm)
-	: manager(pm), first(NULL)
+	: manager(pm)
 {
 }
 
 
 CMTransformFactory::~CMTransformFactory()
 {
-	while(first)
-		delete first;
+	Flush();
+}
+
+
+// Transforms are identified by the digests of the profiles and the intents
+// used to build them - d3 identifies the proofing profile, or the default
+// profile used to feed a device link.
+
+std::string CMTransformFactory::GetKey(MD5Digest *d1,MD5Digest *d2,LCMSWrapper_Intent intent,MD5Digest *d3,int displayintent)
+{
+	std::ostringstream key;
+	key << d1->GetPrintableDigest() << "_" << d2->GetPrintableDigest() << "_" << intent;
+	if(d3)
+		key << "_" << d3->GetPrintableDigest() << "_" << displayintent;
+	return(key.str());
+}
+
+
+// Registered transforms may have been replaced by a lookup table, so the
+// PrecomputeTransforms option forms part of their keys - otherwise toggling it
+// would keep handing out transforms of the old kind.  The cached device links
+// are the same either way, so their filenames use the plain key.
+
+std::string CMTransformFactory::GetRegistryKey(const std::string &key)
+{
+	if(manager.FindInt("PrecomputeTransforms"))
+		return(key+"_lut");
+	return(key);
+}
+
+
+// Transforms this factory has already handed out are found without touching
+// the shared registry.
+
+CMSTransform *CMTransformFactory::Search(const std::string &key)
+{
+	std::string regkey=GetRegistryKey(key);
+	std::unordered_map<std::string,CMSTransform *>::iterator it=transforms.find(regkey);
+	if(it!=transforms.end())
+		return(it->second);
+
+	CMSTransform *result=manager.transforms.Obtain(regkey);
+	if(result)
+		transforms[regkey]=result;
+	return(result);
+}
+
+
+CMSTransform *CMTransformFactory::Register(const std::string &key,CMSTransform *transform)
+{
+	std::string regkey=GetRegistryKey(key);
+	transform=manager.transforms.Add(regkey,transform);
+	transforms[regkey]=transform;
+	return(transform);
 }
 
 
-CMSTransform *CMTransformFactory::Search(MD5Digest *srcdigest,MD5Digest *dstdigest,LCMSWrapper_Intent intent,bool proof)
+// Transforms are saved in a cache directory as device link profiles, named
+// after their keys.  A device link can be turned back into a transform far
+// more quickly than the original profiles, so later sessions and refreshed
+// factories skip most of LittleCMS' work.  A link's modification time is
+// updated whenever it's used, so the cache can be pruned in LRU order.
+
+char *CMTransformFactory::GetCacheFilename(const std::string &key)
 {
-	CMTransformFactoryNode *tfn=first;
-	while(tfn)
+	char *dir=substitute_homedir(TRANSFORMCACHE_PATH);
+	if(!CreateDirIfNeeded(dir))
 	{
-		Debug[TRACE] << "Evaluating transform from " << tfn->digest1.GetPrintableDigest() << " to " << tfn->digest2.GetPrintableDigest() << " and intent " << tfn->intent << endl;
-		if((*srcdigest==tfn->digest1)&&(*dstdigest==tfn->digest2)&&(intent==tfn->intent)&&(proof==tfn->proof))
-			return(tfn->transform);
-		tfn=tfn->next;
+		Debug[WARN] << "Can't create transform cache directory " << dir << endl;
+		free(dir);
+		return(NULL);
 	}
-	return(NULL);
+
+	std::ostringstream fn;
+	fn << dir << SEARCHPATH_SEPARATOR_S << key << ".icc";
+	free(dir);
+	return(strdup(fn.str().c_str()));
+}
+
+
+CMSTransform *CMTransformFactory::LoadCachedTransform(const char *cachefn)
+{
+	if(!cachefn || !CheckFileExists(cachefn))
+		return(NULL);
+
+	CMSTransform *result=NULL;
+	try
+	{
+		// The intent is baked into the device link, so the default will do.
+		CMSProfile link(cachefn);
+		result=new CMSTransform(&link,LCMSWRAPPER_INTENT_PERCEPTUAL);
+		utime(cachefn,NULL);
+		Debug[TRACE] << "Using cached transform " << cachefn << endl;
+	}
+	catch(const char *err)
+	{
+		Debug[WARN] << "Can't use cached transform " << cachefn << ": " << err << endl;
+		unlink(cachefn);
+	}
+	return(result);
+}
+
+
+// Returns the transform, so it can wrap the constructor call.  Once saved, the
+// transform is replaced with one built from the device link, which is sampled and
+// so not quite identical - this way the results don't depend on whether or not
+// the transform happened to be in the cache already.
+
+CMSTransform *CMTransformFactory::SaveCachedTransform(const char *cachefn,CMSTransform *transform)
+{
+	if(!cachefn)
+		return(transform);
+
+	// Save under a temporary name unique to this call, then rename it into place.
+	// Factories build transforms concurrently, and may well race each other to
+	// build the same one, so neither other threads nor other processes may ever
+	// see a partially written profile.
+	std::string tmpfn=std::string(cachefn)+".XXXXXX";
+	int fd=mkstemp(&tmpfn[0]);
+	if(fd<0)
+	{
+		Debug[WARN] << "Can't create temporary file for transform cache " << cachefn << endl;
+		return(transform);
+	}
+	close(fd);
+
+	if(!transform->SaveDeviceLink(tmpfn.c_str()))
+	{
+		Debug[WARN] << "Can't save transform to cache " << cachefn << endl;
+		unlink(tmpfn.c_str());
+		return(transform);
+	}
+
+	CMSTransform *result=NULL;
+	try
+	{
+		CMSProfile link(tmpfn.c_str());
+		result=new CMSTransform(&link,LCMSWRAPPER_INTENT_PERCEPTUAL);
+	}
+	catch(const char *err)
+	{
+		Debug[WARN] << "Can't use saved transform " << cachefn << ": " << err << endl;
+		unlink(tmpfn.c_str());
+		return(transform);
+	}
+
+	if(rename(tmpfn.c_str(),cachefn)==0)
+		PruneCache(cachefn);
+	else
+		unlink(tmpfn.c_str());
+	delete transform;
+	return(result);
+}
+
+
+// Matches the names SaveCachedTransform() gives its temporary files -
+// <key>.icc.XXXXXX, as completed by mkstemp().
+
+static bool IsCacheTempFile(const char *fn)
+{
+	size_t len=strlen(fn);
+	if(len<11 || strncmp(fn+len-11,".icc.",5)!=0)
+		return(false);
+	for(size_t i=len-6;i<len;++i)
+	{
+		if(!isalnum((unsigned char)fn[i]))
+			return(false);
+	}
+	return(true);
+}
+
+
+// Removes the least recently used device links once there are more than
+// TRANSFORMCACHE_MAXFILES of them.  Leftover temporary files are fair game too,
+// but only once they're old enough that nobody can still be writing them.
+
+void CMTransformFactory::PruneCache(const char *cachefn)
+{
+	char *dir=substitute_homedir(TRANSFORMCACHE_PATH);
+	std::vector<std::pair<time_t,std::string> > files;
+	time_t now=time(NULL);
+
+	DirTreeWalker walker(dir);
+	free(dir);
+	const char *fn;
+	while((fn=walker.NextFile()))
+	{
+		struct stat statbuf;
+		if(stat(fn,&statbuf)!=0 || strcmp(fn,cachefn)==0)
+			continue;
+		size_t len=strlen(fn);
+		if(len>4 && strcmp(fn+len-4,".icc")==0)
+			files.push_back(std::pair<time_t,std::string>(statbuf.st_mtime,fn));
+		else if(IsCacheTempFile(fn) && statbuf.st_mtime<now-3600)
+			unlink(fn);
+	}
+
+	if(files.size()<TRANSFORMCACHE_MAXFILES)
+		return;
+
+	std::sort(files.begin(),files.end());
+	for(size_t i=0;i<=files.size()-TRANSFORMCACHE_MAXFILES;++i)
+	{
+		Debug[TRACE] << "Removing cached transform " << files[i].second << endl;
+		unlink(files[i].second.c_str());
+	}
+}
+
+
+// If the PrecomputeTransforms option is set, replaces a newly created transform
+// from RGB with a 3D lookup table sampled from it, which is much quicker to apply.
+
+CMSTransform *CMTransformFactory::PrecomputeTransform(CMSTransform *transform)
+{
+	if(!manager.FindInt("PrecomputeTransforms") || transform->GetInputColourSpace()!=IS_TYPE_RGB)
+		return(transform);
+
+	Debug[TRACE] << "Precomputing lookup table for transform" << endl;
+	CMSTransform *result=transform;
+	try
+	{
+		result=new CMSLUTTransform(transform);
+		delete transform;
+	}
+	catch(const char *err)
+	{
+		Debug[WARN] << "Can't precompute transform: " << err << endl;
+	}
+	return(result);
 }
 
 
@@ -434,12 +787,16 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 			Debug[TRACE] << "Source profile (" << (fn ? fn : "") << ")" << "has hash: " << d1->GetPrintableDigest() << endl;
 			
 			// Search for an existing transform by source / devicelink MD5s...
-			transform=Search(d1,d2,intent);
+			std::string key=GetKey(d1,d2,intent,defprofile->GetMD5());
+			transform=Search(key);
 			if(!transform)
 			{
 				Debug[TRACE] << "No suitable cached transform found - creating a new one..." << endl;
-				transform=new CMSTransform(profiles,3,intent);
-				new CMTransformFactoryNode(this,transform,*d1,*d2,intent);
+				char *cachefn=GetCacheFilename(key);
+				if(!(transform=LoadCachedTransform(cachefn)))
+					transform=SaveCachedTransform(cachefn,new CMSTransform(profiles,3,intent));
+				free(cachefn);
+				transform=Register(key,PrecomputeTransform(transform));
 			}
 		}
 		else
@@ -448,12 +805,16 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 			// If there's no default profile, or the source and default profiles match
 			// then we can just use the devicelink profile in isolation.
 			d1=d2;
-			transform=Search(d1,d2,intent);
+			std::string key=GetKey(d1,d2,intent);
+			transform=Search(key);
 			if(!transform)
 			{
 				Debug[TRACE] << "No suitable cached transform found - creating a new one..." << endl;
-				transform=new CMSTransform(destprofile,intent);
-				new CMTransformFactoryNode(this,transform,*d1,*d2,intent);
+				char *cachefn=GetCacheFilename(key);
+				if(!(transform=LoadCachedTransform(cachefn)))
+					transform=SaveCachedTransform(cachefn,new CMSTransform(destprofile,intent));
+				free(cachefn);
+				transform=Register(key,PrecomputeTransform(transform));
 			}
 		}
 		if(defprofile)
@@ -474,12 +835,16 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 			return(NULL);
 		}
 
-		transform=Search(d1,d2,intent);
+		std::string key=GetKey(d1,d2,intent);
+		transform=Search(key);
 		if(!transform)
 		{
 			Debug[TRACE] << "No suitable cached transform found - creating a new one..." << endl;
-			transform=new CMSTransform(srcprofile,destprofile,intent);
-			new CMTransformFactoryNode(this,transform,*d1,*d2,intent);
+			char *cachefn=GetCacheFilename(key);
+			if(!(transform=LoadCachedTransform(cachefn)))
+				transform=SaveCachedTransform(cachefn,new CMSTransform(srcprofile,destprofile,intent));
+			free(cachefn);
+			transform=Register(key,PrecomputeTransform(transform));
 		}
 	}
 
@@ -537,15 +902,19 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 			d1=srcprofile->GetMD5();
 			
 			// Search for an existing transform by source / devicelink MD5s...
-			transform=Search(d1,d2,intent,true);
+			std::string key=GetKey(d1,d2,intent,defprofile->GetMD5());
+			transform=Search(key);
 			if(!transform)
 			{
 //				Debug[TRACE] << "No suitable cached transform found - creating a new one..." << endl;
 //				Debug[TRACE] << "But can't (yet?) create embedded->default->devicelink->proof transform!" << endl;
 				// FIXME - need a version of CMSProofingTransform that can cope with
 				// multiple profiles!
-				transform=new CMSTransform(profiles,3,intent);
-				new CMTransformFactoryNode(this,transform,*d1,*d2,intent);
+				char *cachefn=GetCacheFilename(key);
+				if(!(transform=LoadCachedTransform(cachefn)))
+					transform=SaveCachedTransform(cachefn,new CMSTransform(profiles,3,intent));
+				free(cachefn);
+				transform=Register(key,PrecomputeTransform(transform));
 			}
 		}
 		else
@@ -554,14 +923,18 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 			// If there's no default profile, or the source and default profiles match
 			// then we can just use the devicelink profile in isolation.
 			d1=d2;
-			transform=Search(d1,d2,intent,true);
+			std::string key=GetKey(d1,d2,intent,proofprofile->GetMD5(),displayintent);
+			transform=Search(key);
 			if(!transform)
 			{
 //				Debug[TRACE] << "No suitable cached transform found - creating a new one..." << endl;
 				// FIXME - need a version of CMSProofingTransform that can cope with
 				// devicelink profiles
-				transform=new CMSProofingTransform(destprofile,proofprofile,intent,displayintent);
-				new CMTransformFactoryNode(this,transform,*d1,*d2,intent,true);
+				char *cachefn=GetCacheFilename(key);
+				if(!(transform=LoadCachedTransform(cachefn)))
+					transform=SaveCachedTransform(cachefn,new CMSProofingTransform(destprofile,proofprofile,intent,displayintent));
+				free(cachefn);
+				transform=Register(key,PrecomputeTransform(transform));
 			}
 		}
 		if(defprofile)
@@ -577,12 +950,16 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 //		if(*d1==*d2)
 //			return(NULL);
 
-		transform=Search(d1,d2,intent,true);
+		std::string key=GetKey(d1,d2,intent,proofprofile->GetMD5(),displayintent);
+		transform=Search(key);
 		if(!transform)
 		{
 //			Debug[TRACE] << "No suitable cached transform found - creating a new proofing transform..." << endl;
-			transform=new CMSProofingTransform(srcprofile,destprofile,proofprofile,intent,displayintent);
-			new CMTransformFactoryNode(this,transform,*d1,*d2,intent,true);
+			char *cachefn=GetCacheFilename(key);
+			if(!(transform=LoadCachedTransform(cachefn)))
+				transform=SaveCachedTransform(cachefn,new CMSProofingTransform(srcprofile,destprofile,proofprofile,intent,displayintent));
+			free(cachefn);
+			transform=Register(key,PrecomputeTransform(transform));
 		}
 	}
 
@@ -590,10 +967,14 @@ CMSTransform *CMTransformFactory::GetTransform(CMSProfile *destprofile,CMSProfil
 }
 
 
+// Releases this factory's references to its transforms - they're only
+// deleted once no other factory is using them.
+
 void CMTransformFactory::Flush()
 {
-	while(first)
-		delete first;
+	for(std::unordered_map<std::string,CMSTransform *>::iterator it=transforms.begin();it!=transforms.end();++it)
+		manager.transforms.Release(it->first);
+	transforms.clear();
 }
 
 
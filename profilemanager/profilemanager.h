@@ -1,10 +1,16 @@
 #ifndef COLOURMANAGEMENT_H
 #define COLOURMANAGEMENT_H
 
+#include <string>
+#include <unordered_map>
+#include <sys/types.h>
+#include <time.h>
+
 #include "imagesource.h"
 #include "lcmswrapper.h"
 #include "configdb.h"
 #include "searchpath.h"
+#include "ptmutex.h"
 
 #ifndef WIN32
 #include <X11/Xlib.h>
@@ -14,6 +20,11 @@
 #define BUILTINSRGB_ESCAPESTRING "<Built-in sRGB profile>"
 #define NOPROFILE_ESCAPESTRING "<None>"
 
+#define TRANSFORMCACHE_PATH "$HOME" SEARCHPATH_SEPARATOR_S ".photoprint" SEARCHPATH_SEPARATOR_S "transforms"
+// Once the transform cache holds more than this many device links, the least
+// recently used are removed.
+#define TRANSFORMCACHE_MAXFILES 256
+
 enum CMColourDevice
 {
 	CM_COLOURDEVICE_NONE=0,
@@ -37,6 +48,71 @@ enum CMProofMode
 class CMTransformFactory;
 class ProfileInfo;
 
+
+// Transforms are immutable once built, and LittleCMS keeps the state of a
+// transformation on the stack, so a single copy of each transform can be
+// shared by every factory (and thus every thread).  Transforms are
+// reference counted by the factories which have handed them out, and
+// deleted when the last one is flushed.
+
+class CMTransformRegistryEntry
+{
+	public:
+	CMTransformRegistryEntry() : transform(NULL), refcount(0)
+	{
+	}
+	CMSTransform *transform;
+	int refcount;
+};
+
+
+class CMTransformRegistry : public PTMutex
+{
+	public:
+	CMTransformRegistry();
+	~CMTransformRegistry();
+	CMSTransform *Obtain(const std::string &key);
+	CMSTransform *Add(const std::string &key,CMSTransform *transform);
+	void Release(const std::string &key);
+	protected:
+	std::unordered_map<std::string,CMTransformRegistryEntry> entries;
+};
+
+
+// Opening a profile and calculating its digest involves reading the whole
+// file, so each profile is read only once, and callers are handed copies
+// which share its digest.  Entries are checked against the file's
+// modification time and size on each use, so a profile which changes on
+// disk is picked up.
+
+class CMSProfileCacheEntry
+{
+	public:
+	CMSProfileCacheEntry() : profile(NULL), mtime(0), size(0)
+	{
+	}
+	CMSProfile *profile;
+	time_t mtime;
+	off_t size;
+};
+
+
+class CMSProfileCache : public PTMutex
+{
+	public:
+	CMSProfileCache();
+	~CMSProfileCache();
+	// Both return a new copy of the profile, owned by the caller.
+	CMSProfile *GetProfile(const char *filename);
+	CMSProfile *GetBuiltInProfile();
+	void Flush();
+	protected:
+	CMSProfile *Copy(const std::string &key,time_t mtime,off_t size);
+	CMSProfile *Store(const std::string &key,time_t mtime,off_t size,CMSProfile *profile);
+	std::unordered_map<std::string,CMSProfileCacheEntry> entries;
+};
+
+
 class ProfileManager : public ConfigDB, public SearchPathHandler
 {
 	public:
@@ -80,23 +156,9 @@ class ProfileManager : public ConfigDB, public SearchPathHandler
 	#endif
 	long proffromdisplay_size;
 	SearchPathIterator spiter;
+	CMTransformRegistry transforms;
+	CMSProfileCache profiles;
 	friend class ProfileInfo;
-};
-
-
-class CMTransformFactoryNode
-{
-	public:
-	CMTransformFactoryNode(CMTransformFactory *header,CMSTransform *transform,MD5Digest &d1,MD5Digest &d2,LCMSWrapper_Intent intent,bool proof=false);
-	~CMTransformFactoryNode();
-	protected:
-	CMTransformFactory *header;
-	CMTransformFactoryNode *prev,*next;
-	CMSTransform *transform;
-	MD5Digest digest1;
-	MD5Digest digest2;
-	LCMSWrapper_Intent intent;
-	bool proof;
 	friend class CMTransformFactory;
 };
 
@@ -111,12 +173,19 @@ class CMTransformFactory
 	CMSTransform *GetTransform(enum CMColourDevice target,ImageSource *src,LCMSWrapper_Intent intent=LCMSWRAPPER_INTENT_DEFAULT);
 	CMSTransform *GetTransform(enum CMColourDevice target,IS_TYPE type,LCMSWrapper_Intent intent=LCMSWRAPPER_INTENT_DEFAULT);
 	CMSTransform *GetTransform(CMSProfile *destprofile,CMSProfile *srcprofile,CMSProfile *proofprofile,LCMSWrapper_Intent intent=LCMSWRAPPER_INTENT_DEFAULT,int displayintent=LCMSWRAPPER_INTENT_DEFAULT);
-	CMSTransform *Search(MD5Digest *srcdigest,MD5Digest *dstdigest,LCMSWrapper_Intent intent,bool proof=0);
+	CMSTransform *Search(const std::string &key);
 	void Flush();
 	protected:
+	std::string GetKey(MD5Digest *d1,MD5Digest *d2,LCMSWrapper_Intent intent,MD5Digest *d3=NULL,int displayintent=0);
+	std::string GetRegistryKey(const std::string &key);
+	CMSTransform *Register(const std::string &key,CMSTransform *transform);
+	char *GetCacheFilename(const std::string &key);
+	CMSTransform *LoadCachedTransform(const char *cachefn);
+	CMSTransform *SaveCachedTransform(const char *cachefn,CMSTransform *transform);
+	void PruneCache(const char *cachefn);
+	CMSTransform *PrecomputeTransform(CMSTransform *transform);
 	ProfileManager &manager;
-	CMTransformFactoryNode *first;
-	friend class CMTransformFactoryNode;
+	std::unordered_map<std::string,CMSTransform *> transforms;	// The transforms this factory holds references to.
 };
 
 
@@ -1,3 +1,4 @@
+#include <errno.h>
 
 #include "consumer.h"
 #include "debug.h"
@@ -18,8 +19,8 @@ Consumer_File::~Consumer_File()
 
 bool Consumer_File::Write(const char *buffer,int length)
 {
-	int l=fwrite(buffer,length,1,file);
-	return(l==length);
+	size_t l=fwrite(buffer,1,length,file);
+	return(l==size_t(length));
 }
 
 void Consumer_File::Cancel()
@@ -72,7 +73,19 @@ bool Consumer_Pipe::Write(const char *buffer,int length)
 	fwrite(buffer,length,1,pfile);
 	return(true);
 #else
-	write(pipefd[1],buffer,length);
+	// Large writes to a pipe may be split, or interrupted by a signal.
+	while(length>0 && !aborted)
+	{
+		int l=write(pipefd[1],buffer,length);
+		if(l<0)
+		{
+			if(errno==EINTR)
+				continue;
+			return(false);
+		}
+		buffer+=l;
+		length-=l;
+	}
 	return(!aborted);
 #endif
 }
@@ -24,6 +24,12 @@ class Consumer
 	}
 	virtual bool Write(const char *buffer, int length)=0;
 	virtual void Cancel()=0;
+	// Waits until all data written so far has reached its destination, and
+	// returns false if any of it couldn't be written.
+	virtual bool Flush()
+	{
+		return(true);
+	}
 };
 
 
@@ -0,0 +1,198 @@
+/*
+ * consumer_async.cpp - a Consumer which gathers small writes into large
+ * buffers and passes them on to another Consumer from a thread of its own.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+
+#include "consumer_async.h"
+
+using namespace std;
+
+
+Consumer_Async::Consumer_Async(Consumer *target,int buffersize,int buffercount)
+	: Consumer(), ThreadFunction(), target(target), buffersize(buffersize), buffercount(buffercount),
+	buffers(NULL), lengths(NULL), head(0), queued(0), fill(0), filllength(0), writing(false),
+	failed(false), producerfailed(false), cancelled(false), finished(false), bytes(0), writes(0), iotime(0.0), stalltime(0.0),
+	thread(this)
+{
+	buffers=(char **)malloc(sizeof(char *)*buffercount);
+	lengths=(int *)malloc(sizeof(int)*buffercount);
+	for(int i=0;i<buffercount;++i)
+	{
+		buffers[i]=(char *)malloc(buffersize);
+		lengths[i]=0;
+	}
+	starttime=Now();
+	thread.Start();
+}
+
+
+Consumer_Async::~Consumer_Async()
+{
+	Flush();
+
+	cond.ObtainMutex();
+	finished=true;
+	cond.Broadcast();
+	cond.ReleaseMutex();
+
+	if(!thread.TestFinished())
+		thread.WaitFinished();
+
+	double elapsed=Now()-starttime;
+	Debug[COMMENT] << "Consumer_Async: wrote " << bytes << " bytes in " << writes << " writes, "
+		<< (elapsed>0.0 ? bytes/(elapsed*1048576.0) : 0.0) << " MB/s over " << elapsed << "s" << endl;
+	Debug[COMMENT] << "Consumer_Async: output busy for " << iotime << "s, producer stalled for " << stalltime << "s" << endl;
+
+	delete target;
+
+	for(int i=0;i<buffercount;++i)
+		free(buffers[i]);
+	free(buffers);
+	free(lengths);
+}
+
+
+double Consumer_Async::Now()
+{
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return(tv.tv_sec+tv.tv_usec/1000000.0);
+}
+
+
+// Queues the buffer being filled, then waits until there's a free one to
+// fill next.  Returns false if the target has failed, since the producer
+// mustn't touch the buffers again - Write() checks the flag for itself
+// rather than taking the lock on every call.
+
+bool Consumer_Async::Submit()
+{
+	cond.ObtainMutex();
+	lengths[fill]=filllength;
+	++queued;
+	cond.Broadcast();
+	if(queued==buffercount && !failed)
+	{
+		double t=Now();
+		while(queued==buffercount && !failed)
+			cond.WaitCondition();
+		stalltime+=Now()-t;
+	}
+	fill=(head+queued)%buffercount;
+	producerfailed=failed;
+	cond.ReleaseMutex();
+	filllength=0;
+	return(!producerfailed);
+}
+
+
+bool Consumer_Async::Write(const char *buffer,int length)
+{
+	if(producerfailed)
+		return(false);
+	if(cancelled)
+		return(true);
+
+	while(length>0)
+	{
+		int l=buffersize-filllength;
+		if(l>length)
+			l=length;
+		memcpy(buffers[fill]+filllength,buffer,l);
+		filllength+=l;
+		buffer+=l;
+		length-=l;
+		if(filllength==buffersize && !Submit())
+			return(false);
+	}
+	return(true);
+}
+
+
+// Writes out any partly-filled buffer and waits for the queue to drain.
+
+bool Consumer_Async::Flush()
+{
+	if(filllength>0 && !cancelled && !producerfailed)
+		Submit();
+
+	cond.ObtainMutex();
+	while(queued>0 && !failed && !cancelled)
+		cond.WaitCondition();
+	bool result=!failed;
+	cond.ReleaseMutex();
+	return(result);
+}
+
+
+// The target is only cancelled once the thread has finished any write it's
+// in the middle of, so it's never used from two threads at once.
+
+void Consumer_Async::Cancel()
+{
+	cond.ObtainMutex();
+	cancelled=true;
+	cond.Broadcast();
+	while(writing)
+		cond.WaitCondition();
+	cond.ReleaseMutex();
+
+	filllength=0;
+	target->Cancel();
+}
+
+
+int Consumer_Async::Entry(Thread &t)
+{
+	while(true)
+	{
+		cond.ObtainMutex();
+		while(queued==0 && !finished && !cancelled)
+			cond.WaitCondition();
+		if(cancelled || queued==0)
+		{
+			cond.ReleaseMutex();
+			return(0);
+		}
+		int idx=head;
+		bool skip=failed;
+		writing=true;
+		cond.ReleaseMutex();
+
+		// Once a write has failed the remaining data is discarded.
+		bool ok=true;
+		double t0=Now();
+		if(!skip)
+			ok=target->Write(buffers[idx],lengths[idx]);
+		double t1=Now();
+
+		cond.ObtainMutex();
+		writing=false;
+		if(!skip)
+		{
+			iotime+=t1-t0;
+			bytes+=lengths[idx];
+			++writes;
+		}
+		if(!ok)
+		{
+			Debug[WARN] << "Consumer_Async: write failed - discarding remaining data" << endl;
+			failed=true;
+		}
+		head=(head+1)%buffercount;
+		--queued;
+		cond.Broadcast();
+		cond.ReleaseMutex();
+	}
+}
@@ -0,0 +1,66 @@
+/*
+ * consumer_async.h - a Consumer which gathers small writes into large
+ * buffers and passes them on to another Consumer from a thread of its own.
+ *
+ * The producer (typically Gutenprint's output callback) only blocks when
+ * every buffer is waiting to be written, so a slow spooler holds up the
+ * print data generation only once it's a few megabytes behind.
+ * Statistics on throughput and on how long the producer was held up are
+ * logged when the Consumer is deleted.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#ifndef CONSUMER_ASYNC_H
+#define CONSUMER_ASYNC_H
+
+#include "consumer.h"
+#include "thread.h"
+
+#define CONSUMER_ASYNC_BUFFERSIZE (256*1024)
+#define CONSUMER_ASYNC_BUFFERS 8
+
+class Consumer_Async : public Consumer, public ThreadFunction
+{
+	public:
+	// Takes ownership of the target, which is deleted along with this object
+	// once any remaining data has been written.
+	Consumer_Async(Consumer *target,int buffersize=CONSUMER_ASYNC_BUFFERSIZE,int buffercount=CONSUMER_ASYNC_BUFFERS);
+	~Consumer_Async();
+	// Returns false once the target has failed a write.
+	bool Write(const char *buffer,int length);
+	// Discards any data not yet written, and cancels the target once it's
+	// no longer busy.
+	void Cancel();
+	bool Flush();
+	int Entry(Thread &t);
+	protected:
+	bool Submit();
+	static double Now();
+	Consumer *target;
+	int buffersize;
+	int buffercount;
+	char **buffers;
+	int *lengths;
+	int head;		// The next buffer to be written.
+	int queued;		// Buffers waiting to be written, including any being written.
+	int fill;		// The buffer being filled.
+	int filllength;
+	bool writing;
+	bool failed;
+	bool producerfailed;	// The producer's copy of failed, updated in Submit().
+	bool cancelled;
+	bool finished;
+	long long bytes;
+	int writes;
+	double starttime;
+	double iotime;		// Time spent in the target's Write().
+	double stalltime;	// Time the producer spent waiting for a free buffer.
+	ThreadCondition cond;
+	Thread thread;
+};
+
+#endif
@@ -0,0 +1,43 @@
+/*
+ * cpufeatures.cpp - runtime detection of SIMD instruction set extensions.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#include <iostream>
+#include <stdlib.h>
+
+#include "debug.h"
+
+#include "cpufeatures.h"
+
+using namespace std;
+
+static int DetectCPUFeatures()
+{
+	int result=0;
+	if(getenv("PHOTOPRINT_NOSIMD"))
+	{
+		Debug[COMMENT] << "SIMD code paths disabled by environment" << endl;
+		return(0);
+	}
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.1"))
+		result|=CPUFEATURE_SSE41;
+	if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		result|=CPUFEATURE_AVX2;
+#endif
+	Debug[COMMENT] << "CPU features: " << result << endl;
+	return(result);
+}
+
+
+int GetCPUFeatures()
+{
+	static int features=DetectCPUFeatures();
+	return(features);
+}
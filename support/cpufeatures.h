@@ -0,0 +1,27 @@
+/*
+ * cpufeatures.h - runtime detection of SIMD instruction set extensions,
+ * so that optimised code paths can be selected on CPUs which support them,
+ * while the same binary still runs on older machines.
+ *
+ * Copyright (c) 2008 by Alastair M. Robinson
+ * Distributed under the terms of the GNU General Public License -
+ * see the file named "COPYING" for more details.
+ *
+ */
+
+#ifndef CPUFEATURES_H
+#define CPUFEATURES_H
+
+// Defined if the compiler can build x86 SIMD code paths using per-function
+// target attributes, without the whole program being built for that target.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#endif
+
+enum CPUFeature {CPUFEATURE_SSE41=1,CPUFEATURE_AVX2=2};
+
+// Returns a bitmask of CPUFeature values.  Detection is done once, and the
+// result can be overridden by setting PHOTOPRINT_NOSIMD in the environment.
+int GetCPUFeatures();
+
+#endif
@@ -4,22 +4,31 @@
 #include <iostream>
 #include <queue>
 #include <list>
+#include <map>
+#include <functional>
+#include <atomic>
+#include <climits>
 
 #include "support/debug.h"
 #include "support/thread.h"
 #include "support/ptmutex.h"
 
 class Worker;
+class Job;
 
-enum JobStatus {JOBSTATUS_QUEUED,JOBSTATUS_RUNNING,JOBSTATUS_CANCELLED,JOBSTATUS_COMPLETED,JOBSTATUS_UNKNOWN};
+enum JobStatus {JOBSTATUS_QUEUED,JOBSTATUS_RUNNING,JOBSTATUS_CANCELLED,JOBSTATUS_COMPLETED,JOBSTATUS_PREEMPTED,JOBSTATUS_UNKNOWN};
+
+// Waiting jobs are kept sorted by priority, highest first.  Jobs of equal priority
+// are run in the order they were queued.
+typedef std::multimap<int,Job *,std::greater<int> > JobQueue_WaitingList;
 
 class Job
 {
 	public:
-	Job() : jobstatus(JOBSTATUS_UNKNOWN)
+	Job(int priority=0) : jobstatus(JOBSTATUS_UNKNOWN), priority(priority), queuestatus(JOBSTATUS_UNKNOWN)
 	{
 	}
-	Job(Job &other)
+	Job(Job &other) : jobstatus(JOBSTATUS_UNKNOWN), priority(other.GetPriority()), queuestatus(JOBSTATUS_UNKNOWN)
 	{
 	}
 	virtual ~Job()
@@ -41,15 +50,25 @@ class Job
 	{
 		jobstatus=JOBSTATUS_CANCELLED;
 	}
+	// Use JobQueue::SetJobPriority() to change the priority of a job once it's been queued.
+	int GetPriority()
+	{
+		return(priority);
+	}
 	protected:
 	JobStatus jobstatus;
+	std::atomic<int> priority;	// Read by ShouldYield() without the queue's mutex.
+	// Owned by the JobQueue, and protected by its mutex.
+	JobStatus queuestatus;					// Which of the queue's lists the job is on.
+	JobQueue_WaitingList::iterator queuepos;	// The job's position in the waiting list, while queued.
+	friend class JobQueue;
 };
 
 
 class JobQueue : public ThreadCondition
 {
 	public:
-	JobQueue() : ThreadCondition()
+	JobQueue() : ThreadCondition(), drainwaiters(0), topwaiting(INT_MIN)
 	{
 	}
 	~JobQueue()
@@ -69,8 +88,10 @@ class JobQueue : public ThreadCondition
 			ReleaseMutex();
 			return(NULL);
 		}
-		Job *result=waiting.front();
-		waiting.pop_front();
+		Job *result=waiting.begin()->second;
+		waiting.erase(waiting.begin());
+		UpdateTopWaiting();
+		result->queuestatus=JOBSTATUS_UNKNOWN;
 		ReleaseMutex();
 		return(result);
 	}
@@ -90,11 +111,13 @@ class JobQueue : public ThreadCondition
 
 //		Debug[TRACE] << "JobQueue::Dispatch() - Getting first job" << endl;
 
-		Job *j=waiting.front();
+		Job *j=waiting.begin()->second;
 
 		// Transfer the job to the "running" list
-		waiting.pop_front();
+		waiting.erase(waiting.begin());
+		UpdateTopWaiting();
 		j->SetJobStatus(JOBSTATUS_RUNNING);
+		j->queuestatus=JOBSTATUS_RUNNING;
 		running.push_back(j);
 
 		// Run the job - without mutex held...
@@ -106,12 +129,27 @@ class JobQueue : public ThreadCondition
 		ObtainMutex();
 		running.remove(j);
 
+		if(j->GetJobStatus()==JOBSTATUS_PREEMPTED)
+		{
+			// The job gave way to a higher priority one, so goes back on the queue.
+			Debug[TRACE] << "Requeueing preempted job" << std::endl;
+			Enqueue(j);
+			Wake();
+			ReleaseMutex();
+			return(true);
+		}
+
 		Debug[TRACE] << "Moving job to Completed queue" << std::endl;
 
 		completed.push_back(j);
+		j->queuestatus=JOBSTATUS_COMPLETED;
 		if(j->GetJobStatus()==JOBSTATUS_RUNNING)	// Don't set status to COMPLETED unless it's currently RUNNING.
 			j->SetJobStatus(JOBSTATUS_COMPLETED);	// - don't want to change CANCELLED to COMPLETED.
 
+		// Let anyone waiting for the queue to drain know it's done so.
+		if(drainwaiters && waiting.empty())
+			Broadcast();
+
 		ReleaseMutex();
 		return(true);
 	}
@@ -120,16 +158,44 @@ class JobQueue : public ThreadCondition
 	{
 		ObtainMutex();
 
-		// FIXME - need to add some kind of job serial number.
-		completed.remove(job);	// FIXME - is this legal if the job's not on the list?
+		switch(job->queuestatus)
+		{
+			case JOBSTATUS_QUEUED:
+			case JOBSTATUS_RUNNING:
+				Debug[WARN] << "JobQueue::AddJob() - job is already queued" << std::endl;
+				ReleaseMutex();
+				return;
+			case JOBSTATUS_COMPLETED:
+				completed.remove(job);
+				break;
+			default:
+				break;
+		}
 
-		job->SetJobStatus(JOBSTATUS_QUEUED);
-		waiting.push_back(job);
-		Broadcast();
+		Enqueue(job);
+		Wake();
 		ReleaseMutex();
 		DeleteCompleted();
 	}
 
+	// Changes a job's priority, moving it within the queue if it's waiting.
+	// Jobs already running will give way to a higher priority job at their next
+	// opportunity, if they check ShouldYield().
+	virtual void SetJobPriority(Job *job,int priority)
+	{
+		ObtainMutex();
+		if(job->queuestatus==JOBSTATUS_QUEUED)
+		{
+			waiting.erase(job->queuepos);
+			job->priority=priority;
+			job->queuepos=waiting.insert(std::pair<int,Job *>(priority,job));
+			UpdateTopWaiting();
+		}
+		else
+			job->priority=priority;
+		ReleaseMutex();
+	}
+
 	// Function to cancel a queued job - returns JOBSTATUS_RUNNING
 	// if the job is in progress, and JOBSTATUS_UNKNOWN if not.
 	virtual JobStatus CancelJob(Job *job)
@@ -138,7 +204,9 @@ class JobQueue : public ThreadCondition
 		JobStatus status=GetJobStatus(job);
 		if(status==JOBSTATUS_QUEUED)
 		{
-			waiting.remove(job);
+			waiting.erase(job->queuepos);
+			UpdateTopWaiting();
+			job->queuestatus=JOBSTATUS_UNKNOWN;
 			ReleaseMutex();
 			delete job;
 			return(JOBSTATUS_UNKNOWN);
@@ -155,35 +223,56 @@ class JobQueue : public ThreadCondition
 	// Proposed fix:  Disallow self-destruction - instead, transfer completed jobs to a new
 	// queue, and delete from there.  DONE
 
+	// The job's status is recorded in the job itself, so the job must not yet have
+	// been deleted - jobs are only deleted by CancelJob() and DeleteCompleted().
 	// Must hold the mutex while using this function - result is no longer valid once
 	// the mutex is released.
 	virtual JobStatus GetJobStatus(Job *job)
 	{
-		std::list<Job *>::iterator it=waiting.begin();
-		while(it!=waiting.end())
-		{
-			if(*it==job)
-				return(JOBSTATUS_QUEUED);
-			++it;
-		}
+		return(job->queuestatus);
+	}
 
-		it=running.begin();
-		while(it!=running.end())
-		{
-			if(*it==job)
-				return(JOBSTATUS_RUNNING);
-			++it;
-		}
+	// Called by a running job at convenient points to determine whether it should
+	// stop and give way to a higher priority job.  If this returns true the job
+	// is marked as preempted, and should return from Run() as soon as possible,
+	// whereupon it will be requeued.  Jobs may call this often, so unless a
+	// waiting job outranks this one the mutex isn't taken.
+	virtual bool ShouldYield(Job *job)
+	{
+		if(job->GetJobStatus()==JOBSTATUS_RUNNING && topwaiting<=job->priority)
+			return(false);
 
-		it=completed.begin();
-		while(it!=completed.end())
+		ObtainMutex();
+		bool result=false;
+		if(job->GetJobStatus()==JOBSTATUS_PREEMPTED)
+			result=true;
+		else if(job->GetJobStatus()==JOBSTATUS_RUNNING && int(running.size())>=GetWorkerCount())
 		{
-			if(*it==job)
-				return(JOBSTATUS_COMPLETED);
-			++it;
+			// Count the waiting jobs which outrank this one, less any already
+			// catered for by other jobs which are giving way.
+			int outranked=0;
+			JobQueue_WaitingList::iterator it=waiting.begin();
+			while(it!=waiting.end() && it->first>job->priority)
+			{
+				++outranked;
+				++it;
+			}
+			std::list<Job *>::iterator rit=running.begin();
+			while(rit!=running.end())
+			{
+				if((*rit)->GetJobStatus()==JOBSTATUS_PREEMPTED)
+					--outranked;
+				++rit;
+			}
+			if(outranked>0)
+			{
+				Debug[TRACE] << "JobQueue - preempting job of priority " << job->priority << std::endl;
+				job->SetJobStatus(JOBSTATUS_PREEMPTED);
+				result=true;
+			}
 		}
-
-		return(JOBSTATUS_UNKNOWN);
+		ReleaseMutex();
+		return(result);
 	}
 
 	// If your jobs need to be deleted from a specific thread,
@@ -194,9 +283,10 @@ class JobQueue : public ThreadCondition
 		while(completed.size())
 		{
 			Job *j=completed.front();
-			completed.remove(j);
+			completed.pop_front();
 			if(j)
 			{
+				j->queuestatus=JOBSTATUS_UNKNOWN;
 				delete j;
 			}
 		}
@@ -208,10 +298,49 @@ class JobQueue : public ThreadCondition
 	{
 		return(waiting.size());
 	}
+
+	// The number of jobs either waiting or running.
+	// NOTE - Must hold the mutex while using this function.
+	virtual int ActiveJobCount()
+	{
+		return(waiting.size()+running.size());
+	}
 	protected:
-	std::list<Job *> waiting;
+	// The number of threads servicing the queue - zero if not known,
+	// in which case running jobs are assumed to occupy every thread.
+	virtual int GetWorkerCount()
+	{
+		return(0);
+	}
+	// Wakes a worker to service a newly-queued job.  Only one is needed, unless
+	// someone else is waiting on the condition for the queue to drain, in which
+	// case a single signal might go to them instead.
+	// Must hold the mutex while using this function.
+	void Wake()
+	{
+		if(drainwaiters)
+			Broadcast();
+		else
+			Signal();
+	}
+	// Must hold the mutex while using this function.
+	void Enqueue(Job *job)
+	{
+		job->SetJobStatus(JOBSTATUS_QUEUED);
+		job->queuestatus=JOBSTATUS_QUEUED;
+		job->queuepos=waiting.insert(std::pair<int,Job *>(job->priority,job));
+		UpdateTopWaiting();
+	}
+	// Must hold the mutex while using this function.
+	void UpdateTopWaiting()
+	{
+		topwaiting=waiting.empty() ? INT_MIN : waiting.begin()->first;
+	}
+	JobQueue_WaitingList waiting;
 	std::list<Job *> running;
 	std::list<Job *> completed;
+	int drainwaiters;	// The number of threads waiting for the queue to empty.
+	std::atomic<int> topwaiting;	// The priority of the first waiting job, so ShouldYield() can usually avoid the mutex.
 };
 
 
@@ -234,55 +363,47 @@ class Worker : public ThreadFunction, public PTMutex
 	}
 	virtual void Cancel()
 	{
+		queue.ObtainMutex();
 		status=WORKERTHREAD_CANCEL;
+		queue.Broadcast();
+		queue.ReleaseMutex();
+	}
+	// Jobs may call this while running to find out whether they should give way to a higher priority job.
+	virtual bool ShouldYield(Job *job)
+	{
+		return(queue.ShouldYield(job));
 	}
+	// Asks the thread to exit once its current job (if any) is finished, and waits for it to do so.
 	virtual void WaitCompletion()
 	{
+		queue.ObtainMutex();
 		if(status==WORKERTHREAD_RUN)
 			status=WORKERTHREAD_TERMINATE;
-		while(!thread.TestFinished())
-		{
-			// We obtain this mutex to avoid a busy wait - the subthread holds it while processing a job.
-			ObtainMutex();
-			queue.ObtainMutex();
-			queue.Broadcast();
-			queue.ReleaseMutex();
-			ReleaseMutex();
-		}
+		queue.Broadcast();
+		queue.ReleaseMutex();
+		if(!thread.TestFinished())
+			thread.WaitFinished();
 	}
 	virtual int Entry(Thread &t)
 	{
 		Debug[TRACE] << "Worker thread running..." << std::endl;
-		do
+
+		// The queue's mutex is held except while a job is being dispatched, so
+		// the status check and the wait can't miss a wakeup.
+		queue.ObtainMutex();
+		while(status==WORKERTHREAD_RUN)
 		{
-//			Debug[TRACE] << "Obtaining mutex" << std::endl;
-			queue.ObtainMutex();
-			while(queue.JobCount()==0)
+			if(queue.JobCount()==0)
 			{
-//				Debug[TRACE] << "Waiting for a job" << std::endl;
 				queue.WaitCondition();
-//				Debug[TRACE] << "Signal received" << std::endl;
-				if(status!=WORKERTHREAD_RUN)
-				{
-//					Debug[TRACE] << "Received cancellation signal" << std::endl;
-					queue.ReleaseMutex();
-					return(0);
-				}
+				continue;
 			}
-//			Debug[TRACE] << "Releasing mutex" << std::endl;
 			queue.ReleaseMutex();
-//			Debug[TRACE] << "Running job" << std::endl;
-
-			// Obtain a per-thread mutex while running the job, so the destructor can avoid a busy-wait.
-			ObtainMutex();
 			queue.Dispatch(this);
-			ReleaseMutex();
-
-			// Send a pulse to say the thread's adopting a new job
 			queue.ObtainMutex();
-			queue.Broadcast();
-			queue.ReleaseMutex();
-		} while(status==WORKERTHREAD_RUN);
+		}
+		queue.ReleaseMutex();
+
 		Debug[TRACE] << "Worker thread cancelled" << std::endl;
 		return(0);
 	}
@@ -320,11 +441,13 @@ class JobDispatcher : public JobQueue
 		Debug[TRACE] << "JobDispatcher - waiting for job completion" << std::endl;
 		ObtainMutex();
 
+		++drainwaiters;
 		while(JobCount())
 		{
 //				Debug[TRACE] << "(" << JobCount() << " jobs remaining...)" << std::endl;
 			WaitCondition();
 		}
+		--drainwaiters;
 		ReleaseMutex();
 
 		std::list<Worker *>::iterator it=threadlist.begin();
@@ -336,9 +459,15 @@ class JobDispatcher : public JobQueue
 	}
 	void AddWorker(Worker *worker)
 	{
+		ObtainMutex();
 		threadlist.push_back(worker);
+		ReleaseMutex();
 	}
 	protected:
+	virtual int GetWorkerCount()
+	{
+		return(threadlist.size());
+	}
 	std::list<Worker *> threadlist;
 	friend class Worker;
 };
@@ -87,7 +87,7 @@ TempFile *TempFile::NextTempFile()
 
 bool TempFile::MatchTempFile(const char *skey)
 {
-	return(strcmp(skey,searchkey)==0);
+	return(searchkey && strcmp(skey,searchkey)==0);
 }
 
 
@@ -127,14 +127,11 @@ TempFile *TempFileTracker::FindTempFile(const char *searchkey)
 	mutex.ObtainMutexShared();
 	TempFile *result=NULL;
 	TempFile *t=FirstTempFile();
-	while(t)
+	while(t && !result)
 	{
-		t=t->NextTempFile();
 		if(t->MatchTempFile(searchkey))
-		{
 			result=t;
-			t=NULL;
-		}
+		t=t->NextTempFile();
 	}
 	mutex.ReleaseMutexShared();
 	return(result);
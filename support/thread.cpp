@@ -124,6 +124,15 @@ ThreadID Thread::GetThreadID()
 #endif
 }
 
+int Thread::GetProcessorCount()
+{
+	int result=g_get_num_processors();
+	if(result<1)
+		result=1;
+	return(result);
+}
+
+
 Thread::Thread(ThreadFunction *threadfunc)
 	: threadfunc(threadfunc), state(THREAD_IDLE)
 {
@@ -146,6 +155,11 @@ void ThreadCondition::Broadcast()
 	pthread_cond_broadcast(&cond);
 }
 
+void ThreadCondition::Signal()
+{
+	pthread_cond_signal(&cond);
+}
+
 void ThreadCondition::WaitCondition()
 {
 	pthread_cond_wait(&cond,&mutex);
@@ -13,6 +13,7 @@ class ThreadCondition : public PTMutex
 	ThreadCondition();
 	~ThreadCondition();
 	virtual void Broadcast();		// Sends the signal - Mutex should be obtained first and released afterwards
+	virtual void Signal();			// As Broadcast, but wakes only one waiting thread
 	virtual void WaitCondition();	// Waits for the signal - mutex should be obtained first and released afterwards
 	protected:
 	pthread_cond_t cond;
@@ -72,8 +73,9 @@ class Thread
 	// Methods to be used from within threads
 	void SendSync();	// Safe to use bi-directionally.
 	bool TestBreak();
-	// Static function - can be called anywhere
+	// Static functions - can be called anywhere
 	static ThreadID GetThreadID();
+	static int GetProcessorCount();
 	protected:
 	static void *LaunchStub(void *ud);
 	ThreadFunction *threadfunc;